@@ -0,0 +1,102 @@
+// TLS handshake rate with and without session resumption.
+//
+// Starts an HTTPS server with ssl_cert.pem and lets 'openssl s_time' fetch a
+// tiny page over and over, each time on a new connection: with full
+// handshakes only, with resumption disabled on the server, and with sessions
+// resumed from the server-side cache or from session tickets. Run it from the
+// examples directory:
+//
+//   ./ssl_bench [seconds_per_run]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "mongoose.h"
+
+#define PORT "18443"
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *callback(enum mg_event event, struct mg_connection *conn) {
+  if (event == MG_NEW_REQUEST) {
+    mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nContent-Type: text/plain\r\n\r\n");
+    mg_mark_end_of_header_transmission(conn);
+    mg_printf(conn, "ok");
+    return "";
+  }
+  return NULL;
+}
+
+static void run(const char *title, const char **options, const char *s_time_mode, int seconds) {
+  struct mg_ssl_session_stats before, after;
+  const struct mg_user_class_t ucb = {
+    NULL,      // Arbitrary user-defined data
+    callback   // User-defined callback function
+  };
+  struct mg_context *ctx;
+  char cmd[256];
+  double start, elapsed;
+  long handshakes;
+
+  if ((ctx = mg_start(&ucb, options)) == NULL ||
+      mg_get_ssl_session_stats(ctx, &before) != 0) {
+    fprintf(stderr, "Cannot start the HTTPS server; is ssl_cert.pem in the current directory?\n");
+    exit(EXIT_FAILURE);
+  }
+
+  snprintf(cmd, sizeof(cmd),
+           "openssl s_time -connect 127.0.0.1:" PORT " -tls1_2 -www / %s -time %d > /dev/null 2>&1",
+           s_time_mode, seconds);
+  // mg_start() ignores SIGCHLD, so system() cannot tell how s_time exited;
+  // the handshake counters tell instead.
+  start = now();
+  (void) system(cmd);
+  elapsed = now() - start;
+
+  mg_get_ssl_session_stats(ctx, &after);
+  mg_stop(ctx);
+
+  handshakes = after.handshakes - before.handshakes;
+  if (handshakes == 0) {
+    fprintf(stderr, "'%s' did not connect; is openssl in the PATH?\n", cmd);
+    exit(EXIT_FAILURE);
+  }
+  printf("%-40s %7ld handshakes %8.1f/s  (resumed: %ld, cache misses: %ld)\n",
+         title, handshakes, handshakes / elapsed,
+         after.hits - before.hits, after.misses - before.misses);
+}
+
+int main(int argc, char *argv[]) {
+  int seconds = argc > 1 ? atoi(argv[1]) : 5;
+  const char *no_resumption[] = {
+    "listening_ports", PORT "s",
+    "ssl_certificate", "ssl_cert.pem",
+    "ssl_session_cache_size", "0",
+    "ssl_session_tickets", "no",
+    NULL
+  };
+  const char *session_cache[] = {
+    "listening_ports", PORT "s",
+    "ssl_certificate", "ssl_cert.pem",
+    "ssl_session_tickets", "no",
+    NULL
+  };
+  const char *session_tickets[] = {
+    "listening_ports", PORT "s",
+    "ssl_certificate", "ssl_cert.pem",
+    "ssl_session_cache_size", "0",
+    NULL
+  };
+
+  run("full handshakes", session_tickets, "-new", seconds);
+  run("resumption disabled on the server", no_resumption, "-reuse", seconds);
+  run("resumed from the session cache", session_cache, "-reuse", seconds);
+  run("resumed from session tickets", session_tickets, "-reuse", seconds);
+
+  return EXIT_SUCCESS;
+}
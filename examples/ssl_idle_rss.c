@@ -0,0 +1,101 @@
+// Server memory held by idle TLS keep-alive connections (Linux only).
+//
+// Starts an HTTPS server with ssl_cert.pem, lets a number of 'openssl
+// s_client' processes each fetch a tiny page and then keep their connection
+// open, and reports how much the resident set size of the server grew per
+// connection. Build it once more with SSL_MODE_RELEASE_BUFFERS taken out of
+// set_ssl_option() to see what handing back the TLS record buffers of idle
+// connections saves. Run it from the examples directory:
+//
+//   ./ssl_idle_rss [connections]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mongoose.h"
+
+#define PORT "18444"
+
+static void *callback(enum mg_event event, struct mg_connection *conn) {
+  if (event == MG_NEW_REQUEST) {
+    // a response head written by mg_write_http_response_head() keeps the
+    // connection alive
+    mg_add_response_header(conn, 0, "Content-Length", "2");
+    mg_add_response_header(conn, 0, "Content-Type", "text/plain");
+    mg_write_http_response_head(conn, 200, NULL);
+    mg_printf(conn, "ok");
+    return "";
+  }
+  return NULL;
+}
+
+// Return the resident set size of this process in KB, or -1.
+static long rss_kb(void) {
+  long pages, resident;
+  FILE *fp = fopen("/proc/self/statm", "r");
+
+  if (fp == NULL)
+    return -1;
+  if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+    resident = -1;
+  fclose(fp);
+  return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(int argc, char *argv[]) {
+  int i, n = argc > 1 ? atoi(argv[1]) : 100;
+  const char *options[] = {
+    "listening_ports", PORT "s",
+    "ssl_certificate", "ssl_cert.pem",
+    "keep_alive_timeout", "60",
+    NULL
+  };
+  const struct mg_user_class_t ucb = {
+    NULL,      // Arbitrary user-defined data
+    callback   // User-defined callback function
+  };
+  struct mg_ssl_session_stats stats;
+  struct mg_context *ctx;
+  FILE **clients;
+  long before, after;
+
+  if (n <= 0 || (clients = calloc(n, sizeof(*clients))) == NULL) {
+    fprintf(stderr, "Usage: %s [connections]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if ((ctx = mg_start(&ucb, options)) == NULL) {
+    fprintf(stderr, "Cannot start the HTTPS server; is ssl_cert.pem in the current directory?\n");
+    return EXIT_FAILURE;
+  }
+
+  // one connection first, so that the one-off TLS setup is not counted
+  (void) system("echo | openssl s_client -connect 127.0.0.1:" PORT " -quiet -no_ign_eof > /dev/null 2>&1");
+  sleep(1);
+  before = rss_kb();
+
+  for (i = 0; i < n; i++) {
+    clients[i] = popen("openssl s_client -connect 127.0.0.1:" PORT " -quiet -no_ign_eof > /dev/null 2>&1", "w");
+    if (clients[i] == NULL) {
+      fprintf(stderr, "Cannot run openssl; is it in the PATH?\n");
+      return EXIT_FAILURE;
+    }
+    fprintf(clients[i], "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    fflush(clients[i]);
+  }
+  // let all handshakes and requests complete, then go idle
+  sleep(5);
+  after = rss_kb();
+
+  mg_get_ssl_session_stats(ctx, &stats);
+  printf("%d idle TLS connections (%ld handshakes): server RSS %ld KB -> %ld KB, %+.1f KB per connection\n",
+         n, stats.handshakes - 1, before, after, (after - before) / (double) n);
+
+  // mg_start() ignores SIGCHLD, so pclose() cannot reap the clients' status
+  for (i = 0; i < n; i++)
+    (void) pclose(clients[i]);
+  free(clients);
+  mg_stop(ctx);
+
+  return EXIT_SUCCESS;
+}
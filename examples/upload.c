@@ -20,81 +20,80 @@ static const char *html_form =
  
 static const char *HTTP_500 = "HTTP/1.0 500 Server Error\r\n\r\n";
 
-static void handle_file_upload(struct mg_connection *conn) {
-  const char *cl_header;
-  char post_data[16 * 1024], path[999], file_name[1024], mime_type[100],
-       buf[BUFSIZ], *eop, *s, *p;
+struct upload {
   FILE *fp;
-  long long int cl, written;
-  int fd, n, post_data_len;
+  char path[999];
+  long long int written;
+  int done;
+};
 
-  // Figure out total content length. Return if it is not present or invalid.
-  cl_header = mg_get_header(conn, "Content-Length");
-  if (cl_header == NULL || (cl = strtoll(cl_header, NULL, 10)) <= 0) {
-    mg_printf(conn, "%s%s", HTTP_500, "Invalid Conent-Length");
-    return;
-  }
+// Called by the multipart parser for each part of the uploaded form.
+static int handle_part(struct mg_multipart *mp, enum mg_multipart_event event,
+                       const char *data, size_t len) {
+  struct upload *up = (struct upload *) mg_get_multipart_user_data(mp);
+  const char *name, *file_name, *s;
+  int fd;
 
-  // Read the initial chunk into memory. This should be multipart POST data.
-  // Parse headers, where we should find file name and content-type.
-  post_data_len = mg_read(conn, post_data, sizeof(post_data));
-  file_name[0] = mime_type[0] = '\0';
-  for (s = p = post_data; p < &post_data[post_data_len]; p++) {
-    if (p[0] == '\r' && p[1] == '\n') {
-      if (s == p) {
-        p += 2;
-        break;  // End of headers
+  switch (event) {
+  case MG_MULTIPART_PART_BEGIN:
+    mg_get_multipart_names(mp, &name, &file_name);
+    if (up->fp != NULL || file_name == NULL || file_name[0] == '\0') {
+      return 0;  // Not the (first) file: ignore this part
+    }
+    // Construct destination file name. Write to /tmp, do not allow
+    // paths that contain slashes.
+    if ((s = strrchr(file_name, '/')) == NULL) {
+      s = file_name;
+    } else {
+      s++;
+    }
+    snprintf(up->path, sizeof(up->path), "/tmp/%s", s);
+    // We're opening the file with exclusive lock held. This guarantee us that
+    // there is no other thread can save into the same file simultaneously.
+    if ((fd = open(up->path, O_CREAT | O_TRUNC |
+                   O_WRONLY | O_EXLOCK | O_CLOEXEC, 0644)) < 0) {
+      return -1;
+    } else if ((up->fp = fdopen(fd, "w")) == NULL) {
+      close(fd);
+      return -1;
+    }
+    break;
+  case MG_MULTIPART_PART_DATA:
+    if (up->fp != NULL && !up->done) {
+      if (fwrite(data, 1, len, up->fp) != len) {
+        return -1;
       }
-      p[0] = p[1] = '\0';
-      sscanf(s, "Content-Type: %99s", mime_type);
-      // TODO(lsm): don't expect filename to be the 3rd field,
-      // parse the header properly instead.
-      sscanf(s, "Content-Disposition: %*s %*s filename=\"%1023[^\"]",
-             file_name);
-      s = p + 2;
+      up->written += len;
     }
+    break;
+  case MG_MULTIPART_PART_END:
+    if (up->fp != NULL) {
+      up->done = 1;  // Ignore any other file parts
+    }
+    break;
   }
+  return 0;
+}
 
-  // Finished parsing headers. Now "p" points to the first byte of data.
-  // Calculate file size
-  cl -= p - post_data;      // Subtract headers size
-  cl -= strlen(post_data);  // Subtract the boundary marker at the end
-  cl -= 6;                  // Subtract "\r\n" before and after boundary
+static void handle_file_upload(struct mg_connection *conn) {
+  struct upload up;
+  int rv;
 
-  // Construct destination file name. Write to /tmp, do not allow
-  // paths that contain slashes.
-  if ((s = strrchr(file_name, '/')) == NULL) {
-    s = file_name;
+  // The multipart parser is fed the request body piecemeal, so the upload
+  // is streamed to disk and may be of any size.
+  memset(&up, 0, sizeof(up));
+  rv = mg_read_multipart(conn, handle_part, &up);
+  if (up.fp != NULL) {
+    (void) fclose(up.fp);
   }
-  snprintf(path, sizeof(path), "/tmp/%s", s);
 
-  if (file_name[0] == '\0') {
-    mg_printf(conn, "%s%s", HTTP_500, "Can't get file name");
-  } else if (cl <= 0) {
-    mg_printf(conn, "%s%s", HTTP_500, "Empty file");
-  } else if ((fd = open(path, O_CREAT | O_TRUNC |
-                        O_WRONLY | O_EXLOCK | O_CLOEXEC)) < 0) {
-    // We're opening the file with exclusive lock held. This guarantee us that
-    // there is no other thread can save into the same file simultaneously.
-    mg_printf(conn, "%s%s", HTTP_500, "Cannot open file");
-  } else if ((fp = fdopen(fd, "w")) == NULL) {
-    mg_printf(conn, "%s%s", HTTP_500, "Cannot reopen file stream");
-    close(fd);
+  if (up.fp == NULL) {
+    mg_printf(conn, "%s%s", HTTP_500, rv < 0 ? "Invalid upload" : "Can't get file name");
+  } else if (rv < 0) {
+    mg_printf(conn, "%s%s", HTTP_500, "Cannot save file");
   } else {
-    // Success. Write data into the file.
-    eop = post_data + post_data_len;
-    n = p + cl > eop ? (int) (eop - p) : (int) cl;
-    (void) fwrite(p, 1, n, fp);
-    written = n;
-    while (written < cl &&
-           (n = mg_read(conn, buf, cl - written > (long long) sizeof(buf) ?
-                        sizeof(buf) : cl - written)) > 0) {
-      (void) fwrite(buf, 1, n, fp);
-      written += n;
-    }
-    (void) fclose(fp);
     mg_printf(conn, "HTTP/1.0 200 OK\r\n\r\n"
-              "Saved to [%s], written %llu bytes", path, cl);
+              "Saved to [%s], written %lld bytes", up.path, up.written);
   }
 }
 
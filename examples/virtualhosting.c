@@ -422,6 +422,10 @@ Off Topic: one can override other options on a per-connection / request basis
            as well. This applies to all options which' values are fetched by
            mongoose through the internal get_conn_option() call - grep
            mongoose.c for that one if you like.
+
+As this callback only looks at the local IP and the Host header, you can run
+with '-vhost_config_cache yes' to have mongoose call it once per virtual host
+instead of for every option lookup of every request.
 */
 // typedef const char * (*mg_option_get_callback_t)(struct mg_context *ctx, struct mg_connection *conn, const char *name);
 static const char *option_get_callback(struct mg_context *ctx, struct mg_connection *conn, const char *name)
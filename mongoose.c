@@ -28,7 +28,9 @@
 #define PASSWORDS_FILE_NAME             ".htpasswd"
 #define CGI_ENVIRONMENT_SIZE            MG_MAX(MG_BUF_LEN, 4096)
 #define MAX_CGI_ENVIR_VARS              64
-#define MAX_REQUEST_SIZE                16384       // Must be larger than 128 (heuristic lower bound)
+#define DEFAULT_REQUEST_SIZE            16384       // Header buffer size for contexts which have not been set up by mg_start()
+#define DEFAULT_ALLOWED_METHODS         "GET,POST,HEAD,PUT,DELETE,OPTIONS"
+#define MIN_REQUEST_SIZE                1024        // Lower bound for the 'header_buffer_size' option; must be larger than 128 (heuristic lower bound)
 
 
 /* buffer size used when copying data to/from file/socket/... */
@@ -43,6 +45,13 @@
 #define USRDMNPWD_BUFSIZ                512
 
 
+// The buffer size used to copy a request body (PUT, CGI POST) to its destination
+// whenever the zero-copy splice() path cannot be used, i.e. for chunked or SSL
+// uploads and on platforms other than Linux. Also the largest splice() step.
+#ifndef MG_BODY_COPY_BUFSIZ
+#define MG_BODY_COPY_BUFSIZ     MG_MAX(DATA_COPY_BUFSIZ, 65536)
+#endif
+
 // The maximum amount of data we're willing to dump in a single mg_cry() log call.
 // In embedded environments with limited RAM, you may want to override this
 // value as this value determines the malloc() size used inside mg_vasprintf().
@@ -61,12 +70,71 @@
 #define MG_SELECT_TIMEOUT_MSECS_TINY    1
 #endif
 
+// The maximum number of entries of the (128 entry) idle connection queue
+// taken by TLS connections which have not completed their handshake yet,
+// including the ones which have not sent anything yet. When a new one would
+// exceed the limit, the oldest of these is dropped, so stalled handshakes
+// cannot fill up the queue and keep new connections from being accepted.
+#ifndef MG_MAX_QUEUED_HANDSHAKES
+#define MG_MAX_QUEUED_HANDSHAKES    64
+#endif
+
+// The maximum number of jobs waiting in the disk I/O queue (see the
+// disk_io_threads option). Requests which need disk access while the queue
+// is full are answered with '503 Service Unavailable'.
+#ifndef MG_MAX_IO_QUEUE_LEN
+#define MG_MAX_IO_QUEUE_LEN     128
+#endif
+
 // The maximum length of a %[U] or %[U] component in a logfile path template.
 // Should be at larger than 8 to make any sense.
 #ifndef MG_LOGFILE_MAX_URI_COMPONENT_LEN
 #define MG_LOGFILE_MAX_URI_COMPONENT_LEN    64
 #endif
 
+// The buffer size for the headers of a single part of a multipart/form-data
+// upload; see mg_create_multipart_parser().
+#ifndef MG_MULTIPART_HEADER_BUFSIZ
+#define MG_MULTIPART_HEADER_BUFSIZ  2048
+#endif
+
+// The number of seconds a configuration snapshot replaced by mg_reload_options()
+// is kept around after the last connection released it, for the benefit of
+// the context-level readers which do not hold a reference; see publish_config().
+#ifndef MG_CONFIG_RETIRE_GRACE
+#define MG_CONFIG_RETIRE_GRACE      30
+#endif
+
+// The maximum number of virtual host configurations kept when vhost_config_cache
+// is enabled; requests for further hosts are served without the cache.
+#ifndef MG_MAX_VHOST_CONFIGS
+#define MG_MAX_VHOST_CONFIGS        64
+#endif
+
+// The maximum number of parsed passwords files (global_passwords_file,
+// put_delete_passwords_file, protect_uri and per-directory .htpasswd files)
+// kept in memory; further files are parsed for each request.
+#ifndef MG_MAX_PASSWORDS_FILES
+#define MG_MAX_PASSWORDS_FILES      64
+#endif
+
+// The number of seconds a Digest authentication nonce handed out in a 401
+// response is accepted, and the number of nonces which are tracked at once;
+// older nonces are rejected as stale, upon which the client retries with a
+// fresh one. A client address is handed at most one fresh nonce per
+// MG_AUTH_NONCE_MIN_AGE seconds: further 401 responses to it within that
+// time carry the same nonce, so a single client flooding the server cannot
+// evict the nonces of the others.
+#ifndef MG_AUTH_NONCE_TIMEOUT
+#define MG_AUTH_NONCE_TIMEOUT       3600
+#endif
+#ifndef MG_MAX_AUTH_NONCES
+#define MG_MAX_AUTH_NONCES          1024
+#endif
+#ifndef MG_AUTH_NONCE_MIN_AGE
+#define MG_AUTH_NONCE_MIN_AGE       5
+#endif
+
 #if MG_DEBUG_TRACING
 // 'data' exports don't work well for dynamic libs: use accessor function
 unsigned int *mg_trace_level(void) {
@@ -219,6 +287,11 @@ void mg_freea(void *ptr) {
 typedef struct ssl_st SSL;
 typedef struct ssl_method_st SSL_METHOD;
 typedef struct ssl_ctx_st SSL_CTX;
+typedef struct evp_cipher_st EVP_CIPHER;
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+typedef struct env_md_st EVP_MD;
+typedef struct hmac_ctx_st HMAC_CTX;
+typedef struct engine_st ENGINE;
 
 #define SSL_ERROR_NONE              0
 #define SSL_ERROR_SSL               1
@@ -233,6 +306,26 @@ typedef struct ssl_ctx_st SSL_CTX;
 #define SSL_FILETYPE_PEM            1
 #define CRYPTO_LOCK                 1
 
+#define SSL_CTRL_SESS_NUMBER        20
+#define SSL_CTRL_SESS_ACCEPT_GOOD   25
+#define SSL_CTRL_SESS_HIT           27
+#define SSL_CTRL_SESS_MISSES        29
+#define SSL_CTRL_SESS_TIMEOUTS      30
+#define SSL_CTRL_SESS_CACHE_FULL    31
+#define SSL_CTRL_OPTIONS            32
+#define SSL_CTRL_MODE               33
+#define SSL_CTRL_SET_SESS_CACHE_SIZE 42
+#define SSL_CTRL_SET_SESS_CACHE_MODE 44
+#define SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB 72
+#define CRYPTO_EX_INDEX_SSL_CTX     1 // OpenSSL 1.1+
+#define CRYPTO_EX_INDEX_SSL_CTX_1_0 2 // before OpenSSL 1.1
+#define SSL_SESS_CACHE_OFF          0x0000
+#define SSL_SESS_CACHE_SERVER       0x0002
+#define SSL_OP_NO_TICKET            0x00004000L
+#define SSL_MODE_RELEASE_BUFFERS    0x00000010L
+#define OPENSSL_INIT_LOAD_CRYPTO_STRINGS 0x00000002L
+#define OPENSSL_INIT_LOAD_SSL_STRINGS 0x00200000L
+
 #if defined(NO_SSL_DL)
 extern void SSL_free(SSL *);
 extern int SSL_accept(SSL *);
@@ -245,20 +338,63 @@ extern int SSL_get_error(const SSL *, int);
 extern int SSL_set_fd(SSL *, int);
 extern SSL *SSL_new(SSL_CTX *);
 extern SSL_CTX *SSL_CTX_new(SSL_METHOD *);
-extern SSL_METHOD *SSLv23_server_method(void);
-extern SSL_METHOD *SSLv23_client_method(void);
-extern int SSL_library_init(void);
-extern void SSL_load_error_strings(void);
 extern int SSL_CTX_use_PrivateKey_file(SSL_CTX *, const char *, int);
 extern int SSL_CTX_use_certificate_file(SSL_CTX *, const char *, int);
 extern int SSL_CTX_use_certificate_chain_file(SSL_CTX *, const char *);
 extern void SSL_CTX_set_default_passwd_cb(SSL_CTX *, mg_callback_t);
 extern void SSL_CTX_free(SSL_CTX *);
+extern long SSL_CTX_ctrl(SSL_CTX *, int, long, void *);
+extern long SSL_CTX_callback_ctrl(SSL_CTX *, int, void (*)(void));
+extern int SSL_CTX_set_session_id_context(SSL_CTX *, const unsigned char *, unsigned int);
+extern long SSL_CTX_set_timeout(SSL_CTX *, long);
+extern SSL_CTX *SSL_get_SSL_CTX(const SSL *);
+extern int SSL_CTX_set_ex_data(SSL_CTX *, int, void *);
+extern void *SSL_CTX_get_ex_data(const SSL_CTX *, int);
+extern int SSL_pending(const SSL *);
 extern unsigned long ERR_get_error(void);
 extern char *ERR_error_string(unsigned long, char *);
+extern int RAND_bytes(unsigned char *, int);
+extern const EVP_CIPHER *EVP_aes_128_cbc(void);
+extern const EVP_MD *EVP_sha256(void);
+extern int EVP_EncryptInit_ex(EVP_CIPHER_CTX *, const EVP_CIPHER *, ENGINE *,
+                              const unsigned char *, const unsigned char *);
+extern int EVP_DecryptInit_ex(EVP_CIPHER_CTX *, const EVP_CIPHER *, ENGINE *,
+                              const unsigned char *, const unsigned char *);
+extern int HMAC_Init_ex(HMAC_CTX *, const void *, int, const EVP_MD *, ENGINE *);
+extern int CRYPTO_get_ex_new_index(int, long, void *, void *, void *, void *);
+#if defined(OPENSSL_API_1_1)
+extern int OPENSSL_init_ssl(uint64_t, const void *);
+extern SSL_METHOD *TLS_server_method(void);
+extern SSL_METHOD *TLS_client_method(void);
+#if defined(OPENSSL_API_3_0)
+extern uint64_t SSL_CTX_set_options(SSL_CTX *, uint64_t);
+#else
+extern unsigned long SSL_CTX_set_options(SSL_CTX *, unsigned long);
+#endif // OPENSSL_API_3_0
+// Gone since OpenSSL 1.1; never called, see is_legacy_openssl()
+#define SSL_library_init()              ((void) 0)
+#define SSL_load_error_strings()        ((void) 0)
+#define SSLv23_server_method()          NULL
+#define SSLv23_client_method()          NULL
+#define CRYPTO_num_locks()              0
+#define CRYPTO_set_locking_callback(cb) ((void) 0)
+#define CRYPTO_set_id_callback(cb)      ((void) 0)
+#else
+extern int SSL_library_init(void);
+extern void SSL_load_error_strings(void);
+extern SSL_METHOD *SSLv23_server_method(void);
+extern SSL_METHOD *SSLv23_client_method(void);
 extern int CRYPTO_num_locks(void);
 extern void CRYPTO_set_locking_callback(void (*)(int, int, const char *, int));
 extern void CRYPTO_set_id_callback(unsigned long (*)(void));
+// Only exist since OpenSSL 1.1; never called, see is_legacy_openssl()
+#define OPENSSL_init_ssl(opts, settings) 0
+#define TLS_server_method()             NULL
+#define TLS_client_method()             NULL
+#define SSL_CTX_set_options(ctx, op)    0
+#endif // OPENSSL_API_1_1
+// The declaration above has the signature of the OpenSSL linked against
+#define SSL_CTX_set_options_v3          SSL_CTX_set_options
 #else
 // Dynamically loaded SSL functionality
 struct ssl_func {
@@ -277,27 +413,57 @@ struct ssl_func {
 #define SSL_set_fd (* (int (*)(SSL *, SOCKET)) ssl_sw[8].ptr)
 #define SSL_new (* (SSL * (*)(SSL_CTX *)) ssl_sw[9].ptr)
 #define SSL_CTX_new (* (SSL_CTX * (*)(SSL_METHOD *)) ssl_sw[10].ptr)
-#define SSLv23_server_method (* (SSL_METHOD * (*)(void)) ssl_sw[11].ptr)
-#define SSL_library_init (* (int (*)(void)) ssl_sw[12].ptr)
 #define SSL_CTX_use_PrivateKey_file (* (int (*)(SSL_CTX *, \
-        const char *, int)) ssl_sw[13].ptr)
+        const char *, int)) ssl_sw[11].ptr)
 #define SSL_CTX_use_certificate_file (* (int (*)(SSL_CTX *, \
-        const char *, int)) ssl_sw[14].ptr)
+        const char *, int)) ssl_sw[12].ptr)
 #define SSL_CTX_set_default_passwd_cb \
-  (* (void (*)(SSL_CTX *, mg_callback_t)) ssl_sw[15].ptr)
-#define SSL_CTX_free (* (void (*)(SSL_CTX *)) ssl_sw[16].ptr)
-#define SSL_load_error_strings (* (void (*)(void)) ssl_sw[17].ptr)
+  (* (void (*)(SSL_CTX *, mg_callback_t)) ssl_sw[13].ptr)
+#define SSL_CTX_free (* (void (*)(SSL_CTX *)) ssl_sw[14].ptr)
 #define SSL_CTX_use_certificate_chain_file \
-  (* (int (*)(SSL_CTX *, const char *)) ssl_sw[18].ptr)
-#define SSLv23_client_method (* (SSL_METHOD * (*)(void)) ssl_sw[19].ptr)
-
-#define CRYPTO_num_locks (* (int (*)(void)) crypto_sw[0].ptr)
+  (* (int (*)(SSL_CTX *, const char *)) ssl_sw[15].ptr)
+#define SSL_CTX_ctrl (* (long (*)(SSL_CTX *, int, long, void *)) ssl_sw[16].ptr)
+#define SSL_CTX_callback_ctrl \
+  (* (long (*)(SSL_CTX *, int, void (*)(void))) ssl_sw[17].ptr)
+#define SSL_CTX_set_session_id_context (* (int (*)(SSL_CTX *, \
+        const unsigned char *, unsigned int)) ssl_sw[18].ptr)
+#define SSL_CTX_set_timeout (* (long (*)(SSL_CTX *, long)) ssl_sw[19].ptr)
+#define SSL_get_SSL_CTX (* (SSL_CTX * (*)(const SSL *)) ssl_sw[20].ptr)
+#define SSL_CTX_set_ex_data (* (int (*)(SSL_CTX *, int, void *)) ssl_sw[21].ptr)
+#define SSL_CTX_get_ex_data (* (void * (*)(const SSL_CTX *, int)) ssl_sw[22].ptr)
+#define SSL_pending (* (int (*)(const SSL *)) ssl_sw[23].ptr)
+
+#define ERR_get_error (* (unsigned long (*)(void)) crypto_sw[0].ptr)
+#define ERR_error_string (* (char * (*)(unsigned long,char *)) crypto_sw[1].ptr)
+#define RAND_bytes (* (int (*)(unsigned char *, int)) crypto_sw[2].ptr)
+#define EVP_aes_128_cbc (* (const EVP_CIPHER * (*)(void)) crypto_sw[3].ptr)
+#define EVP_sha256 (* (const EVP_MD * (*)(void)) crypto_sw[4].ptr)
+#define EVP_EncryptInit_ex (* (int (*)(EVP_CIPHER_CTX *, const EVP_CIPHER *, \
+        ENGINE *, const unsigned char *, const unsigned char *)) crypto_sw[5].ptr)
+#define EVP_DecryptInit_ex (* (int (*)(EVP_CIPHER_CTX *, const EVP_CIPHER *, \
+        ENGINE *, const unsigned char *, const unsigned char *)) crypto_sw[6].ptr)
+#define HMAC_Init_ex (* (int (*)(HMAC_CTX *, const void *, int, \
+        const EVP_MD *, ENGINE *)) crypto_sw[7].ptr)
+#define CRYPTO_get_ex_new_index (* (int (*)(int, long, void *, \
+        void *, void *, void *)) crypto_sw[8].ptr)
+
+#define SSL_library_init (* (int (*)(void)) ssl_legacy_sw[0].ptr)
+#define SSL_load_error_strings (* (void (*)(void)) ssl_legacy_sw[1].ptr)
+#define SSLv23_server_method (* (SSL_METHOD * (*)(void)) ssl_legacy_sw[2].ptr)
+#define SSLv23_client_method (* (SSL_METHOD * (*)(void)) ssl_legacy_sw[3].ptr)
+
+#define CRYPTO_num_locks (* (int (*)(void)) crypto_legacy_sw[0].ptr)
 #define CRYPTO_set_locking_callback \
-  (* (void (*)(void (*)(int, int, const char *, int))) crypto_sw[1].ptr)
+  (* (void (*)(void (*)(int, int, const char *, int))) crypto_legacy_sw[1].ptr)
 #define CRYPTO_set_id_callback \
-  (* (void (*)(unsigned long (*)(void))) crypto_sw[2].ptr)
-#define ERR_get_error (* (unsigned long (*)(void)) crypto_sw[3].ptr)
-#define ERR_error_string (* (char * (*)(unsigned long,char *)) crypto_sw[4].ptr)
+  (* (void (*)(unsigned long (*)(void))) crypto_legacy_sw[2].ptr)
+
+#define OPENSSL_init_ssl (* (int (*)(uint64_t, const void *)) ssl_modern_sw[0].ptr)
+#define TLS_server_method (* (SSL_METHOD * (*)(void)) ssl_modern_sw[1].ptr)
+#define TLS_client_method (* (SSL_METHOD * (*)(void)) ssl_modern_sw[2].ptr)
+#define SSL_CTX_set_options (* (unsigned long (*)(SSL_CTX *, unsigned long)) ssl_modern_sw[3].ptr)
+// OpenSSL 3.0 widened the options to uint64_t; see is_openssl_3()
+#define SSL_CTX_set_options_v3 (* (uint64_t (*)(SSL_CTX *, uint64_t)) ssl_modern_sw[3].ptr)
 
 // set_ssl_option() function updates this array.
 // It loads SSL library dynamically and changes NULLs to the actual addresses
@@ -315,25 +481,65 @@ static struct ssl_func ssl_sw[] = {
   {"SSL_set_fd",                            NULL},
   {"SSL_new",                               NULL},
   {"SSL_CTX_new",                           NULL},
-  {"SSLv23_server_method",                  NULL},
-  {"SSL_library_init",                      NULL},
   {"SSL_CTX_use_PrivateKey_file",           NULL},
   {"SSL_CTX_use_certificate_file",          NULL},
   {"SSL_CTX_set_default_passwd_cb",         NULL},
   {"SSL_CTX_free",                          NULL},
-  {"SSL_load_error_strings",                NULL},
   {"SSL_CTX_use_certificate_chain_file",    NULL},
-  {"SSLv23_client_method",                  NULL},
+  {"SSL_CTX_ctrl",                          NULL},
+  {"SSL_CTX_callback_ctrl",                 NULL},
+  {"SSL_CTX_set_session_id_context",        NULL},
+  {"SSL_CTX_set_timeout",                   NULL},
+  {"SSL_get_SSL_CTX",                       NULL},
+  {"SSL_CTX_set_ex_data",                   NULL},
+  {"SSL_CTX_get_ex_data",                   NULL},
+  {"SSL_pending",                           NULL},
   {NULL,                                    NULL}
 };
 
 // Similar array as ssl_sw. These functions could be located in different lib.
 static struct ssl_func crypto_sw[] = {
+  {"ERR_get_error",                         NULL},
+  {"ERR_error_string",                      NULL},
+  {"RAND_bytes",                            NULL},
+  {"EVP_aes_128_cbc",                       NULL},
+  {"EVP_sha256",                            NULL},
+  {"EVP_EncryptInit_ex",                    NULL},
+  {"EVP_DecryptInit_ex",                    NULL},
+  {"HMAC_Init_ex",                          NULL},
+  {"CRYPTO_get_ex_new_index",               NULL},
+  {NULL,                                    NULL}
+};
+
+// OpenSSL 1.1 turned these into macros, or dropped them; set_ssl_option()
+// loads either these or ssl_modern_sw[]. See is_legacy_openssl().
+static struct ssl_func ssl_legacy_sw[] = {
+  {"SSL_library_init",                      NULL},
+  {"SSL_load_error_strings",                NULL},
+  {"SSLv23_server_method",                  NULL},
+  {"SSLv23_client_method",                  NULL},
+  {NULL,                                    NULL}
+};
+
+static struct ssl_func crypto_legacy_sw[] = {
   {"CRYPTO_num_locks",                      NULL},
   {"CRYPTO_set_locking_callback",           NULL},
   {"CRYPTO_set_id_callback",                NULL},
-  {"ERR_get_error",                         NULL},
-  {"ERR_error_string",                      NULL},
+  {NULL,                                    NULL}
+};
+
+// The OpenSSL 1.1+ replacements.
+static struct ssl_func ssl_modern_sw[] = {
+  {"OPENSSL_init_ssl",                      NULL},
+  {"TLS_server_method",                     NULL},
+  {"TLS_client_method",                     NULL},
+  {"SSL_CTX_set_options",                   NULL},
+  {NULL,                                    NULL}
+};
+
+// Only exists since OpenSSL 3.0; loaded to tell 3.0+ from 1.1.
+static struct ssl_func ssl_v3_sw[] = {
+  {"SSL_CTX_new_ex",                        NULL},
   {NULL,                                    NULL}
 };
 #endif // NO_SSL_DL
@@ -383,6 +589,7 @@ struct socket {
   struct usa lsa;                 // Local socket address
   struct usa rsa;                 // Remote socket address
   int max_idle_seconds;           // 'keep alive' timeout (used while monitoring the idle queue, used together with the recv()-oriented SO_RCVTIMEO, etc. socket options), 0 is infinity.
+  time_t handshake_deadline;      // Time by which the TLS handshake must have completed; 0 is infinity
   unsigned is_ssl: 1;             // Is socket SSL-ed
   unsigned read_error: 1;         // Receive error occurred on this socket (recv())
   unsigned write_error: 1;        // Write error occurred on this socket (send())
@@ -414,6 +621,7 @@ struct mg_idle_connection {
   unsigned is_inited: 1;
 
   // book-keeping:
+  unsigned in_handshake: 1;         // counted in ctx->num_queued_handshakes while in the queue proper
   int next;                         // next in chain; cyclic linked list!
   int prev;                         // previous in chain; cyclic linked list!
 };
@@ -430,7 +638,10 @@ typedef enum {
   KEEP_ALIVE_TIMEOUT, SOCKET_LINGER_TIMEOUT,
   ACCESS_CONTROL_LIST,
   EXTRA_MIME_TYPES, LISTENING_PORTS, IGNORE_OCCUPIED_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
-  NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES,
+  SSL_SESSION_CACHE_SIZE, SSL_SESSION_TIMEOUT, SSL_SESSION_TICKETS, SSL_TICKET_KEY_LIFETIME,
+  NUM_THREADS, DISK_IO_THREADS, DISK_IO_TIMEOUT, HEADER_BUFFER_SIZE, MAX_HEADER_BUFFER_SIZE,
+  RUN_AS_USER, REWRITE, HIDE_FILES,
+  PRECOMPRESSED_PATTERN, COMPRESS_CONTENT_TYPES, VHOST_CONFIG_CACHE,
   NUM_OPTIONS
 } mg_option_index_t;
 
@@ -459,18 +670,115 @@ static const char *config_options[(NUM_OPTIONS + 1/* sentinel*/) * MG_ENTRIES_PE
   "",  "ignore_occupied_ports",         "no",
   "r", "document_root",                 ".",
   "s", "ssl_certificate",               NULL,
+  "",  "ssl_session_cache_size",        "20480",
+  "",  "ssl_session_timeout",           "300",
+  "",  "ssl_session_tickets",           "yes",
+  "",  "ssl_ticket_key_lifetime",       "3600",
   "t", "num_threads",                   "10",
+  "",  "disk_io_threads",               "0",
+  "",  "disk_io_timeout",               "30",
+  "",  "header_buffer_size",            "16384",
+  "",  "max_header_buffer_size",        "0",
   "u", "run_as_user",                   NULL,
   "w", "url_rewrite_patterns",          NULL,
   "x", "hide_files_patterns",           NULL,
+  "",  "precompressed_pattern",         NULL,
+  "",  "compress_content_types",        NULL,
+  "",  "vhost_config_cache",            "no",
   NULL, NULL, NULL
 };
 
+struct mg_pattern;                      // Compiled pattern; see compile_pattern()
+struct mg_acl;                          // Compiled access control list; see compile_acl()
+struct mg_mime_types;                   // MIME type lookup table; see compile_mime_types()
+struct mg_uri_map;                      // Compiled url_rewrite_patterns or protect_uri; see compile_uri_map()
+
+// Pre-parsed, typed copies of the option values, built at mg_start() so that
+// hot paths need not atoi() or split the option strings over and over again.
+// They only apply when a connection sees the context-wide option value;
+// see is_ctx_option_value().
+struct mg_typed_options {
+  int valid;                            // set by set_typed_options()
+  int num[NUM_OPTIONS];                 // atoi() of each option value
+  unsigned char yes[NUM_OPTIONS];       // 1 when the option value is "yes"
+  struct vec *lists[NUM_OPTIONS];       // the items of the list options; see list_options[]
+  int list_len[NUM_OPTIONS];
+};
+
+// An immutable snapshot of the option values and everything derived from them.
+// Connections bind to the current snapshot at the start of each request (see
+// bind_connection_config()), so mg_reload_options() can publish a new snapshot
+// without pulling the option values out from under an in-flight request.
+struct mg_config {
+  int refcount;                         // number of connections bound to this snapshot; protected by ctx->cfg_mutex
+  int is_vhost;                         // 1 when the user_option_get values have been resolved into this snapshot; see bind_vhost_config()
+  time_t retired;                       // when this snapshot was replaced by another one
+  struct mg_config *next_retired;       // next entry in the ctx->retired_cfgs list
+  char *config[NUM_OPTIONS];            // Mongoose configuration parameters
+  struct mg_pattern *patterns[NUM_OPTIONS]; // Compiled pattern options; see set_pattern_options()
+  struct mg_typed_options typed;        // Pre-parsed option values; see set_typed_options()
+  struct mg_acl *acl;                   // Compiled access_control_list; see set_acl_option()
+  struct mg_mime_types *mime;           // extra_mime_types and builtin_mime_types[] lookup table; see set_mime_option()
+  struct mg_uri_map *rewrite;           // Compiled url_rewrite_patterns; see set_rewrite_option()
+  struct mg_uri_map *protect;           // Compiled protect_uri; see set_protect_option()
+};
+
+// A cached per-virtual-host configuration: the snapshot as seen through the
+// user_option_get callback by the requests for one Host at one listener.
+struct mg_vhost_config {
+  struct mg_vhost_config *next;         // next entry in the ctx->vhosts[] hash chain
+  unsigned int hash;
+  struct mg_config *cfg;                // the resolved options; the cache holds one reference
+  char key[1];                          // "<host>|<local address>:<port>"
+};
+
+struct mg_passwords;                    // A parsed passwords file; see load_passwords()
+
+// A Digest authentication nonce handed out by the server; see new_nonce().
+struct mg_auth_nonce {
+  unsigned long seq;                    // the nonce's sequence number; 0: slot unused
+  time_t issued;
+  unsigned int client;                  // the key of the client it was handed out to; see nonce_client_key()
+  unsigned long max_nc;                 // the highest nonce count seen
+  uint64_t nc_seen;                     // bit i set: nonce count max_nc - i has been seen
+};
+
+// A TLS session ticket encryption key; see ssl_ticket_key_callback().
+struct mg_ssl_ticket_key {
+  unsigned char name[16];               // identifies the key in the tickets it encrypted
+  unsigned char aes_key[16];
+  unsigned char hmac_key[32];
+  time_t created;                       // 0: slot unused
+};
+
+// A cached passwords file.
+struct mg_passwords_file {
+  struct mg_passwords_file *next;       // next entry in the ctx->passwords_files[] hash chain
+  unsigned int hash;
+  struct mg_passwords *pw;              // the cache holds one reference
+  char path[1];
+};
+
 struct mg_context {
   volatile int stop_flag;               // Should we stop event loop
   SSL_CTX *ssl_ctx;                     // SSL context
   SSL_CTX *client_ssl_ctx;              // Client SSL context
-  char *config[NUM_OPTIONS];            // Mongoose configuration parameters
+  struct mg_config *volatile cfg;       // Current configuration snapshot; see publish_config()
+  struct mg_config *retired_cfgs;       // Replaced snapshots waiting to be freed; see collect_retired_configs()
+  pthread_mutex_t cfg_mutex;            // Protects cfg, retired_cfgs and the snapshot reference counts
+  pthread_mutex_t reload_mutex;         // Serializes mg_reload_options() calls
+  struct mg_vhost_config *vhosts[32];   // Cached per-virtual-host configurations; protected by cfg_mutex
+  int num_vhosts;                       // Number of entries in vhosts[]
+  struct mg_passwords_file *passwords_files[32]; // Cached passwords files; protected by passwords_mutex
+  int num_passwords_files;              // Number of entries in passwords_files[]
+  pthread_mutex_t passwords_mutex;      // Protects passwords_files[] and the mg_passwords reference counts
+  struct mg_auth_nonce nonces[MG_MAX_AUTH_NONCES]; // Outstanding Digest nonces, indexed by seq; protected by nonce_mutex
+  unsigned long nonce_seq;              // Sequence number of the last nonce handed out
+  unsigned long client_nonces[MG_MAX_AUTH_NONCES]; // Sequence number of the last nonce handed out per client key hash; protected by nonce_mutex
+  pthread_mutex_t nonce_mutex;          // Protects nonces[], nonce_seq and client_nonces[]
+  struct mg_ssl_ticket_key ticket_keys[2]; // [0]: the current session ticket key, [1]: the key it replaced; protected by ticket_mutex
+  int ticket_key_lifetime;              // Seconds a ticket key is used for new tickets; 0: session tickets are disabled
+  pthread_mutex_t ticket_mutex;         // Protects ticket_keys[]
   struct mg_user_class_t user_functions; // user-defined callbacks and data
 
   struct socket *listening_sockets;
@@ -482,12 +790,56 @@ struct mg_context {
   struct mg_idle_connection queue_store[128]; // Cut down on malloc()/free()ing cost by using a static queue.
   volatile int sq_head;                 // Index to first node of cyclic linked list of 'pushed back' sockets which expect to serve more requests but are currently inactive. '-1' ~ empty!
   int idle_q_store_free_slot;           // index into the idle_queue_store[] where scanning for a free slot should start. Single linked list on '.next'.
+  int num_queued_handshakes;            // Number of TLS connections in their handshake in the idle queue (not counting the test sets pulled by the workers); see MG_MAX_QUEUED_HANDSHAKES
 
   pthread_cond_t sq_full;               // Signaled when socket is produced
   pthread_cond_t sq_empty;              // Signaled when socket is consumed
+
+  int num_io_threads;                   // Number of disk I/O threads; 0: filesystem calls are made by the worker itself
+  int io_timeout;                       // Max number of seconds a worker waits for a disk I/O job; 0 is infinity
+  int io_queue_len;                     // Number of jobs in the disk I/O queue
+  struct mg_io_job *io_head;            // First job in the disk I/O queue
+  struct mg_io_job *io_tail;            // Last job in the disk I/O queue
+  pthread_mutex_t io_mutex;             // Protects the disk I/O queue and job states
+  pthread_cond_t io_queued;             // Signaled when a disk I/O job is queued
+  pthread_cond_t io_done;               // Broadcast when a disk I/O job has completed
+
+  int header_buf_size;                  // Initial size of each connection's RX and TX header buffers
+  int max_header_buf_size;              // Size up to which these buffers may grow for large requests/responses
+};
+
+// Well-known request headers, resolved in O(1) through the header index;
+// see known_header_names[].
+typedef enum {
+  HDR_CONTENT_LENGTH,
+  HDR_TRANSFER_ENCODING,
+  HDR_CONNECTION,
+  HDR_HOST,
+  HDR_RANGE,
+  HDR_IF_NONE_MATCH,
+  HDR_IF_MODIFIED_SINCE,
+  HDR_AUTHORIZATION,
+  HDR_ACCEPT_ENCODING,
+  HDR_COOKIE,
+  HDR_CONTENT_TYPE,
+  HDR_EXPECT,
+
+  HDR_KNOWN_COUNT
+} known_header_t;
+
+#define HEADER_HASH_SIZE  64    // number of hash buckets; must be a power of 2
+
+// Index of the request headers in mg_request_info::http_headers[].
+// All entries are 1 + header index; 0 marks the end of a chain / absence.
+struct mg_header_index {
+  int num_headers;                                // number of headers indexed; -1 when the index must be rebuilt
+  unsigned char known[HDR_KNOWN_COUNT];           // first occurrence of each well-known header
+  unsigned char bucket[HEADER_HASH_SIZE];         // first header with this name hash
+  unsigned char next[ARRAY_SIZE(((struct mg_request_info *) 0)->http_headers)]; // next header in the same hash chain, in request order
 };
 
 struct mg_connection {
+  struct mg_config *cfg;                // The configuration snapshot the current request is bound to; NULL: use ctx->cfg
   unsigned must_close: 1;               // 1 if connection must be closed
   unsigned is_inited: 1;                // 1 when the connection been completely set up (SSL, local and remote peer info, ...)
   unsigned is_client_conn: 2;           // 0 when the connection is a server-side connection (responding to requests); 1: client connection (sending requests); 2: peer-to-peer connection (non-HTTP)
@@ -498,8 +850,12 @@ struct mg_connection {
   unsigned rx_chunk_header_parsed: 2;   // 1 when the current chunk's header has already been (received and) parsed, 2 when header reception/parsing is in progress, 3 when header was parsed and is now processed
   unsigned tx_can_compact_hdrstore: 2;  // signal whether a TX header store 'compact' operation would have any effect at all; 1: regular compact; 2: always pull the request uri and query string into the tx buffer space for persistence
   unsigned nested_err_or_pagereq_count: 2; // 1 when we're requesting an error/'nested' page; > 1 when the page request is failing (nested errors)
+  unsigned tx_no_compression: 1;        // 1 when the current response must not be compressed on the fly (static files, byte ranges)
+  unsigned auth_nonce_stale: 1;         // 1 when the request's Digest response is correct, but for an unknown, expired or replayed nonce
+  unsigned long auth_nonce_seq;         // sequence number of the request's Digest nonce when it is outstanding; 0: none
 
   struct mg_request_info request_info;
+  struct mg_header_index hdr_index;     // lazily built index of request_info.http_headers[]
   struct mg_context *ctx;
   SSL *ssl;                             // SSL descriptor
   struct socket client;                 // Connected client
@@ -508,7 +864,7 @@ struct mg_connection {
   int64_t num_bytes_sent;               // Total bytes sent to client; negative number is the amount of header bytes sent; positive number is the amount of data bytes
   int64_t content_len;                  // received Content-Length header value or chunk size; INT64_MAX means fetch as much as you can, mg_read() will act like a single pull(); -1 means we'd have to fetch (and decode) the (HTTP) headers first
   int64_t consumed_content;             // How many bytes of content have already been read
-  char *buf;                            // Buffer for received data [buf_size] / chunk header reception [CHUNK_HEADER_BUFSIZ] / headers to transmit [buf_size]
+  char *buf;                            // Buffer for received data [buf_size] / chunk header reception [CHUNK_HEADER_BUFSIZ] / headers to transmit [buf_size]; allocated with the connection, or on the heap after grow_header_buffer()
   //char *body;                           // Pointer to not-read yet buffered body data
   //char *next_request;                   // Pointer to the buffered next request
   int buf_size;                         // Buffer size for received data + chunk header reception
@@ -526,6 +882,11 @@ struct mg_connection {
   int tx_chunk_count;                   // The number of chunks transmitted so far.
   int rx_chunk_count;                   // The number of chunks received so far.
 
+  struct mg_io_job *io_job;             // Disk I/O job slot (lazily allocated when the disk I/O pool is used)
+  int disk_io_status;                   // 503 or 504 when a disk I/O job for the current request failed to complete; 0 otherwise
+
+  struct mg_tx_compressor *tx_compressor; // gzip stream state for compressed responses (lazily allocated, reused for kept-alive requests)
+
   char error_logfile_path[PATH_MAX+1];  // cached value: path to the error logfile designated to this connection/CTX
   char access_logfile_path[PATH_MAX+1]; // cached value: path to the access logfile designated to this connection/CTX
 };
@@ -615,31 +976,62 @@ static int get_option_index(const char *name) {
   return -1;
 }
 
+// Return the current configuration snapshot of the context, or NULL when
+// the context has not been set up by mg_start().
+//
+// The caller holds no reference to the snapshot: it relies on a replaced
+// snapshot staying around for MG_CONFIG_RETIRE_GRACE seconds, which is ample
+// for the short-lived, context-level lookups done this way. Connections use
+// their bound snapshot instead (see conn_config()), and the master thread
+// takes a reference for each accepted connection (see acquire_config()).
+static struct mg_config *ctx_config(const struct mg_context *ctx) {
+  return (ctx != NULL ? ctx->cfg : NULL);
+}
+
+// Return the configuration snapshot the connection is bound to, or the
+// current context snapshot when the connection is not bound to one.
+static struct mg_config *conn_config(const struct mg_connection *conn) {
+  if (conn == NULL)
+    return NULL;
+  if (conn->cfg != NULL)
+    return conn->cfg;
+  return ctx_config(conn->ctx);
+}
+
+static const char *config_value(const struct mg_config *cfg, int index) {
+  if (cfg == NULL || cfg->config[index] == NULL)
+    return "";
+  return cfg->config[index];
+}
+
+// The returned value lives in the current snapshot without holding a
+// reference to it; see ctx_config().
 const char *mg_get_option(struct mg_context *ctx, const char *name) {
   const char *rv = call_user_option_get(ctx, name);
   if (!rv) {
     int i = get_option_index(name);
     if (i == -1) {
       return NULL;
-    } else if (ctx == NULL || ctx->config[i] == NULL) {
-      return "";
     } else {
-      return ctx->config[i];
+      return config_value(ctx_config(ctx), i);
     }
   }
   return rv;
 }
 
 const char *mg_get_conn_option(struct mg_connection *conn, const char *name) {
-  const char *rv = call_user_conn_option_get(conn, name);
+  struct mg_config *cfg = conn_config(conn);
+  int i = get_option_index(name);
+  const char *rv = NULL;
+
+  // a virtual host snapshot already holds the callback's values
+  if (i == -1 || cfg == NULL || !cfg->is_vhost)
+    rv = call_user_conn_option_get(conn, name);
   if (!rv) {
-    int i = get_option_index(name);
     if (i == -1) {
       return NULL;
-    } else if (conn == NULL || conn->ctx == NULL || conn->ctx->config[i] == NULL) {
-      return "";
     } else {
-      return conn->ctx->config[i];
+      return config_value(cfg, i);
     }
   }
   return rv;
@@ -652,30 +1044,94 @@ const char *mg_get_option_long_name(const char *name) {
   return NULL;
 }
 
-static const char *get_option(struct mg_context *ctx, mg_option_index_t index) {
+// Return the option value as seen through the snapshot 'cfg'.
+static const char *get_cfg_option(struct mg_context *ctx, const struct mg_config *cfg,
+                                  mg_option_index_t index) {
   const char *rv;
   MG_ASSERT((int)index >= 0 && (int)index < NUM_OPTIONS);
   rv = call_user_option_get(ctx, config_options[index * MG_ENTRIES_PER_CONFIG_OPTION + 1]);
   if (rv)
     return rv;
 
-  if (ctx == NULL || ctx->config[index] == NULL)
-    return "";
-  else
-    return ctx->config[index];
+  return config_value(cfg, index);
+}
+
+static const char *get_option(struct mg_context *ctx, mg_option_index_t index) {
+  return get_cfg_option(ctx, ctx_config(ctx), index);
 }
 
 static const char *get_conn_option(struct mg_connection *conn, mg_option_index_t index) {
+  struct mg_config *cfg = conn_config(conn);
   const char *rv;
   MG_ASSERT((int)index >= 0 && (int)index < NUM_OPTIONS);
-  rv = call_user_conn_option_get(conn, config_options[index * MG_ENTRIES_PER_CONFIG_OPTION + 1]);
-  if (rv)
-    return rv;
+  if (cfg == NULL || !cfg->is_vhost) {
+    rv = call_user_conn_option_get(conn, config_options[index * MG_ENTRIES_PER_CONFIG_OPTION + 1]);
+    if (rv)
+      return rv;
+  }
 
-  if (conn == NULL || conn->ctx == NULL || conn->ctx->config[index] == NULL)
-    return "";
-  else
-    return conn->ctx->config[index];
+  return config_value(cfg, index);
+}
+
+// Return 1 when 'value' is the snapshot value of the option, i.e. it has
+// not been overridden by the user_option_get callback, so that the
+// pre-parsed cfg->typed values apply to it.
+static int is_config_option_value(const struct mg_config *cfg, mg_option_index_t index,
+                                  const char *value) {
+  return cfg != NULL && cfg->typed.valid &&
+    (value == cfg->config[index] || (cfg->config[index] == NULL && *value == '\0'));
+}
+
+// Return the integer value of an option as seen through the snapshot 'cfg'.
+static int get_cfg_int_option(struct mg_context *ctx, const struct mg_config *cfg,
+                              mg_option_index_t index) {
+  const char *value = get_cfg_option(ctx, cfg, index);
+
+  return is_config_option_value(cfg, index, value) ? cfg->typed.num[index] : atoi(value);
+}
+
+static int get_conn_int_option(struct mg_connection *conn, mg_option_index_t index) {
+  struct mg_config *cfg = conn_config(conn);
+  const char *value = get_conn_option(conn, index);
+
+  return is_config_option_value(cfg, index, value) ? cfg->typed.num[index] : atoi(value);
+}
+
+// Return 1 when a boolean option is set to "yes".
+static int get_conn_bool_option(struct mg_connection *conn, mg_option_index_t index) {
+  struct mg_config *cfg = conn_config(conn);
+  const char *value = get_conn_option(conn, index);
+
+  return is_config_option_value(cfg, index, value) ? cfg->typed.yes[index] : !mg_strcasecmp(value, "yes");
+}
+
+static const char *next_option(const char *list, struct vec *val,
+                               struct vec *eq_val);
+
+// Walk the items of a comma-separated list option. Before the first call,
+// set *list to NULL and *pos to 0.
+//
+// Return 1 when the next item has been stored in 'item', 0 at the end of the list.
+static int next_conn_list_item(struct mg_connection *conn, mg_option_index_t index,
+                               const char **list, int *pos, struct vec *item) {
+  const struct mg_typed_options *to;
+
+  if (*list == NULL && *pos == 0) {
+    *list = get_conn_option(conn, index);
+    if (!is_config_option_value(conn_config(conn), index, *list)) {
+      *pos = -1;
+      if (index == ALLOWED_METHODS && is_empty(*list))
+        *list = DEFAULT_ALLOWED_METHODS;
+    }
+  }
+  if (*pos < 0)
+    return (*list = next_option(*list, item, NULL)) != NULL;
+
+  to = &conn_config(conn)->typed;
+  if (*pos >= to->list_len[index])
+    return 0;
+  *item = to->lists[index][(*pos)++];
+  return 1;
 }
 
 // ntop()/ntoa() replacement for IPv6 + IPv4 support:
@@ -1542,6 +1998,15 @@ static char *skip_allws(char *str) {
 static const char *rfc2616_token_charset = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789~`!#$%^&*_-+'.|";
 static const char *rfc2616_nonws_separator_charset = "@()={}[]:;,<>?/\\"; // plus <">, SP, HT
 
+// rfc2616_token_charset as a lookup table, for the single-pass header parser
+static const unsigned char rfc2616_token_map[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+  // 128..255: all zero
+};
+
 // Return 0 on success, -1 on failure.
 int mg_unquote_header_value(char *str, char *sentinel, char **end_ref) {
   char *p, *te;
@@ -1878,8 +2343,95 @@ static const char *get_header(const struct mg_header *headers, int num_headers,
   return NULL;
 }
 
+static const struct {
+  const char *name;
+  size_t len;
+} known_header_names[HDR_KNOWN_COUNT] = {
+  {"Content-Length", 14},
+  {"Transfer-Encoding", 17},
+  {"Connection", 10},
+  {"Host", 4},
+  {"Range", 5},
+  {"If-None-Match", 13},
+  {"If-Modified-Since", 17},
+  {"Authorization", 13},
+  {"Accept-Encoding", 15},
+  {"Cookie", 6},
+  {"Content-Type", 12},
+  {"Expect", 6}
+};
+
+// Case-insensitive hash of a header name. Folding with 0x20 also merges
+// a few non-letter pairs; those are told apart by the name comparison.
+static unsigned int header_name_hash(const char *name) {
+  unsigned int h = 0;
+
+  while (*name)
+    h = h * 31 + (* (const unsigned char *) name++ | 0x20);
+  return h & (HEADER_HASH_SIZE - 1);
+}
+
+// Force a rebuild of the header index on next use; call this whenever
+// request_info.http_headers[] has been (re)filled.
+static void invalidate_header_index(struct mg_connection *conn) {
+  conn->hdr_index.num_headers = -1;
+}
+
+static void build_header_index(struct mg_connection *conn) {
+  struct mg_header_index *idx = &conn->hdr_index;
+  const struct mg_request_info *ri = &conn->request_info;
+  int i, k;
+
+  memset(idx->known, 0, sizeof(idx->known));
+  memset(idx->bucket, 0, sizeof(idx->bucket));
+  // walk backwards so that each chain lists its headers in request order:
+  for (i = MG_MIN(ri->num_headers, (int) ARRAY_SIZE(ri->http_headers)); i-- > 0; ) {
+    const char *name = ri->http_headers[i].name;
+    unsigned int h;
+    size_t len;
+
+    idx->next[i] = 0;
+    if (name == NULL)
+      continue;
+    h = header_name_hash(name);
+    idx->next[i] = idx->bucket[h];
+    idx->bucket[h] = (unsigned char) (i + 1);
+
+    len = strlen(name);
+    for (k = 0; k < HDR_KNOWN_COUNT; k++) {
+      if (known_header_names[k].len == len &&
+          !mg_strcasecmp(name, known_header_names[k].name)) {
+        idx->known[k] = (unsigned char) (i + 1);
+        break;
+      }
+    }
+  }
+  idx->num_headers = ri->num_headers;
+}
+
+static const struct mg_header_index *get_header_index(const struct mg_connection *conn) {
+  if (conn->hdr_index.num_headers != conn->request_info.num_headers)
+    build_header_index((struct mg_connection *) conn);
+  return &conn->hdr_index;
+}
+
+// Return the value of a well-known request header, or NULL if not present.
+static const char *get_known_header(const struct mg_connection *conn, known_header_t id) {
+  int i = get_header_index(conn)->known[id];
+
+  return (i ? conn->request_info.http_headers[i - 1].value : NULL);
+}
+
 const char *mg_get_header(const struct mg_connection *conn, const char *name) {
-  return get_header(conn->request_info.http_headers, conn->request_info.num_headers, name);
+  const struct mg_header_index *idx = get_header_index(conn);
+  const struct mg_header *headers = conn->request_info.http_headers;
+  int i;
+
+  for (i = idx->bucket[header_name_hash(name)]; i; i = idx->next[i - 1]) {
+    if (!mg_strcasecmp(name, headers[i - 1].name))
+      return headers[i - 1].value;
+  }
+  return NULL;
 }
 
 // A helper function for traversing a comma separated list of values.
@@ -1927,45 +2479,327 @@ static const char *next_option(const char *list, struct vec *val,
   return list;
 }
 
-static int match_string(const char *pattern, int pattern_len, const char *str) {
-  const char *or_str;
-  int i, j, len, res;
+// Patterns ('cgi_pattern', 'hide_files_patterns', ...) are compiled per
+// '|'-separated alternative. The common 'literal[$]', 'literal*', 'literal**'
+// and '**literal$' alternatives are matched directly; any other alternative
+// becomes a small program for a Pike VM, which tracks all candidate
+// positions in the pattern at once rather than backtracking, so that
+// matching takes O(strlen(str) * pattern_len) time at most. Wildcards are
+// greedy: the result equals that of the classic backtracking matcher.
+typedef enum {
+  PAT_CHAR,                     // the literal character 'c'
+  PAT_ANY,                      // '?': any character
+  PAT_STAR,                     // '*': zero or more characters other than '/'
+  PAT_STAR_ALL,                 // '**': zero or more characters
+  PAT_EOS,                      // '$': end of string; match
+  PAT_MATCH                     // end of pattern; match
+} pattern_op_t;
+
+struct pattern_insn {
+  unsigned char op;             // pattern_op_t
+  char c;
+};
 
-  if (pattern_len == -1)
-    pattern_len = (int)strlen(pattern);
-  if ((or_str = (const char *) memchr(pattern, '|', pattern_len)) != NULL) {
-    res = match_string(pattern, or_str - pattern, str);
-    return res > 0 ? res :
-           match_string(or_str + 1, (pattern + pattern_len) - (or_str + 1), str);
+typedef enum {
+  PAT_KIND_LITERAL,             // 'literal', 'literal$', 'literal*' or 'literal**'
+  PAT_KIND_SUFFIX,              // '**literal$'
+  PAT_KIND_PROGRAM              // anything else: run the instructions
+} pattern_kind_t;
+
+struct pattern_alt {
+  pattern_kind_t kind;
+  const char *lit;              // the literal, for PAT_KIND_LITERAL and PAT_KIND_SUFFIX
+  int lit_len;
+  int anchored;                 // PAT_KIND_LITERAL: the literal is followed by '$'
+  pattern_op_t tail;            // PAT_KIND_LITERAL: PAT_MATCH, or the trailing PAT_STAR / PAT_STAR_ALL
+  int first_insn;               // PAT_KIND_PROGRAM: the instructions
+  int num_insns;
+};
+
+struct mg_pattern {
+  int num_alts;
+  struct pattern_alt *alts;
+  struct pattern_insn *insns;
+  int suffix_filter;            // all alternatives are '**literal$': check suffix_bytes[] first
+  unsigned char suffix_bytes[32]; // bitmap of the last characters of these literals
+  char src[1];                  // the pattern source; the literals point in here
+};
+
+// Number of program instructions for which match_string() and the Pike VM
+// need no heap memory.
+#define PATTERN_STACK_INSNS  64
+
+// Compile the pattern alternative p[0..len), with room for len + 1
+// instructions at 'insns' (which are only used for PAT_KIND_PROGRAM).
+static void compile_pattern_alt(struct pattern_alt *alt, const char *p, int len,
+                                struct pattern_insn *insns) {
+  const char *dollar = (const char *) memchr(p, '$', len);
+  int i, n, wild;
+
+  memset(alt, 0, sizeof(*alt));
+  alt->tail = PAT_MATCH;
+  if (dollar != NULL) {
+    // anything beyond the '$' is never looked at:
+    len = (int) (dollar - p);
+    alt->anchored = 1;
+  }
+  for (wild = 0; wild < len && p[wild] != '?' && p[wild] != '*'; wild++)
+    ;
+
+  if (wild == len ||
+      (!alt->anchored && p[wild] == '*' && (len - wild == 1 ||
+                                            (len - wild == 2 && p[wild + 1] == '*')))) {
+    alt->kind = PAT_KIND_LITERAL;
+    alt->lit = p;
+    alt->lit_len = wild;
+    if (wild < len)
+      alt->tail = (len - wild == 1 ? PAT_STAR : PAT_STAR_ALL);
+    return;
+  }
+  if (alt->anchored && len >= 2 && p[0] == '*' && p[1] == '*' &&
+      (int) strcspn(p + 2, "?*") >= len - 2) {
+    alt->kind = PAT_KIND_SUFFIX;
+    alt->lit = p + 2;
+    alt->lit_len = len - 2;
+    return;
   }
 
-  i = j = 0;
-  res = -1;
-  for (; i < pattern_len; i++, j++) {
-    if (pattern[i] == '?' && str[j] != '\0') {
-      continue;
-    } else if (pattern[i] == '$') {
-      return str[j] == '\0' ? j : -1;
-    } else if (pattern[i] == '*') {
+  alt->kind = PAT_KIND_PROGRAM;
+  for (i = n = 0; i < len; i++, n++) {
+    insns[n].c = 0;
+    if (p[i] == '?') {
+      insns[n].op = PAT_ANY;
+    } else if (p[i] != '*') {
+      insns[n].op = PAT_CHAR;
+      insns[n].c = p[i];
+    } else if (i + 1 < len && p[i + 1] == '*') {
+      insns[n].op = PAT_STAR_ALL;
       i++;
-      if (pattern[i] == '*') {
-        i++;
-        len = (int)strlen(str + j);
-      } else {
-        len = (int)strcspn(str + j, "/");
-      }
-      if (i == pattern_len) {
-        return j + len;
+    } else {
+      insns[n].op = PAT_STAR;
+    }
+  }
+  insns[n].op = (alt->anchored ? PAT_EOS : PAT_MATCH);
+  insns[n].c = 0;
+  alt->num_insns = n + 1;
+}
+
+// Add the thread at 'pc', and the threads reachable from it without
+// consuming a character, to the list, unless already present.
+static void add_pattern_thread(const struct pattern_insn *prog, int pc, int *list,
+                               int *count, int *mark, int generation) {
+  while (mark[pc] != generation) {
+    mark[pc] = generation;
+    list[(*count)++] = pc;
+    if (prog[pc].op != PAT_STAR && prog[pc].op != PAT_STAR_ALL)
+      break;
+    // a star may also match nothing; as the star itself has been listed
+    // first, matching more takes precedence:
+    pc++;
+  }
+}
+
+// Run the Pike VM. Threads are kept in priority order, which makes the
+// first thread to match the one the backtracking matcher would have found:
+// lower priority threads are dropped at that point.
+static int run_pattern_program(const struct pattern_insn *prog, int num_insns,
+                               const char *str) {
+  int stack_mem[3 * PATTERN_STACK_INSNS];
+  int *mem = stack_mem, *clist, *nlist, *mark, *tmp;
+  int ccount = 0, ncount, generation = 1;
+  int i, j, pc, res = -1;
+  unsigned char c;
+
+  if (num_insns > PATTERN_STACK_INSNS &&
+      (mem = (int *) malloc(3 * num_insns * sizeof(*mem))) == NULL)
+    return -1;
+  clist = mem;
+  nlist = mem + num_insns;
+  mark = mem + 2 * num_insns;
+  memset(mark, 0, num_insns * sizeof(*mark));
+
+  add_pattern_thread(prog, 0, clist, &ccount, mark, generation);
+  for (j = 0; ccount > 0; j++) {
+    c = (unsigned char) str[j];
+    ncount = 0;
+    generation++;
+    for (i = 0; i < ccount; i++) {
+      pc = clist[i];
+      switch (prog[pc].op) {
+      case PAT_CHAR:
+        if (c == (unsigned char) prog[pc].c)
+          add_pattern_thread(prog, pc + 1, nlist, &ncount, mark, generation);
+        continue;
+      case PAT_ANY:
+        if (c != '\0')
+          add_pattern_thread(prog, pc + 1, nlist, &ncount, mark, generation);
+        continue;
+      case PAT_STAR:
+        if (c != '\0' && c != '/')
+          add_pattern_thread(prog, pc, nlist, &ncount, mark, generation);
+        continue;
+      case PAT_STAR_ALL:
+        if (c != '\0')
+          add_pattern_thread(prog, pc, nlist, &ncount, mark, generation);
+        continue;
+      case PAT_EOS:
+        if (c != '\0')
+          continue;
+        break;
+      default:
+        break;
       }
-      do {
-        res = match_string(pattern + i, pattern_len - i, str + j + len);
-      } while (res == -1 && len-- > 0);
-      return res == -1 ? -1 : j + res + len;
-    } else if (pattern[i] != str[j]) {
+      res = j;
+      break;
+    }
+    if (c == '\0')
+      break;
+    tmp = clist;
+    clist = nlist;
+    nlist = tmp;
+    ccount = ncount;
+  }
+
+  if (mem != stack_mem)
+    free(mem);
+  return res;
+}
+
+// Return the length of the prefix of 'str' matched by the alternative, or -1.
+// *str_len caches strlen(str); (size_t)-1 when not known yet.
+static int match_pattern_alt(const struct pattern_alt *alt, const struct pattern_insn *insns,
+                             const char *str, size_t *str_len) {
+  switch (alt->kind) {
+  case PAT_KIND_LITERAL:
+    if (strncmp(str, alt->lit, alt->lit_len) != 0)
+      return -1;
+    str += alt->lit_len;
+    if (alt->anchored)
+      return *str == '\0' ? alt->lit_len : -1;
+    if (alt->tail == PAT_STAR)
+      return alt->lit_len + (int) strcspn(str, "/");
+    if (alt->tail == PAT_STAR_ALL)
+      return alt->lit_len + (int) strlen(str);
+    return alt->lit_len;
+  case PAT_KIND_SUFFIX:
+    if (*str_len == (size_t) -1)
+      *str_len = strlen(str);
+    if (*str_len < (size_t) alt->lit_len ||
+        memcmp(str + *str_len - alt->lit_len, alt->lit, alt->lit_len) != 0)
       return -1;
+    return (int) *str_len;
+  default:
+    return run_pattern_program(insns + alt->first_insn, alt->num_insns, str);
+  }
+}
+
+static void free_pattern(struct mg_pattern *pat) {
+  if (pat != NULL) {
+    free(pat->alts);
+    free(pat->insns);
+    free(pat);
+  }
+}
+
+// Compile a pattern. Return NULL when out of memory.
+static struct mg_pattern *compile_pattern(const char *pattern) {
+  struct mg_pattern *pat;
+  const char *p, *e, *or_str;
+  size_t len = strlen(pattern);
+  int n, num_insns = 0;
+
+  if ((pat = (struct mg_pattern *) calloc(1, sizeof(*pat) + len)) == NULL)
+    return NULL;
+  memcpy(pat->src, pattern, len + 1);
+  for (n = 1, p = pat->src; (p = strchr(p, '|')) != NULL; p++)
+    n++;
+  pat->alts = (struct pattern_alt *) calloc(n, sizeof(*pat->alts));
+  pat->insns = (struct pattern_insn *) calloc(len + n, sizeof(*pat->insns));
+  if (pat->alts == NULL || pat->insns == NULL) {
+    free_pattern(pat);
+    return NULL;
+  }
+
+  pat->suffix_filter = 1;
+  for (p = pat->src, e = p + len; ; p = or_str + 1) {
+    struct pattern_alt *alt = &pat->alts[pat->num_alts++];
+
+    if ((or_str = (const char *) memchr(p, '|', e - p)) == NULL)
+      or_str = e;
+    compile_pattern_alt(alt, p, (int) (or_str - p), pat->insns + num_insns);
+    alt->first_insn = num_insns;
+    num_insns += alt->num_insns;
+    if (alt->kind == PAT_KIND_SUFFIX && alt->lit_len > 0) {
+      unsigned char last = (unsigned char) alt->lit[alt->lit_len - 1];
+      pat->suffix_bytes[last >> 3] |= (unsigned char) (1 << (last & 7));
+    } else {
+      pat->suffix_filter = 0;
     }
+    if (or_str == e)
+      break;
   }
-  return j;
+  return pat;
+}
+
+// Return the length of the prefix of 'str' matched by the first alternative
+// which matches a non-empty prefix; otherwise the result for the last one.
+static int match_pattern(const struct mg_pattern *pat, const char *str) {
+  size_t str_len = (size_t) -1;
+  int i, res = -1;
+
+  if (pat->suffix_filter) {
+    unsigned char last;
+
+    str_len = strlen(str);
+    last = (str_len > 0 ? (unsigned char) str[str_len - 1] : 0);
+    if (str_len == 0 || !(pat->suffix_bytes[last >> 3] & (1 << (last & 7))))
+      return -1;
+  }
+  for (i = 0; i < pat->num_alts; i++) {
+    res = match_pattern_alt(&pat->alts[i], pat->insns, str, &str_len);
+    if (res > 0)
+      break;
+  }
+  return res;
+}
+
+// Match an ad-hoc pattern, compiling it one alternative at a time.
+static int match_string(const char *pattern, int pattern_len, const char *str) {
+  struct pattern_insn stack_insns[PATTERN_STACK_INSNS];
+  struct pattern_insn *insns;
+  struct pattern_alt alt;
+  const char *or_str, *e;
+  size_t str_len = (size_t) -1;
+  int len, res;
+
+  if (pattern_len == -1)
+    pattern_len = (int)strlen(pattern);
+  for (e = pattern + pattern_len; ; pattern = or_str + 1) {
+    if ((or_str = (const char *) memchr(pattern, '|', e - pattern)) == NULL)
+      or_str = e;
+    len = (int) (or_str - pattern);
+    insns = stack_insns;
+    if (len >= PATTERN_STACK_INSNS &&
+        (insns = (struct pattern_insn *) malloc((len + 1) * sizeof(*insns))) == NULL)
+      return -1;
+    compile_pattern_alt(&alt, pattern, len, insns);
+    res = match_pattern_alt(&alt, insns, str, &str_len);
+    if (insns != stack_insns)
+      free(insns);
+    if (res > 0 || or_str == e)
+      return res;
+  }
+}
+
+// Match 'str' against a pattern option, using the pattern compiled at
+// mg_start() unless a user callback has overridden the option value.
+static int match_option(struct mg_connection *conn, mg_option_index_t index, const char *str) {
+  struct mg_config *cfg = conn_config(conn);
+  const char *pattern = get_conn_option(conn, index);
+
+  if (cfg != NULL && cfg->patterns[index] != NULL && pattern == cfg->config[index])
+    return match_pattern(cfg->patterns[index], str);
+  return match_string(pattern, -1, str);
 }
 
 // return non-zero when the given status_code is a probably legal
@@ -2037,13 +2871,13 @@ static int should_keep_alive(struct mg_connection *conn) {
                  mg_get_stop_flag(conn->ctx)));
 
     return (!conn->must_close &&
-            !mg_strcasecmp(get_conn_option(conn, ENABLE_KEEP_ALIVE), "yes") &&
+            get_conn_bool_option(conn, ENABLE_KEEP_ALIVE) &&
             (header == NULL ?
              (http_version && !strcmp(http_version, "1.1")) :
              !mg_strcasecmp(header, "keep-alive")) &&
             conn->ctx->stop_flag == 0);
   } else {
-    const char *header = mg_get_header(conn, "Connection");
+    const char *header = get_known_header(conn, HDR_CONNECTION);
 
     DEBUG_TRACE(0x0002,
                 ("must_close: %d, status: %d, legal: %d, keep-alive: %s, header: %s / ver: %s, stop: %d",
@@ -2062,7 +2896,7 @@ static int should_keep_alive(struct mg_connection *conn) {
             // so it's time to close and let them retry.
             conn->request_info.status_code < 500 &&
             is_legal_response_code(conn->request_info.status_code) &&
-            !mg_strcasecmp(get_conn_option(conn, ENABLE_KEEP_ALIVE), "yes") &&
+            get_conn_bool_option(conn, ENABLE_KEEP_ALIVE) &&
             (header == NULL ?
              (http_version && !strcmp(http_version, "1.1")) :
              !mg_strcasecmp(header, "keep-alive")) &&
@@ -2079,10 +2913,88 @@ static const char *suggest_connection_header(struct mg_connection *conn) {
 static const char *mg_get_allowed_methods(struct mg_connection *conn) {
   const char *allowed = get_conn_option(conn, ALLOWED_METHODS);
   if (is_empty(allowed))
-    allowed = "GET,POST,HEAD,PUT,DELETE,OPTIONS";
+    allowed = DEFAULT_ALLOWED_METHODS;
   return allowed;
 }
 
+// Return the location 'p' will have once the connection buffer 'old_buf',
+// sized 'old_size', has been moved to 'new_buf', sized 'new_size'.
+// References outside the buffer are returned as-is.
+static char *relocate_buf_ref(const char *p, const char *old_buf, int old_size,
+                              char *new_buf, int new_size) {
+  if (p == NULL || p < old_buf || p >= old_buf + 2 * old_size + CHUNK_HEADER_BUFSIZ)
+    return (char *) p;
+  // RX data + chunk header space keep their offset, the TX header store moves up:
+  if (p < old_buf + old_size + CHUNK_HEADER_BUFSIZ)
+    return new_buf + (p - old_buf);
+  return new_buf + new_size + (p - old_buf - old_size);
+}
+
+// Double the size of the connection's RX and TX header buffers, up to the
+// 'max_header_buffer_size' option, to accommodate a rare large request
+// (or response, for client connections). Received data and the TX header
+// store are moved and all references into them are relocated.
+//
+// Return 0 on success, -1 when the buffers cannot grow any further.
+static int grow_header_buffer(struct mg_connection *conn) {
+  struct mg_request_info *ri = &conn->request_info;
+  char *old_buf = conn->buf;
+  int old_size = conn->buf_size;
+  int max_size = conn->ctx->max_header_buf_size;
+  int new_size;
+  char *new_buf;
+  int i;
+
+  if (old_size >= max_size)
+    return -1;
+  new_size = (old_size > max_size / 2 ? max_size : old_size * 2);
+  new_buf = (char *) malloc(new_size * 2 + CHUNK_HEADER_BUFSIZ);
+  if (new_buf == NULL) {
+    mg_cry(conn, "%s: cannot grow the header buffer to %d bytes: out of memory", __func__, new_size);
+    return -1;
+  }
+  memcpy(new_buf, old_buf, old_size + CHUNK_HEADER_BUFSIZ);
+  memcpy(new_buf + new_size + CHUNK_HEADER_BUFSIZ, old_buf + old_size + CHUNK_HEADER_BUFSIZ, conn->tx_headers_len);
+
+#define RELOCATE(p)   relocate_buf_ref(p, old_buf, old_size, new_buf, new_size)
+  ri->request_method = RELOCATE(ri->request_method);
+  ri->uri = RELOCATE(ri->uri);
+  ri->http_version = RELOCATE(ri->http_version);
+  ri->query_string = RELOCATE(ri->query_string);
+  ri->path_info = RELOCATE(ri->path_info);
+  for (i = 0; i < ri->num_headers; i++) {
+    ri->http_headers[i].name = RELOCATE(ri->http_headers[i].name);
+    ri->http_headers[i].value = RELOCATE(ri->http_headers[i].value);
+  }
+  for (i = 0; i < ri->num_response_headers; i++) {
+    ri->response_headers[i].name = RELOCATE(ri->response_headers[i].name);
+    ri->response_headers[i].value = RELOCATE(ri->response_headers[i].value);
+  }
+#undef RELOCATE
+
+  if (old_buf != (char *) (conn + 1))
+    free(old_buf);
+  conn->buf = new_buf;
+  conn->buf_size = new_size;
+  DEBUG_TRACE(0x0010, ("grew header buffer from %d to %d bytes", old_size, new_size));
+  return 0;
+}
+
+// Return the initial size of the RX and TX header buffers of a connection.
+static int get_header_buf_size(const struct mg_context *ctx) {
+  return ctx->header_buf_size > 0 ? ctx->header_buf_size : DEFAULT_REQUEST_SIZE;
+}
+
+// Return the connection to its original header buffers once a grown buffer
+// is no longer needed, i.e. after the last request on the connection.
+static void release_header_buffer(struct mg_connection *conn) {
+  if (conn->buf != NULL && conn->buf != (char *) (conn + 1)) {
+    free(conn->buf);
+    conn->buf = (char *) (conn + 1);
+    conn->buf_size = get_header_buf_size(conn->ctx);
+  }
+}
+
 // Return negative value on error; otherwise number of bytes saved by compacting.
 //
 // NOTE: we MAY also be storing the URI+QUERY strings in the TX buffer,
@@ -2279,11 +3191,12 @@ int mg_vadd_response_header(struct mg_connection *conn, int force_add, const cha
       n = (int)mg_strlcpy(dst, tag, space);
       if (n + 6 < space) // NUL+[?] + empty value + NUL+[?]+[?]+[?]
         break;
-      // we need to compact and retry, and when it still fails then, we're toast.
-      if (compact_tx_headers(conn) <= 0) {
+      // we need to compact (or grow) and retry, and when it still fails then, we're toast.
+      if (compact_tx_headers(conn) <= 0 && grow_header_buffer(conn) < 0) {
         mg_cry(conn, "%s: header buffer overflow for key %s", __func__, tag);
         return -1;
       }
+      bufbase = conn->buf + conn->buf_size + CHUNK_HEADER_BUFSIZ;
       dst = bufbase + conn->tx_headers_len;
       space = conn->buf_size - conn->tx_headers_len;
     }
@@ -2308,18 +3221,24 @@ int mg_vadd_response_header(struct mg_connection *conn, int force_add, const cha
 
   // now store the value:
   for(;;) {
-    n = mg_vsnq0printf(conn, dst, space, value_fmt, ap);
+    va_list aq;
+
+    // each attempt needs its own copy of the arguments as a failed attempt has consumed them:
+    VA_COPY(aq, ap);
+    n = mg_vsnq0printf(conn, dst, space, value_fmt, aq);
+    va_end(aq);
     // n==0 is also possible when snprintf() fails dramatically (see notes in mg_snq0printf() et al)
     if (n + 4 < space && n > 0) // + NUL+[?]+[?]+[?]
       break;
     // only accept n==0 when the value_fmt is empty and there's nothing to compact or (heuristic!) when there's 'sufficient space' to write:
     if (n == 0 && 4 < space && (!conn->tx_can_compact_hdrstore || is_empty(value_fmt) || space >= MG_MAX(MG_BUF_LEN, conn->buf_size / 4)))
       break;
-    // we need to compact and retry, and when it still fails then, we're toast.
-    if (compact_tx_headers(conn) <= 0) {
+    // we need to compact (or grow) and retry, and when it still fails then, we're toast.
+    if (compact_tx_headers(conn) <= 0 && grow_header_buffer(conn) < 0) {
       mg_cry(conn, "%s: header buffer overflow for key %s", __func__, tag);
       return -1;
     }
+    bufbase = conn->buf + conn->buf_size + CHUNK_HEADER_BUFSIZ;
     dst = bufbase + conn->tx_headers_len;
     space = conn->buf_size - conn->tx_headers_len;
   }
@@ -2358,12 +3277,43 @@ const char *mg_get_response_header(const struct mg_connection *conn, const char
   return NULL;
 }
 
-static int write_http_head(struct mg_connection *conn, PRINTF_FORMAT_STRING(const char *first_line_fmt), ...) PRINTF_ARGS(2, 3);
+// Return non-zero when the Accept-Encoding header value 'hdr' allows the
+// content coding 'coding', i.e. lists it (or '*') without a zero q-value.
+// An explicit entry for 'coding' overrides the '*' wildcard.
+static int accepts_content_coding(const char *hdr, const char *coding) {
+  size_t coding_len = strlen(coding);
+  int exact = -1, wildcard = -1;
 
-// Return number of bytes sent; return 0 when nothing was done; -1 on error.
-static int write_http_head(struct mg_connection *conn, const char *first_line_fmt, ...) {
-  int i, n, rv, rv2, tx_len;
-  char *buf;
+  while (*hdr) {
+    const char *tok, *end;
+    size_t tok_len;
+    double q = 1.0;
+
+    hdr += strspn(hdr, " \t,");
+    tok = hdr;
+    tok_len = strcspn(tok, " \t,;");
+    end = tok + strcspn(tok, ",");
+    // scan the parameters of this element for a q-value:
+    for (hdr = tok + tok_len; hdr < end; hdr += strcspn(hdr, ";,")) {
+      hdr += strspn(hdr, " \t;");
+      if (lowercase(hdr) == 'q' && hdr[1] == '=')
+        q = strtod(hdr + 2, NULL);
+    }
+    if (tok_len == coding_len && !mg_strncasecmp(tok, coding, coding_len))
+      exact = (q > 0);
+    else if (tok_len == 1 && *tok == '*')
+      wildcard = (q > 0);
+    hdr = end;
+  }
+  return exact >= 0 ? exact : wildcard > 0;
+}
+
+static int write_http_head(struct mg_connection *conn, PRINTF_FORMAT_STRING(const char *first_line_fmt), ...) PRINTF_ARGS(2, 3);
+
+// Return number of bytes sent; return 0 when nothing was done; -1 on error.
+static int write_http_head(struct mg_connection *conn, const char *first_line_fmt, ...) {
+  int i, n, rv, rv2, tx_len;
+  char *buf;
   const char *te_tag;
   const char *cl_tag;
   const char *ka_tag;
@@ -2508,6 +3458,79 @@ static int write_http_head(struct mg_connection *conn, const char *first_line_fm
   return rv;
 }
 
+#if defined(USE_ZLIB)
+struct mg_tx_compressor {
+  z_stream strm;
+  int state;                            // 0: idle, 1: compressing the current response, 2: the gzip stream has been completed
+  unsigned char out[DATA_COPY_BUFSIZ];  // deflate() output, written through to the connection
+};
+#endif
+
+// Add 'Accept-Encoding' to the Vary response header, unless it's listed already.
+static void add_vary_accept_encoding(struct mg_connection *conn) {
+  char vary[256];
+  const char *hdr = mg_get_response_header(conn, "Vary");
+
+  if (is_empty(hdr)) {
+    mg_add_response_header(conn, 0, "Vary", "Accept-Encoding");
+  } else if (strcmp(hdr, "*") && !mg_stristr(hdr, "Accept-Encoding")) {
+    // copy the old value as the header store may be compacted while we write the new one:
+    mg_strlcpy(vary, hdr, sizeof(vary));
+    mg_add_response_header(conn, 0, "Vary", "%s, Accept-Encoding", vary);
+  }
+}
+
+// Decide whether the response which is about to be sent should be gzip
+// compressed on the fly: it must have a Content-Type listed in the
+// 'compress_content_types' option, carry a body, not be encoded already
+// and the client must accept gzip.
+//
+// When it should, set up the compressor and replace any Content-Length
+// header by a Content-Encoding header; write_http_head() will then pick
+// chunked transfer mode (HTTP/1.1) or close the connection (HTTP/1.0) to
+// delimit the compressed body.
+static void start_tx_compression(struct mg_connection *conn, int status_code) {
+  const char *pattern = get_conn_option(conn, COMPRESS_CONTENT_TYPES);
+  const char *content_type;
+  const char *accept_encoding;
+
+  if (is_empty(pattern) || conn->tx_no_compression || conn->is_client_conn ||
+      status_code < 200 || status_code == 204 || status_code == 206 || status_code == 304 ||
+      !mg_strcasecmp(conn->request_info.request_method, "HEAD"))
+    return;
+  content_type = mg_get_response_header(conn, "Content-Type");
+  if (is_empty(content_type) || match_option(conn, COMPRESS_CONTENT_TYPES, content_type) <= 0 ||
+      !is_empty(mg_get_response_header(conn, "Content-Encoding")) ||
+      !is_empty(mg_get_response_header(conn, "Content-Range")))
+    return;
+  // the response differs per Accept-Encoding from here on, whether we compress it or not:
+  add_vary_accept_encoding(conn);
+  accept_encoding = get_known_header(conn, HDR_ACCEPT_ENCODING);
+  if (accept_encoding == NULL || !accepts_content_coding(accept_encoding, "gzip"))
+    return;
+
+#if defined(USE_ZLIB)
+  if (conn->tx_compressor == NULL) {
+    conn->tx_compressor = (struct mg_tx_compressor *) calloc(1, sizeof(*conn->tx_compressor));
+    if (conn->tx_compressor == NULL)
+      return;
+    // windowBits 15 + 16: produce a gzip rather than a zlib stream
+    if (deflateInit2(&conn->tx_compressor->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      mg_cry(conn, "%s: deflateInit2() failed", __func__);
+      free(conn->tx_compressor);
+      conn->tx_compressor = NULL;
+      return;
+    }
+  } else if (deflateReset(&conn->tx_compressor->strm) != Z_OK) {
+    return;
+  }
+  conn->tx_compressor->state = 1;
+  mg_remove_response_header(conn, "Content-Length");
+  mg_add_response_header(conn, 0, "Content-Encoding", "gzip");
+#endif
+}
+
 int mg_write_http_response_head(struct mg_connection *conn, int status_code, const char *status_text) {
   const char *http_version = conn->request_info.http_version;
 
@@ -2523,6 +3546,9 @@ int mg_write_http_response_head(struct mg_connection *conn, int status_code, con
 
   mg_set_response_code(conn, status_code);
 
+  if (!mg_have_headers_been_sent(conn))
+    start_tx_compression(conn, status_code);
+
   return write_http_head(conn, "HTTP/%s %d %s\r\n", http_version, status_code, status_text);
 }
 
@@ -3665,8 +4691,9 @@ static int pull(FILE *fp, struct mg_connection *conn, char *buf, int len) {
   return nread;
 }
 
-// forward declaration:
+// forward declarations:
 static int read_and_parse_chunk_header(struct mg_connection *conn);
+static int have_buffered_chunk_header(const struct mg_connection *conn);
 
 static int read_bytes(struct mg_connection *conn, void *buf, size_t len, int nonblocking) {
   int n, buffered_len, nread;
@@ -3709,7 +4736,8 @@ static int read_bytes(struct mg_connection *conn, void *buf, size_t len, int non
         int cl;
         MG_ASSERT(conn->rx_remaining_chunksize == 0);
         // nonblocking: check if any data is pending; only then do we fetch one more chunk header...
-        if (nread == 0 || mg_is_read_data_available(conn) == 1 || !nonblocking) {
+        if (nread == 0 || !nonblocking || have_buffered_chunk_header(conn) ||
+            mg_is_read_data_available(conn) == 1) {
           cl = read_and_parse_chunk_header(conn);
           if (conn->rx_remaining_chunksize == 0) {
             DEBUG_TRACE(0x0004,
@@ -3833,7 +4861,9 @@ int mg_have_headers_been_sent(const struct mg_connection *conn) {
   return 0;
 }
 
-int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
+// Write (uncompressed) data to the connection, taking care of the chunked
+// transfer framing. Return the number of bytes written; negative number on error.
+static int write_data(struct mg_connection *conn, const void *buf, size_t len) {
   int rv;
   const char *src = (const char *)buf;
   int64_t txlen = (int64_t) len;
@@ -3938,6 +4968,84 @@ int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
   return (src - (const char *)buf);
 }
 
+#if defined(USE_ZLIB)
+// Run deflate() on the pending input and send whatever output it produces.
+// Return 0 on success, -1 on error.
+static int deflate_and_write(struct mg_connection *conn, int flush) {
+  struct mg_tx_compressor *c = conn->tx_compressor;
+  int rv, n;
+
+  do {
+    c->strm.next_out = c->out;
+    c->strm.avail_out = sizeof(c->out);
+    rv = deflate(&c->strm, flush);
+    if (rv == Z_STREAM_ERROR) {
+      mg_cry(conn, "%s: deflate() failed", __func__);
+      return -1;
+    }
+    n = (int) (sizeof(c->out) - c->strm.avail_out);
+    if (n > 0 && write_data(conn, c->out, n) != n)
+      return -1;
+  } while (c->strm.avail_out == 0 || (flush == Z_FINISH && rv != Z_STREAM_END));
+  return 0;
+}
+
+// Compress the content data and write the compressed output; return 'len'
+// on success as mg_write() reports the amount of (uncompressed) data accepted.
+static int write_compressed(struct mg_connection *conn, const void *buf, size_t len) {
+  struct mg_tx_compressor *c = conn->tx_compressor;
+
+  if (c->state == 2) {
+    mg_cry(conn, "%s: trying to send %d content data bytes beyond the END of a compressed transfer", __func__, (int)len);
+    return -1;
+  }
+  c->strm.next_in = (Bytef *) buf;
+  c->strm.avail_in = (uInt) len;
+  if (deflate_and_write(conn, Z_NO_FLUSH) < 0)
+    return -1;
+  MG_ASSERT(c->strm.avail_in == 0);
+  return (int) len;
+}
+
+// Complete the gzip stream of the current response, if any.
+static int finish_tx_compression(struct mg_connection *conn) {
+  struct mg_tx_compressor *c = conn->tx_compressor;
+
+  if (c == NULL || c->state != 1 || conn->num_bytes_sent < 0)
+    return 0;
+  c->state = 2;
+  c->strm.next_in = NULL;
+  c->strm.avail_in = 0;
+  return deflate_and_write(conn, Z_FINISH);
+}
+#endif
+
+static void release_tx_compressor(struct mg_connection *conn) {
+#if defined(USE_ZLIB)
+  if (conn->tx_compressor != NULL) {
+    (void) deflateEnd(&conn->tx_compressor->strm);
+    free(conn->tx_compressor);
+    conn->tx_compressor = NULL;
+  }
+#else
+  (void) conn;
+#endif
+}
+
+int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
+  // may be called with len == 0 from the mg_printf() family:
+  if (len == 0)
+    return 0;
+
+#if defined(USE_ZLIB)
+  // compress content data only, NOT the (HTTP) header or the chunk headers:
+  if (conn->tx_compressor != NULL && conn->tx_compressor->state != 0 &&
+      conn->num_bytes_sent >= 0 && conn->tx_chunk_header_sent < 2)
+    return write_compressed(conn, buf, len);
+#endif
+  return write_data(conn, buf, len);
+}
+
 int mg_vprintf(struct mg_connection *conn, const char *fmt, va_list aa) {
   char *buf = NULL;
   int len;
@@ -4036,6 +5144,121 @@ static size_t url_decode(const char *src, size_t src_len, char *dst,
   return j;
 }
 
+#if defined(MG_HAVE_SSE2)
+// Return the index of the lowest set bit in a non-zero mask.
+static int lowest_bit_index(unsigned int mask) {
+#if defined(_MSC_VER)
+  unsigned long idx;
+  _BitScanForward(&idx, mask);
+  return (int) idx;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+// Return the offset of the first byte in s[0..len) from which on
+// normalize_path() may have to change the string: a '%', a '\', or a '/'
+// followed by another separator, a '.' or a '%'. Return len when there is
+// none, i.e. when the string is already clean.
+static size_t find_uri_special(const char *s, size_t len) {
+  size_t i = 0;
+
+#if defined(MG_HAVE_SSE2)
+  // s[len] is the NUL sentinel, so the 'next byte' vector stays in bounds:
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i w = _mm_loadu_si128((const __m128i *) (s + i + 1));
+    __m128i next = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(w, _mm_set1_epi8('/')),
+                                             _mm_cmpeq_epi8(w, _mm_set1_epi8('\\'))),
+                                _mm_or_si128(_mm_cmpeq_epi8(w, _mm_set1_epi8('.')),
+                                             _mm_cmpeq_epi8(w, _mm_set1_epi8('%'))));
+    __m128i m = _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), next);
+    unsigned int mask;
+
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    mask = (unsigned int) _mm_movemask_epi8(m);
+    if (mask)
+      return i + lowest_bit_index(mask);
+  }
+#endif
+  for (; i < len; i++) {
+    if (s[i] == '%' || s[i] == '\\' ||
+        (s[i] == '/' && (s[i + 1] == '/' || s[i + 1] == '\\' ||
+                         s[i + 1] == '.' || s[i + 1] == '%')))
+      return i;
+  }
+  return len;
+}
+
+// Fetch the next, optionally URL-decoded, character and advance *s past it.
+static int next_path_char(char **s, int decode) {
+  const unsigned char *p = (const unsigned char *) *s;
+  int a, b;
+
+  if (decode && p[0] == '%' && isxdigit(p[1]) && isxdigit(p[2])) {
+    a = tolower(p[1]);
+    b = tolower(p[2]);
+    *s += 3;
+    return (HEXTOI(a) << 4) | HEXTOI(b);
+  }
+  if (p[0] != '\0')
+    (*s)++;
+  return p[0];
+}
+
+// Protect against directory disclosure attack by removing '..',
+// excessive '/' and '\' characters in place. Optionally URL-decode the
+// string in the same pass, so that encoded separators and dots are
+// treated like their plain counterparts.
+// Return TRUE when the string was clean and has not been touched.
+static int normalize_path(char *path, size_t len, int decode) {
+  char *s, *p, *q;
+  int c;
+
+  s = path + find_uri_special(path, len);
+  if (*s == '\0')
+    return 1;
+
+  p = s;
+  while ((c = next_path_char(&s, decode)) != '\0') {
+    *p++ = (char) c;
+    if (IS_DIRSEP_CHAR(c)) {
+      // Skip all following slashes and backslashes
+      for (q = s; IS_DIRSEP_CHAR(next_path_char(&q, decode)); q = s)
+        s = q;
+
+      // Skip all double-dots
+      for (;;) {
+        q = s;
+        if (next_path_char(&q, decode) != '.' || next_path_char(&q, decode) != '.')
+          break;
+        s = q;
+      }
+    }
+  }
+  *p = '\0';
+  return 0;
+}
+
+// Return TRUE when path is absolute and contains no '.', '..' or empty
+// segments, i.e. when mg_mk_fullpath() could only resolve symlinks.
+static int is_clean_absolute_path(const char *path) {
+  size_t len = strlen(path);
+
+#if defined(_WIN32)
+  // our clean paths have no '\', so only 'X:/...' qualifies
+  if (!(isalpha(* (const unsigned char *) path) && path[1] == ':' && path[2] == '/'))
+    return 0;
+#else
+  if (path[0] != '/')
+    return 0;
+#endif
+  return find_uri_special(path, len) == len &&
+         !(len >= 2 && path[len - 1] == '.' && path[len - 2] == '/');
+}
+
 // Scan given buffer and fetch the value of the given variable.
 // It can be specified in query string, or in the POST data.
 // Return -1 if the variable not found, or length of the URLdecoded
@@ -4089,13 +5312,105 @@ int mg_get_var(const char *buf, size_t buf_len, const char *name,
   return len;
 }
 
+// Case-insensitive hash of a form variable name.
+static unsigned int form_var_name_hash(const char *name, size_t len) {
+  unsigned int h = 0;
+
+  while (len-- > 0)
+    h = h * 31 + (* (const unsigned char *) name++ | 0x20);
+  return h % ARRAY_SIZE(((struct mg_form_vars *) 0)->bucket);
+}
+
+int mg_parse_form_vars(struct mg_form_vars *vars, const char *data, size_t data_len,
+                       int is_form_url_encoded) {
+  int tail[ARRAY_SIZE(vars->bucket)];
+  const char *p, *e, *s, *eq;
+  int count = 0;
+  size_t i;
+
+  vars->is_form_url_encoded = is_form_url_encoded;
+  vars->num_vars = 0;
+  for (i = 0; i < ARRAY_SIZE(vars->bucket); i++)
+    vars->bucket[i] = tail[i] = -1;
+  if (data == NULL)
+    return 0;
+  if (data_len == (size_t)-1)
+    data_len = strlen(data);
+
+  for (p = data, e = data + data_len; p < e; p = s + 1) {
+    struct mg_form_var *v;
+    unsigned int h;
+
+    if ((s = (const char *) memchr(p, '&', (size_t)(e - p))) == NULL)
+      s = e;
+    // mg_get_var() never finds a variable without '=', so neither do we:
+    if ((eq = (const char *) memchr(p, '=', (size_t)(s - p))) == NULL)
+      continue;
+    if (count++ >= (int) ARRAY_SIZE(vars->vars))
+      continue;
+
+    v = &vars->vars[vars->num_vars];
+    v->name = p;
+    v->name_len = eq - p;
+    v->value = eq + 1;
+    v->value_len = s - eq - 1;
+
+    // append to the hash chain to keep repeated variables in order:
+    v->next = -1;
+    h = form_var_name_hash(v->name, v->name_len);
+    if (tail[h] < 0)
+      vars->bucket[h] = vars->num_vars;
+    else
+      vars->vars[tail[h]].next = vars->num_vars;
+    tail[h] = vars->num_vars++;
+  }
+  return count;
+}
+
+int mg_find_form_var(const struct mg_form_vars *vars, const char *var_name, int prev) {
+  size_t name_len;
+  int i;
+
+  if (vars == NULL || var_name == NULL)
+    return -1;
+  name_len = strlen(var_name);
+  if (prev < 0)
+    i = vars->bucket[form_var_name_hash(var_name, name_len)];
+  else if (prev < vars->num_vars)
+    i = vars->vars[prev].next;
+  else
+    return -1;
+
+  for (; i >= 0; i = vars->vars[i].next) {
+    if (vars->vars[i].name_len == name_len &&
+        !mg_strncasecmp(var_name, vars->vars[i].name, name_len))
+      return i;
+  }
+  return -1;
+}
+
+int mg_decode_form_var(const struct mg_form_vars *vars, int index,
+                       char *dst, size_t dst_len) {
+  const struct mg_form_var *v;
+
+  if (dst == NULL || dst_len == 0)
+    return -2;
+  dst[0] = '\0';
+  if (vars == NULL || index < 0 || index >= vars->num_vars)
+    return -1;
+  v = &vars->vars[index];
+  if (v->value_len >= dst_len)
+    return -1;
+  return (int) url_decode(v->value, v->value_len, dst, dst_len, vars->is_form_url_encoded);
+}
+
 int mg_get_cookie(const struct mg_connection *conn, const char *cookie_name,
                   char *dst, size_t dst_size) {
   const char *s, *p, *end;
   int name_len, len = -1;
 
   dst[0] = '\0';
-  if ((s = mg_get_header(conn, "Cookie")) == NULL) {
+  if ((s = get_known_header(conn, HDR_COOKIE)) == NULL) {
     return -1;
   }
 
@@ -4124,117 +5439,753 @@ int mg_get_cookie(const struct mg_connection *conn, const char *cookie_name,
   return len;
 }
 
-static int convert_uri_to_file_name(struct mg_connection *conn, char *buf,
-                                    size_t buf_len, struct mgstat *st) {
-  struct vec a, b;
-  const char *rewrite, *uri = conn->request_info.uri;
-  char *p;
-  int match_len, stat_result;
+// Disk I/O thread pool.
+//
+// When the 'disk_io_threads' option is non-zero, the filesystem calls made
+// while serving a request (stat, open, read, opendir/readdir) are handed to
+// a small pool of dedicated threads. The worker waits for the result for at
+// most 'disk_io_timeout' seconds, so a stalled document_root (NFS hiccup,
+// failing disk) costs a '504 Gateway Timeout' instead of hanging every
+// worker thread in the server.
+//
+// A job which times out while being executed is abandoned: the I/O thread
+// releases it, including any file or directory handle it carries, once the
+// blocking call finally returns.
+typedef enum {
+  MG_IO_STAT,
+  MG_IO_FOPEN,
+  MG_IO_FREAD,
+  MG_IO_OPENDIR,
+  MG_IO_READDIR
+} mg_io_op_t;
 
-  buf_len--;  // This is because memmove() for PATH_INFO may shift part
-              // of the path one byte on the right.
-  mg_snprintf(conn, buf, buf_len, "%s%s", get_conn_option(conn, DOCUMENT_ROOT), uri);
+typedef enum {
+  MG_IO_QUEUED,
+  MG_IO_RUNNING,
+  MG_IO_DONE,
+  MG_IO_ABANDONED
+} mg_io_state_t;
+
+struct mg_io_job {
+  struct mg_io_job *next;               // Linkage in the disk I/O queue
+  mg_io_op_t op;
+  volatile mg_io_state_t state;
+  int rv;                               // Result of the call: 0/-1 or the number of bytes read
+  int err;                              // ERRNO as produced by the call
+  FILE *fp;                             // MG_IO_FOPEN result; MG_IO_FREAD input
+  DIR *dir;                             // MG_IO_OPENDIR result; MG_IO_READDIR input
+  const char *mode;                     // MG_IO_FOPEN mode
+  size_t len;                           // MG_IO_FREAD size
+  struct mgstat st;                     // MG_IO_STAT result
+  char path[PATH_MAX];                  // MG_IO_STAT/FOPEN/OPENDIR input; MG_IO_READDIR result (entry name)
+  char data[DATA_COPY_BUFSIZ];          // MG_IO_FREAD result
+};
 
-  rewrite = get_conn_option(conn, REWRITE);
-  while ((rewrite = next_option(rewrite, &a, &b)) != NULL) {
-    if ((match_len = match_string(a.ptr, (int)a.len, uri)) > 0) {
-      mg_snprintf(conn, buf, buf_len, "%.*s%s", (int)b.len, b.ptr, uri + match_len);
-      break;
-    }
+static void set_errno(int err) {
+#if defined(_WIN32)
+  SetLastError((DWORD) err);
+#else
+  errno = err;
+#endif
+}
+
+static void exec_io_job(struct mg_io_job *job) {
+  struct dirent *dp;
+
+  switch (job->op) {
+  case MG_IO_STAT:
+    job->rv = mg_stat(job->path, &job->st);
+    break;
+  case MG_IO_FOPEN:
+    job->fp = mg_fopen(job->path, job->mode);
+    job->rv = (job->fp != NULL ? 0 : -1);
+    break;
+  case MG_IO_FREAD:
+    job->rv = (int) fread(job->data, 1, job->len, job->fp);
+    break;
+  case MG_IO_OPENDIR:
+    job->dir = opendir(job->path);
+    job->rv = (job->dir != NULL ? 0 : -1);
+    break;
+  case MG_IO_READDIR:
+    dp = readdir(job->dir);
+    if (dp != NULL)
+      mg_strlcpy(job->path, dp->d_name, sizeof(job->path));
+    job->rv = (dp != NULL ? 0 : -1);
+    break;
   }
+  job->err = ERRNO;
+}
 
-  // Win32: CGI can fail when being fed an interpreter plus relative path to the script;
-  // keep in mind that other scenarios, e.g. user event handlers, may fail similarly
-  // when receiving relative filesystem paths, so we solve the issue once and for all,
-  // right here:
-  mg_mk_fullpath(buf, buf_len);
+// Release an abandoned job and whatever file/directory handle it carries.
+static void discard_io_job(struct mg_io_job *job) {
+  if (job->fp != NULL)
+    (void) mg_fclose(job->fp);
+  if (job->dir != NULL)
+    (void) closedir(job->dir);
+  free(job);
+}
 
-  if ((stat_result = mg_stat(buf, st)) != 0) {
-    const char *cgi_exts = get_conn_option(conn, CGI_EXTENSIONS);
-    int cgi_exts_len = (int)strlen(cgi_exts);
+// Wait for 'cv' for about a second at most. The native Win32 emulation of
+// pthread_cond_timedwait() expects a relative timeout, POSIX an absolute one.
+static void io_cond_wait(struct mg_context *ctx, pthread_cond_t *cv) {
+  struct timespec ts = {0};
 
-    // Support PATH_INFO for CGI scripts.
-    for (p = buf + strlen(buf); p > buf + 1; p--) {
-      if (*p == '/') {
-        *p = '\0';
-        if (match_string(cgi_exts, cgi_exts_len, buf) > 0 &&
-            (stat_result = mg_stat(buf, st)) == 0) {
-          // Shift PATH_INFO block one character right, e.g.
-          //  "/x.cgi/foo/bar\x00" => "/x.cgi\x00/foo/bar\x00"
-          // conn->path_info is pointing to the local variable "path" declared
-          // in handle_request(), so PATH_INFO is not valid after
-          // handle_request returns.
-          conn->request_info.path_info = p + 1;
-          memmove(p + 2, p + 1, strlen(p + 1) + 1);  // +1 is for trailing \0
-          p[1] = '/';
-          break;
-        } else {
-          *p = '/';
-          stat_result = -1;
-        }
-      }
+#if defined(_WIN32) && !defined(__SYMBIAN32__) && !defined(HAVE_PTHREAD)
+  ts.tv_sec = 1;
+#else
+  ts.tv_sec = time(NULL) + 1;
+#endif
+  (void) pthread_cond_timedwait(cv, &ctx->io_mutex, &ts);
+}
+
+static void * WINCDECL io_thread(struct mg_context *ctx) {
+  struct mg_io_job *job;
+
+  (void) pthread_mutex_lock(&ctx->io_mutex);
+  while (ctx->stop_flag == 0) {
+    if ((job = ctx->io_head) == NULL) {
+      io_cond_wait(ctx, &ctx->io_queued);
+      continue;
+    }
+    ctx->io_head = job->next;
+    if (ctx->io_head == NULL)
+      ctx->io_tail = NULL;
+    ctx->io_queue_len--;
+    job->state = MG_IO_RUNNING;
+    (void) pthread_mutex_unlock(&ctx->io_mutex);
+
+    exec_io_job(job);
+
+    (void) pthread_mutex_lock(&ctx->io_mutex);
+    if (job->state == MG_IO_ABANDONED) {
+      discard_io_job(job);
+    } else {
+      job->state = MG_IO_DONE;
+      (void) pthread_cond_broadcast(&ctx->io_done);
     }
   }
+  (void) pthread_mutex_unlock(&ctx->io_mutex);
 
-  DEBUG_TRACE(0x0200, ("[%s] -> [%s], [%.*s]", uri, buf, (int) b.len, b.ptr));
+  // Signal master that we're done and exiting
+  (void) pthread_mutex_lock(&ctx->mutex);
+  ctx->num_threads--;
+  (void) pthread_cond_signal(&ctx->cond);
+  MG_ASSERT(ctx->num_threads >= 1);
+  (void) pthread_mutex_unlock(&ctx->mutex);
 
-  return stat_result;
+  // WARNING: ctx->num_threads-- MUST be the VERY LAST THING this thread does (see worker_thread()).
+  return NULL;
 }
 
-#if !defined(NO_SSL)
-static int sslize(struct mg_connection *conn, SSL_CTX *ssl_ctx, int (*func)(SSL *)) {
-  MG_ASSERT(ssl_ctx);
-  if ((conn->ssl = SSL_new(ssl_ctx)) != NULL &&
-    SSL_set_fd(conn->ssl, conn->client.sock) == 1) {
-    int rv;
-    do {
-      rv = func(conn->ssl);
-    } while (ssl_renegotiation_ongoing(conn, &rv));
-    return (rv == 1);
+// Return the (reset) disk I/O job slot of the connection, or NULL when the
+// filesystem call should be made directly because the disk I/O pool is disabled.
+static struct mg_io_job *get_io_job(struct mg_connection *conn, mg_io_op_t op) {
+  struct mg_io_job *job;
+
+  if (conn->ctx == NULL || conn->ctx->num_io_threads <= 0)
+    return NULL;
+  if (conn->io_job == NULL) {
+    conn->io_job = (struct mg_io_job *) malloc(sizeof(*conn->io_job));
+    if (conn->io_job == NULL)
+      return NULL;
   }
-  return 0;
+  job = conn->io_job;
+  job->op = op;
+  job->rv = -1;
+  job->err = 0;
+  job->fp = NULL;
+  job->dir = NULL;
+  return job;
 }
-#else // NO_SSL
-#define sslize(conn, s, f)     0
-#endif // NO_SSL
-
-// Check whether full request is buffered. Return:
-//   -1  if request is malformed
-//    0  if request is not yet fully buffered
-//   >0  actual request length, including last \r\n\r\n
-static int get_request_len(const char *buf, int buflen) {
-  const char *s, *e;
-  int len = 0;
 
-  for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++)
-    // Control characters are not allowed but >=128 is.
-    if (!isprint(* (const unsigned char *) s) && *s != '\r' &&
-        *s != '\n' && * (const unsigned char *) s < 128) {
-      len = -1;
-      break; // [i_a] abort scan as soon as one malformed character is found; don't let subsequent \r\n\r\n win us over anyhow
-    } else if (s[0] == '\n' && s[1] == '\n') {
-      len = (int) (s - buf) + 2;
-    } else if (s[0] == '\n' && &s[1] < e &&
-        s[1] == '\r' && s[2] == '\n') {
-      len = (int) (s - buf) + 3;
-    }
+static void release_io_job(struct mg_connection *conn) {
+  if (conn->io_job != NULL) {
+    free(conn->io_job);
+    conn->io_job = NULL;
+  }
+}
 
-  return len;
+// Have the disk I/O pool execute 'job' and wait for it to complete.
+//
+// Return 0 on completion. Otherwise return the HTTP status code to report,
+// which is also stored in conn->disk_io_status: 503 when the queue is full
+// or the server is stopping, 504 when the timeout expired. In the latter
+// case the job may have been abandoned to the I/O thread, which is the case
+// when conn->io_job no longer points at 'job': do not touch it any more.
+static int run_io_job(struct mg_connection *conn, struct mg_io_job *job) {
+  struct mg_context *ctx = conn->ctx;
+  time_t deadline = time(NULL) + ctx->io_timeout;
+  struct mg_io_job **pp, *prev = NULL;
+
+  (void) pthread_mutex_lock(&ctx->io_mutex);
+  if (ctx->stop_flag != 0 || ctx->io_queue_len >= MG_MAX_IO_QUEUE_LEN) {
+    (void) pthread_mutex_unlock(&ctx->io_mutex);
+    mg_cry(conn, "%s: disk I/O queue is full", __func__);
+    return conn->disk_io_status = 503;
+  }
+  job->state = MG_IO_QUEUED;
+  job->next = NULL;
+  if (ctx->io_tail != NULL)
+    ctx->io_tail->next = job;
+  else
+    ctx->io_head = job;
+  ctx->io_tail = job;
+  ctx->io_queue_len++;
+  (void) pthread_cond_signal(&ctx->io_queued);
+
+  while (job->state != MG_IO_DONE && ctx->stop_flag == 0 &&
+         (ctx->io_timeout <= 0 || time(NULL) < deadline)) {
+    io_cond_wait(ctx, &ctx->io_done);
+  }
+
+  if (job->state == MG_IO_QUEUED) {
+    // nobody picked it up yet: take it back out of the queue
+    for (pp = &ctx->io_head; *pp != job; pp = &(*pp)->next)
+      prev = *pp;
+    *pp = job->next;
+    if (ctx->io_tail == job)
+      ctx->io_tail = prev;
+    ctx->io_queue_len--;
+  } else if (job->state == MG_IO_RUNNING) {
+    // the I/O thread is stuck in the call: it owns the job from now on
+    job->state = MG_IO_ABANDONED;
+    conn->io_job = NULL;
+  }
+  if (job->state != MG_IO_DONE) {
+    conn->disk_io_status = (ctx->stop_flag != 0 ? 503 : 504);
+  }
+  (void) pthread_mutex_unlock(&ctx->io_mutex);
+
+  if (conn->disk_io_status != 0) {
+    mg_cry(conn, "%s: disk I/O did not complete within %d seconds", __func__, ctx->io_timeout);
+    return conn->disk_io_status;
+  }
+  set_errno(job->err);
+  return 0;
 }
 
-// Convert month to the month number. Return -1 on error, or month number
-static int get_month_index(const char *s) {
-  size_t i;
+// mg_stat() through the disk I/O pool. Once a disk I/O job of the current
+// request failed, all subsequent calls fail immediately.
+static int conn_stat(struct mg_connection *conn, const char *path, struct mgstat *stp) {
+  struct mg_io_job *job;
 
-  for (i = 0; i < ARRAY_SIZE(month_names); i++)
-    if (!strcmp(s, month_names[i]))
-      return (int) i;
+  if (conn->disk_io_status != 0)
+    return -1;
+  if ((job = get_io_job(conn, MG_IO_STAT)) == NULL)
+    return mg_stat(path, stp);
+  mg_strlcpy(job->path, path, sizeof(job->path));
+  if (run_io_job(conn, job) != 0)
+    return -1;
+  *stp = job->st;
+  return job->rv;
+}
 
-  return -1;
+// mg_fopen() through the disk I/O pool.
+static FILE *conn_fopen(struct mg_connection *conn, const char *path, const char *mode) {
+  struct mg_io_job *job;
+
+  if (conn->disk_io_status != 0)
+    return NULL;
+  if ((job = get_io_job(conn, MG_IO_FOPEN)) == NULL)
+    return mg_fopen(path, mode);
+  mg_strlcpy(job->path, path, sizeof(job->path));
+  job->mode = mode;
+  if (run_io_job(conn, job) != 0)
+    return NULL;
+  return job->fp;
 }
 
-// Parse UTC date-time string, and return the corresponding time_t value.
-static time_t parse_date_string(const char *datetime) {
+// fread() through the disk I/O pool. When the read times out, the file is
+// handed over to the I/O thread and *fpp is set to NULL: the caller must
+// not close it.
+static int conn_fread(struct mg_connection *conn, FILE **fpp, char *buf, int len) {
+  struct mg_io_job *job;
+
+  if (conn->disk_io_status != 0)
+    return -1;
+  if ((job = get_io_job(conn, MG_IO_FREAD)) == NULL)
+    return (int) fread(buf, 1, (size_t) len, *fpp);
+  job->fp = *fpp;
+  job->len = (size_t) MG_MIN(len, (int) sizeof(job->data));
+  if (run_io_job(conn, job) != 0) {
+    if (conn->io_job != job)
+      *fpp = NULL;
+    else
+      job->fp = NULL;
+    return -1;
+  }
+  job->fp = NULL;
+  if (job->rv > 0)
+    memcpy(buf, job->data, (size_t) job->rv);
+  return job->rv;
+}
+
+// opendir() through the disk I/O pool.
+static DIR *conn_opendir(struct mg_connection *conn, const char *path) {
+  struct mg_io_job *job;
+
+  if (conn->disk_io_status != 0)
+    return NULL;
+  if ((job = get_io_job(conn, MG_IO_OPENDIR)) == NULL)
+    return opendir(path);
+  mg_strlcpy(job->path, path, sizeof(job->path));
+  if (run_io_job(conn, job) != 0)
+    return NULL;
+  return job->dir;
+}
+
+// readdir() through the disk I/O pool; return the name of the next entry or
+// NULL when done. When the call times out, the directory is handed over to
+// the I/O thread and *dirpp is set to NULL: the caller must not close it.
+static const char *conn_readdir(struct mg_connection *conn, DIR **dirpp) {
+  struct mg_io_job *job;
+  struct dirent *dp;
+
+  if (conn->disk_io_status != 0)
+    return NULL;
+  if ((job = get_io_job(conn, MG_IO_READDIR)) == NULL) {
+    dp = readdir(*dirpp);
+    return (dp != NULL ? dp->d_name : NULL);
+  }
+  job->dir = *dirpp;
+  if (run_io_job(conn, job) != 0) {
+    if (conn->io_job != job)
+      *dirpp = NULL;
+    else
+      job->dir = NULL;
+    return NULL;
+  }
+  job->dir = NULL;
+  return (job->rv == 0 ? job->path : NULL);
+}
+
+// URI maps, i.e. the url_rewrite_patterns and protect_uri options, are
+// compiled into a table of rules plus a character trie of the literal text
+// each rule's URI pattern (or each of its '|' alternatives) starts with. Each
+// trie node lists the rules, in ascending order, having an alternative
+// starting with the text spelled by the path to that node; the root lists
+// the rules with an alternative which starts with a wildcard. Walking the
+// URI down the trie therefore only visits the rules which can possibly
+// match, and the first rule in list order which does match wins, as before.
+struct uri_map_rule {
+  struct mg_pattern *pat;               // NULL: 'key' is a plain URI prefix
+  struct vec key;                       // the URI pattern or prefix
+  struct vec value;                     // e.g. the substitution: the new path prefix
+};
+
+struct uri_map_node {
+  int c;                                // the character leading to this node
+  int child;                            // first child; -1: none
+  int sibling;                          // next child of the parent; -1: none
+  int first_link;                       // the rules listed at this node; -1: none
+};
+
+struct uri_map_link {
+  int rule;
+  int next;
+};
+
+struct mg_uri_map {
+  int num_rules;
+  struct uri_map_rule *rules;
+  struct uri_map_node *nodes;           // nodes[0] is the root
+  struct uri_map_link *links;
+};
+
+static void free_uri_map(struct mg_uri_map *map) {
+  int i;
+
+  if (map != NULL) {
+    for (i = 0; map->rules != NULL && i < map->num_rules; i++)
+      free_pattern(map->rules[i].pat);
+    free(map->rules);
+    free(map->nodes);
+    free(map->links);
+    free(map);
+  }
+}
+
+// Return the k-th character of the literal text the j-th alternative of the
+// rule starts with, or -1 beyond that.
+static int uri_map_key_char(const struct uri_map_rule *rule, int j, int k) {
+  const struct pattern_alt *alt;
+  const struct pattern_insn *insn;
+
+  if (rule->pat == NULL)
+    return (k < (int) rule->key.len ? (unsigned char) rule->key.ptr[k] : -1);
+  alt = &rule->pat->alts[j];
+  switch (alt->kind) {
+  case PAT_KIND_LITERAL:
+    return (k < alt->lit_len ? (unsigned char) alt->lit[k] : -1);
+  case PAT_KIND_PROGRAM:
+    insn = &rule->pat->insns[alt->first_insn + k];
+    return (k < alt->num_insns && insn->op == PAT_CHAR ? (unsigned char) insn->c : -1);
+  default:
+    return -1;
+  }
+}
+
+// Compile the 'key=value,...' URI map 'list', which must outlive the result.
+// The keys are patterns when 'is_pattern' is set, plain URI prefixes
+// otherwise. Return NULL when out of memory.
+static struct mg_uri_map *compile_uri_map(struct mg_context *ctx, const char *list,
+                                          int is_pattern) {
+  struct mg_uri_map *map;
+  struct uri_map_rule *rule;
+  struct uri_map_node *node;
+  struct vec a, b;
+  const char *p;
+  char *pattern;
+  int i, j, k, c, n, num_alts, num_nodes = 1, num_links = 0, max_nodes = 1, max_links = 0;
+
+  if ((map = (struct mg_uri_map *) calloc(1, sizeof(*map))) == NULL)
+    goto oom;
+  for (p = list; (p = next_option(p, &a, &b)) != NULL; )
+    map->num_rules++;
+  if ((map->rules = (struct uri_map_rule *) calloc(map->num_rules + 1, sizeof(*map->rules))) == NULL)
+    goto oom;
+  for (i = 0, p = list; (p = next_option(p, &a, &b)) != NULL; i++) {
+    rule = &map->rules[i];
+    rule->key = a;
+    rule->value = b;
+    if (is_pattern) {
+      if ((pattern = (char *) malloc(a.len + 1)) == NULL)
+        goto oom;
+      memcpy(pattern, a.ptr, a.len);
+      pattern[a.len] = '\0';
+      rule->pat = compile_pattern(pattern);
+      free(pattern);
+      if (rule->pat == NULL)
+        goto oom;
+    }
+    num_alts = (rule->pat != NULL ? rule->pat->num_alts : 1);
+    for (j = 0; j < num_alts; j++) {
+      for (k = 0; uri_map_key_char(rule, j, k) >= 0; k++)
+        ;
+      max_nodes += k;
+      max_links++;
+    }
+  }
+  map->nodes = (struct uri_map_node *) malloc(max_nodes * sizeof(*map->nodes));
+  map->links = (struct uri_map_link *) malloc((max_links + 1) * sizeof(*map->links));
+  if (map->nodes == NULL || map->links == NULL)
+    goto oom;
+  map->nodes[0].c = -1;
+  map->nodes[0].child = map->nodes[0].sibling = map->nodes[0].first_link = -1;
+
+  // walk the rules backwards, prepending them to the node lists, which
+  // thus end up in ascending order:
+  for (i = map->num_rules - 1; i >= 0; i--) {
+    rule = &map->rules[i];
+    num_alts = (rule->pat != NULL ? rule->pat->num_alts : 1);
+    for (j = 0; j < num_alts; j++) {
+      for (n = 0, k = 0; (c = uri_map_key_char(rule, j, k)) >= 0; k++) {
+        int child;
+
+        for (child = map->nodes[n].child; child >= 0 && map->nodes[child].c != c; )
+          child = map->nodes[child].sibling;
+        if (child < 0) {
+          child = num_nodes++;
+          node = &map->nodes[child];
+          node->c = c;
+          node->child = node->first_link = -1;
+          node->sibling = map->nodes[n].child;
+          map->nodes[n].child = child;
+        }
+        n = child;
+      }
+      node = &map->nodes[n];
+      if (node->first_link < 0 || map->links[node->first_link].rule != i) {
+        map->links[num_links].rule = i;
+        map->links[num_links].next = node->first_link;
+        node->first_link = num_links++;
+      }
+    }
+  }
+  return map;
+
+oom:
+  mg_cry(fc(ctx), "%s: out of memory", __func__);
+  free_uri_map(map);
+  return NULL;
+}
+
+// Return the first rule whose pattern matches a non-empty prefix of 'uri',
+// or whose plain prefix 'uri' starts with, and the length of that prefix in
+// *match_len; NULL when none does.
+static const struct uri_map_rule *match_uri_map(const struct mg_uri_map *map,
+                                                const char *uri, int *match_len) {
+  const struct uri_map_rule *rule;
+  const struct uri_map_link *link;
+  const char *p = uri;
+  int n = 0, best = map->num_rules, len, l;
+
+  *match_len = 0;
+  for (;;) {
+    for (l = map->nodes[n].first_link; l >= 0 && map->links[l].rule < best; l = link->next) {
+      link = &map->links[l];
+      rule = &map->rules[link->rule];
+      if ((len = (rule->pat == NULL ? (int) rule->key.len : match_pattern(rule->pat, uri))) > 0 ||
+          rule->pat == NULL) {
+        best = link->rule;
+        *match_len = len;
+        break;
+      }
+    }
+    if (*p == '\0')
+      break;
+    for (n = map->nodes[n].child; n >= 0 && map->nodes[n].c != (unsigned char) *p; )
+      n = map->nodes[n].sibling;
+    if (n < 0)
+      break;
+    p++;
+  }
+  return (best < map->num_rules ? &map->rules[best] : NULL);
+}
+
+static int convert_uri_to_file_name(struct mg_connection *conn, char *buf,
+                                    size_t buf_len, struct mgstat *st) {
+  struct mg_config *cfg = conn_config(conn);
+  const struct uri_map_rule *rule;
+  struct vec a, b;
+  const char *rewrite, *uri = conn->request_info.uri;
+  char *p;
+  int match_len, stat_result;
+
+  buf_len--;  // This is because memmove() for PATH_INFO may shift part
+              // of the path one byte on the right.
+  mg_snprintf(conn, buf, buf_len, "%s%s", get_conn_option(conn, DOCUMENT_ROOT), uri);
+
+  rewrite = get_conn_option(conn, REWRITE);
+  if (is_config_option_value(cfg, REWRITE, rewrite) && cfg->rewrite != NULL) {
+    if ((rule = match_uri_map(cfg->rewrite, uri, &match_len)) != NULL) {
+      b = rule->value;
+      mg_snprintf(conn, buf, buf_len, "%.*s%s", (int)b.len, b.ptr, uri + match_len);
+    }
+  } else {
+    while ((rewrite = next_option(rewrite, &a, &b)) != NULL) {
+      if ((match_len = match_string(a.ptr, (int)a.len, uri)) > 0) {
+        mg_snprintf(conn, buf, buf_len, "%.*s%s", (int)b.len, b.ptr, uri + match_len);
+        break;
+      }
+    }
+  }
+
+  // Win32: CGI can fail when being fed an interpreter plus relative path to the script;
+  // keep in mind that other scenarios, e.g. user event handlers, may fail similarly
+  // when receiving relative filesystem paths, so we solve the issue once and for all,
+  // right here. A clean absolute path would only see its symlinks resolved, so we
+  // save ourselves the filesystem round trips in that (common) case.
+  if (!is_clean_absolute_path(buf))
+    mg_mk_fullpath(buf, buf_len);
+
+  if ((stat_result = conn_stat(conn, buf, st)) != 0) {
+
+    // Support PATH_INFO for CGI scripts.
+    for (p = buf + strlen(buf); p > buf + 1; p--) {
+      if (*p == '/') {
+        *p = '\0';
+        if (match_option(conn, CGI_EXTENSIONS, buf) > 0 &&
+            (stat_result = conn_stat(conn, buf, st)) == 0) {
+          // Shift PATH_INFO block one character right, e.g.
+          //  "/x.cgi/foo/bar\x00" => "/x.cgi\x00/foo/bar\x00"
+          // conn->path_info is pointing to the local variable "path" declared
+          // in handle_request(), so PATH_INFO is not valid after
+          // handle_request returns.
+          conn->request_info.path_info = p + 1;
+          memmove(p + 2, p + 1, strlen(p + 1) + 1);  // +1 is for trailing \0
+          p[1] = '/';
+          break;
+        } else {
+          *p = '/';
+          stat_result = -1;
+        }
+      }
+    }
+  }
+
+  DEBUG_TRACE(0x0200, ("[%s] -> [%s], [%.*s]", uri, buf, (int) b.len, b.ptr));
+
+  return stat_result;
+}
+
+#if !defined(NO_SSL)
+static int sslize(struct mg_connection *conn, SSL_CTX *ssl_ctx, int (*func)(SSL *)) {
+  MG_ASSERT(ssl_ctx);
+  if ((conn->ssl = SSL_new(ssl_ctx)) != NULL &&
+    SSL_set_fd(conn->ssl, conn->client.sock) == 1) {
+    int rv;
+    do {
+      rv = func(conn->ssl);
+    } while (ssl_renegotiation_ongoing(conn, &rv));
+    return (rv == 1);
+  }
+  return 0;
+}
+
+// Advance the TLS handshake of an accepted connection as far as the data
+// which the client has sent so far allows, without blocking.
+//
+// Return 1 when the handshake has completed, 0 when it needs more data from
+// the client, -1 on failure.
+static int ssl_accept_step(struct mg_connection *conn) {
+  int rv, err;
+
+  if (conn->ssl == NULL) {
+    if ((conn->ssl = SSL_new(conn->ctx->ssl_ctx)) == NULL ||
+        SSL_set_fd(conn->ssl, conn->client.sock) != 1)
+      return -1;
+    // the idle queue expires clients which go silent; this catches the
+    // ones which trickle their handshake in byte by byte:
+    if (conn->client.max_idle_seconds > 0)
+      conn->client.handshake_deadline = time(NULL) + conn->client.max_idle_seconds;
+    // the socket stays non-blocking until the handshake is done
+    (void) set_non_blocking_mode(conn->client.sock, 1);
+  } else if (conn->client.handshake_deadline != 0 &&
+             time(NULL) >= conn->client.handshake_deadline) {
+    mg_cry(conn, "%s: TLS handshake timed out", __func__);
+    (void) set_non_blocking_mode(conn->client.sock, 0);
+    return -1;
+  }
+
+  for (;;) {
+    rv = SSL_accept(conn->ssl);
+    err = (rv == 1 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, rv));
+    if (err == SSL_ERROR_WANT_WRITE &&
+        conn->client.handshake_deadline != 0 &&
+        time(NULL) >= conn->client.handshake_deadline) {
+      mg_cry(conn, "%s: TLS handshake timed out", __func__);
+    } else if (err == SSL_ERROR_WANT_WRITE) {
+      // our flight doesn't fit in the socket send buffer: that's rare
+      // enough to simply wait for it to drain, as long as the client
+      // keeps reading
+      fd_set fdw;
+      int max_fh = -1;
+      struct timeval tv;
+
+      tv.tv_sec = MG_SELECT_TIMEOUT_MSECS / 1000;
+      tv.tv_usec = (MG_SELECT_TIMEOUT_MSECS % 1000) * 1000;
+      FD_ZERO(&fdw);
+      add_to_set(conn->client.sock, &fdw, &max_fh);
+      if (select(max_fh + 1, NULL, &fdw, NULL, &tv) > 0 && conn->ctx->stop_flag == 0)
+        continue;
+    }
+    break;
+  }
+
+  // reset the select() markers used by consume_socket() et al, unless
+  // the request is already there: no need for a trip through the idle
+  // queue then.
+  conn->client.was_idle = 0;
+  conn->client.has_read_data = 0;
+  if (err == SSL_ERROR_WANT_READ) {
+    return 0;
+  }
+  (void) set_non_blocking_mode(conn->client.sock, 0);
+  if (err != SSL_ERROR_NONE) {
+    return -1;
+  }
+  conn->client.handshake_deadline = 0;
+  if (SSL_pending(conn->ssl) == 0) {
+    fd_set fdr;
+    int max_fh = -1;
+    struct timeval tv = {0};
+
+    FD_ZERO(&fdr);
+    add_to_set(conn->client.sock, &fdr, &max_fh);
+    if (select(max_fh + 1, &fdr, NULL, NULL, &tv) <= 0)
+      return 1;
+  }
+  conn->client.was_idle = 1;
+  conn->client.has_read_data = 1;
+  return 1;
+}
+#else // NO_SSL
+#define sslize(conn, s, f)     0
+#define ssl_accept_step(conn)  (-1)
+#endif // NO_SSL
+
+// Check whether full request is buffered. Return:
+//   -1  if request is malformed
+//    0  if request is not yet fully buffered
+//   >0  actual request length, including last \r\n\r\n
+//
+// The scan starts at offset *scan_pos (0 for a fresh buffer). When the
+// request is not yet complete, *scan_pos is updated to the offset where the
+// next scan of the same, extended, buffer should resume. This keeps header
+// reception linear when the request arrives in many small segments.
+//
+// Only LF and illegal control characters need a closer look, so the SIMD
+// paths skip 32/16 byte blocks which contain neither.
+static int get_request_len(const char *buf, int buflen, int *scan_pos) {
+  const unsigned char *s = (const unsigned char *) buf;
+  int i = *scan_pos;
+
+  while (i < buflen - 1) {
+#if defined(MG_HAVE_AVX2)
+    for (; i + 32 < buflen; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+      __m256i m = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1F)), v);
+      unsigned int mask;
+
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+      m = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), m);
+      mask = (unsigned int) _mm256_movemask_epi8(m);
+      if (mask) {
+        i += lowest_bit_index(mask);
+        break;
+      }
+    }
+#endif
+#if defined(MG_HAVE_SSE2)
+    for (; i + 16 < buflen; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+      __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v);
+      unsigned int mask;
+
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+      m = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), m);
+      mask = (unsigned int) _mm_movemask_epi8(m);
+      if (mask) {
+        i += lowest_bit_index(mask);
+        break;
+      }
+    }
+    if (i >= buflen - 1)
+      break;
+#endif
+    // Control characters are not allowed but >=128 is.
+    if (s[i] < 0x20 ? (s[i] != '\r' && s[i] != '\n') : s[i] == 0x7F) {
+      return -1; // [i_a] abort scan as soon as one malformed character is found; don't let subsequent \r\n\r\n win us over anyhow
+    } else if (s[i] == '\n' && s[i + 1] == '\n') {
+      return i + 2;
+    } else if (s[i] == '\n' && i + 2 < buflen &&
+        s[i + 1] == '\r' && s[i + 2] == '\n') {
+      return i + 3;
+    }
+    i++;
+  }
+
+  // a LF in either of the last two bytes may still start a terminator:
+  if (*scan_pos < buflen - 2)
+    *scan_pos = buflen - 2;
+  return 0;
+}
+
+// Convert month to the month number. Return -1 on error, or month number
+static int get_month_index(const char *s) {
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(month_names); i++)
+    if (!strcmp(s, month_names[i]))
+      return (int) i;
+
+  return -1;
+}
+
+// Parse UTC date-time string, and return the corresponding time_t value.
+static time_t parse_date_string(const char *datetime) {
   static const unsigned short days_before_month[] = {
     0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
   };
@@ -4261,28 +6212,6 @@ static time_t parse_date_string(const char *datetime) {
   return result;
 }
 
-// Protect against directory disclosure attack by removing '..',
-// excessive '/' and '\' characters
-static void remove_double_dots_and_double_slashes(char *s) {
-  char *p = s;
-
-  while (*s != '\0') {
-    *p++ = *s++;
-    if (IS_DIRSEP_CHAR(s[-1])) {
-      // Skip all following slashes and backslashes
-      while (IS_DIRSEP_CHAR(s[0])) {
-        s++;
-      }
-
-      // Skip all double-dots
-      while (*s == '.' && s[1] == '.') {
-        s += 2;
-      }
-    }
-  }
-  *p = '\0';
-}
-
 static const struct {
   const char *extension;
   size_t ext_len;
@@ -4360,31 +6289,190 @@ const char *mg_get_builtin_mime_type(const char *path) {
   return get_builtin_mime_type(path, "text/plain");
 }
 
+struct mime_type_entry {
+  const char *ext;                      // the extension or path suffix, e.g. ".html"; not NUL terminated
+  size_t ext_len;
+  struct vec mime_type;                 // e.g. "text/html"
+  const char *content_type;             // the Content-Type header value, e.g. "text/html; charset=utf-8"
+  int next;                             // next entry in the hash chain; -1: none
+};
+
+// The MIME types of the extra_mime_types option and builtin_mime_types[],
+// hashed by file extension.
+struct mg_mime_types {
+  int bucket[64];                       // first entry of each hash chain; -1: none
+  int num_compound;
+  int *compound;                        // the extra_mime_types entries which are not a plain ".ext", in list order
+  struct mime_type_entry *entries;      // the extra_mime_types entries in list order, then builtin_mime_types[]
+};
+
+static unsigned int mime_ext_hash(const char *ext, size_t len) {
+  unsigned int h = 0;
+
+  while (len-- > 0)
+    h = h * 31 + lowercase(ext++);
+  return h % ARRAY_SIZE(((struct mg_mime_types *) 0)->bucket);
+}
+
+// Return the final extension of 'path', including the dot, or NULL.
+static const char *get_path_extension(const char *path, size_t path_len) {
+  const char *p = path + path_len;
+
+  while (p > path && p[-1] != '.' && p[-1] != '/')
+    p--;
+  return (p > path && p[-1] == '.' ? p - 1 : NULL);
+}
+
+// Build the MIME type table for the extra_mime_types 'list', which must
+// outlive the table. Return NULL when out of memory.
+static struct mg_mime_types *compile_mime_types(struct mg_context *ctx, const char *list) {
+  struct mg_mime_types *mt;
+  struct mime_type_entry *e;
+  struct vec ext_vec, mime_vec;
+  const char *p;
+  char *strings;
+  size_t size, n = 0, num_extra, i, j;
+  unsigned int h;
+  int k;
+
+  size = 0;
+  for (p = list; (p = next_option(p, &ext_vec, &mime_vec)) != NULL; n++)
+    size += mime_vec.len + sizeof("; charset=utf-8");
+  for (i = 0; builtin_mime_types[i].extension != NULL; i++)
+    size += strlen(builtin_mime_types[i].mime_type) + sizeof("; charset=utf-8");
+  num_extra = n;
+  n += i;
+  mt = (struct mg_mime_types *) malloc(sizeof(*mt) + n * (sizeof(*e) + sizeof(int)) + size);
+  if (mt == NULL) {
+    mg_cry(fc(ctx), "%s: out of memory", __func__);
+    return NULL;
+  }
+  mt->entries = (struct mime_type_entry *) (mt + 1);
+  mt->compound = (int *) (mt->entries + n);
+  mt->num_compound = 0;
+  strings = (char *) (mt->compound + n);
+  for (i = 0; i < ARRAY_SIZE(mt->bucket); i++)
+    mt->bucket[i] = -1;
+
+  for (i = 0, p = list; i < n; i++) {
+    e = &mt->entries[i];
+    if (p != NULL && (p = next_option(p, &ext_vec, &mime_vec)) != NULL) {
+      e->ext = ext_vec.ptr;
+      e->ext_len = ext_vec.len;
+      e->mime_type = mime_vec;
+    } else {
+      j = i - num_extra;
+      e->ext = builtin_mime_types[j].extension;
+      e->ext_len = builtin_mime_types[j].ext_len;
+      e->mime_type.ptr = builtin_mime_types[j].mime_type;
+      e->mime_type.len = strlen(e->mime_type.ptr);
+    }
+    // 'text/...' mime types default to ISO-8859-1; make sure they use the more modern UTF-8 charset instead:
+    e->content_type = strings;
+    if (e->mime_type.len > 5 && !memcmp("text/", e->mime_type.ptr, 5))
+      strings += sprintf(strings, "%.*s; charset=utf-8", (int) e->mime_type.len, e->mime_type.ptr) + 1;
+    else
+      strings += sprintf(strings, "%.*s", (int) e->mime_type.len, e->mime_type.ptr) + 1;
+
+    e->next = -1;
+    if (e->ext_len == 0 ||
+        get_path_extension(e->ext, e->ext_len) != e->ext) {
+      mt->compound[mt->num_compound++] = (int) i;
+      continue;
+    }
+    // the first entry for an extension wins: only hash that one
+    h = mime_ext_hash(e->ext, e->ext_len);
+    for (k = mt->bucket[h]; k >= 0; k = mt->entries[k].next) {
+      if (mt->entries[k].ext_len == e->ext_len &&
+          !mg_strncasecmp(mt->entries[k].ext, e->ext, e->ext_len))
+        break;
+    }
+    if (k < 0) {
+      e->next = mt->bucket[h];
+      mt->bucket[h] = (int) i;
+    }
+  }
+  return mt;
+}
+
+// Return the entry for 'path' in the MIME type table, or NULL when unknown.
+static const struct mime_type_entry *lookup_mime_type(const struct mg_mime_types *mt,
+                                                      const char *path) {
+  const struct mime_type_entry *e;
+  size_t path_len = strlen(path);
+  const char *ext = get_path_extension(path, path_len);
+  int i, best = -1;
+
+  if (ext != NULL) {
+    size_t ext_len = path + path_len - ext;
+
+    for (i = mt->bucket[mime_ext_hash(ext, ext_len)]; i >= 0; i = e->next) {
+      e = &mt->entries[i];
+      if (e->ext_len == ext_len && !mg_strncasecmp(e->ext, ext, ext_len)) {
+        best = i;
+        break;
+      }
+    }
+  }
+  // an extra_mime_types entry for a path suffix such as ".tar.gz" wins
+  // when it comes earlier in the list
+  for (i = 0; i < mt->num_compound && (best < 0 || mt->compound[i] < best); i++) {
+    e = &mt->entries[mt->compound[i]];
+    if (e->ext_len <= path_len &&
+        !mg_strncasecmp(path + path_len - e->ext_len, e->ext, e->ext_len)) {
+      best = mt->compound[i];
+      break;
+    }
+  }
+  return (best >= 0 ? &mt->entries[best] : NULL);
+}
+
 // Look at the "path" extension and figure what mime type it has.
 // Store mime type in the vector.
 // Return the default MIME type string when the MIME type is not known.
-static void get_mime_type(struct mg_context *ctx, const char *path,
-                          const char *default_mime_type, struct vec *vec) {
+//
+// Return the matching Content-Type header value, charset included, when it
+// is readily available; NULL otherwise.
+//
+// When 'conn' is not NULL, the extra MIME types of the snapshot the
+// connection is bound to apply; otherwise those of the context.
+static const char *get_mime_type(struct mg_context *ctx, struct mg_connection *conn,
+                                 const char *path, const char *default_mime_type,
+                                 struct vec *vec) {
+  struct mg_config *cfg = (conn != NULL ? conn_config(conn) : ctx_config(ctx));
+  const struct mime_type_entry *e;
   struct vec ext_vec, mime_vec;
   const char *list, *ext;
   size_t path_len;
 
+  list = (conn != NULL ? get_conn_option(conn, EXTRA_MIME_TYPES) :
+          get_option(ctx, EXTRA_MIME_TYPES));
+  if (is_config_option_value(cfg, EXTRA_MIME_TYPES, list) && cfg->mime != NULL) {
+    if ((e = lookup_mime_type(cfg->mime, path)) != NULL) {
+      *vec = e->mime_type;
+      return e->content_type;
+    }
+    vec->ptr = default_mime_type;
+    vec->len = (vec->ptr ? strlen(vec->ptr) : 0);
+    return NULL;
+  }
+
   path_len = strlen(path);
 
   // Scan user-defined mime types first, in case user wants to
   // override default mime types.
-  list = get_option(ctx, EXTRA_MIME_TYPES);
   while ((list = next_option(list, &ext_vec, &mime_vec)) != NULL) {
     // ext now points to the path suffix
     ext = path + path_len - ext_vec.len;
     if (mg_strncasecmp(ext, ext_vec.ptr, ext_vec.len) == 0) {
       *vec = mime_vec;
-      return;
+      return NULL;
     }
   }
 
   vec->ptr = get_builtin_mime_type(path, default_mime_type);
   vec->len = (vec->ptr ? strlen(vec->ptr) : 0);
+  return NULL;
 }
 
 #ifndef HAVE_MD5
@@ -4619,11 +6707,9 @@ static int check_password(const char *method, const char *ha1, const char *uri,
   }
 
   // NOTE(lsm): due to a bug in MSIE, we do not compare the URI
-  // TODO(lsm): check for authentication timeout
+  // The nonce and its nonce count are checked by check_nonce().
   if (// strcmp(dig->uri, c->ouri) != 0 ||
-      strlen(response) != 32
-      // || now - strtoul(dig->nonce, NULL, 10) > 3600
-      ) {
+      strlen(response) != 32) {
     return 0;
   }
 
@@ -4634,25 +6720,390 @@ static int check_password(const char *method, const char *ha1, const char *uri,
   return mg_strcasecmp(response, expected_response) == 0;
 }
 
+// Return 1 when slot 'n' tracks the unexpired nonce with sequence number
+// 'seq'. The caller must hold ctx->nonce_mutex.
+static int is_outstanding_nonce(const struct mg_auth_nonce *n, unsigned long seq, time_t now) {
+  return seq != 0 && n->seq == seq &&
+         now >= n->issued && now - n->issued <= MG_AUTH_NONCE_TIMEOUT;
+}
+
+// Return the key new_nonce() rate-limits the connection's client by: a hash
+// of the remote address, never 0.
+static unsigned int nonce_client_key(const struct mg_connection *conn) {
+  const unsigned char *p = (const unsigned char *) &conn->client.rsa.u.sin.sin_addr;
+  size_t len = sizeof(conn->client.rsa.u.sin.sin_addr);
+  unsigned int h = 0;
+
+#if defined(USE_IPV6)
+  if (conn->client.rsa.u.sa.sa_family == AF_INET6) {
+    p = (const unsigned char *) &conn->client.rsa.u.sin6.sin6_addr;
+    len = sizeof(conn->client.rsa.u.sin6.sin6_addr);
+  }
+#endif
+  while (len-- > 0)
+    h = h * 31 + *p++;
+  return (h != 0 ? h : 1);
+}
+
+// Hand out a nonce: "<issue time><sequence number>", both in hex, where the
+// sequence number selects the ctx->nonces[] slot tracking it.
+//
+// 'reuse_seq' is the sequence number of the client's current nonce (0: none):
+// while that one is outstanding, it is handed out again. So is the last
+// nonce handed out to 'client' (see nonce_client_key()) while it is younger
+// than MG_AUTH_NONCE_MIN_AGE. Otherwise a fresh nonce takes the oldest slot
+// and its previous nonce is forgotten. A 'client' of 0 always gets a fresh
+// nonce.
+//
+// Every client gets a nonce of its own this way, so the nonce counts of
+// different clients do not collide, while a flood of unauthenticated
+// requests from one address cannot evict the nonces of the other clients.
+static void new_nonce(struct mg_context *ctx, char *buf, size_t buf_len,
+                      unsigned long reuse_seq, unsigned int client) {
+  struct mg_auth_nonce *n;
+  unsigned long seq, *last = &ctx->client_nonces[client % MG_MAX_AUTH_NONCES];
+  time_t now = time(NULL);
+
+  (void) pthread_mutex_lock(&ctx->nonce_mutex);
+  n = &ctx->nonces[reuse_seq % MG_MAX_AUTH_NONCES];
+  if (!is_outstanding_nonce(n, reuse_seq, now)) {
+    n = &ctx->nonces[*last % MG_MAX_AUTH_NONCES];
+    if (client == 0 || n->client != client || !is_outstanding_nonce(n, *last, now) ||
+        now - n->issued >= MG_AUTH_NONCE_MIN_AGE) {
+      if ((seq = ctx->nonce_seq + 1) == 0)
+        seq = 1;
+      n = &ctx->nonces[seq % MG_MAX_AUTH_NONCES];
+      ctx->nonce_seq = seq;
+      n->seq = seq;
+      n->issued = now;
+      n->client = client;
+      n->max_nc = 0;
+      n->nc_seen = 0;
+      if (client != 0)
+        *last = seq;
+    }
+  }
+  (void) snprintf(buf, buf_len, "%08lx%lx", (unsigned long) n->issued, n->seq);
+  (void) pthread_mutex_unlock(&ctx->nonce_mutex);
+}
+
+// Return the ctx->nonces[] slot tracking 'nonce' when it is an outstanding
+// nonce handed out by new_nonce(), NULL otherwise.
+// The caller must hold ctx->nonce_mutex.
+static struct mg_auth_nonce *find_nonce(struct mg_context *ctx, const char *nonce, time_t now) {
+  struct mg_auth_nonce *n;
+  char issued_str[9];
+  unsigned long seq;
+
+  if (nonce == NULL || strlen(nonce) <= 8 ||
+      strspn(nonce, "0123456789abcdef") != strlen(nonce) ||
+      strlen(nonce) > 8 + 2 * sizeof(seq))
+    return NULL;
+  mg_strlcpy(issued_str, nonce, sizeof(issued_str));
+  seq = strtoul(nonce + 8, NULL, 16);
+  n = &ctx->nonces[seq % MG_MAX_AUTH_NONCES];
+  if (!is_outstanding_nonce(n, seq, now) ||
+      (unsigned long) n->issued != strtoul(issued_str, NULL, 16))
+    return NULL;
+  return n;
+}
+
+// Return the sequence number of 'nonce' when it is outstanding, 0 otherwise.
+static unsigned long lookup_nonce(struct mg_context *ctx, const char *nonce) {
+  struct mg_auth_nonce *n;
+  unsigned long seq;
+
+  (void) pthread_mutex_lock(&ctx->nonce_mutex);
+  n = find_nonce(ctx, nonce, time(NULL));
+  seq = (n != NULL ? n->seq : 0);
+  (void) pthread_mutex_unlock(&ctx->nonce_mutex);
+  return seq;
+}
+
+// Return 1 when 'nonce' is an outstanding nonce handed out by new_nonce()
+// and the nonce count 'nc' has not been used with it before. Nonce counts
+// may arrive out of order, as clients send parallel requests over several
+// connections, so the last 64 counts are remembered.
+static int check_nonce(struct mg_context *ctx, const char *nonce, const char *nc) {
+  struct mg_auth_nonce *n;
+  unsigned long count, d;
+  int ok;
+
+  if (strspn(nc, "0123456789abcdefABCDEF") != strlen(nc) || strlen(nc) > 8 ||
+      (count = strtoul(nc, NULL, 16)) == 0)
+    return 0;
+
+  (void) pthread_mutex_lock(&ctx->nonce_mutex);
+  n = find_nonce(ctx, nonce, time(NULL));
+  ok = (n != NULL);
+  if (ok && count > n->max_nc) {
+    d = count - n->max_nc;
+    n->nc_seen = (d < 64 ? n->nc_seen << d : 0) | 1;
+    n->max_nc = count;
+  } else if (ok) {
+    d = n->max_nc - count;
+    if (d >= 64 || (n->nc_seen & ((uint64_t) 1 << d)))
+      ok = 0;
+    else
+      n->nc_seen |= (uint64_t) 1 << d;
+  }
+  (void) pthread_mutex_unlock(&ctx->nonce_mutex);
+  return ok;
+}
+
+// Passwords files are parsed once into a hash table of the
+// 'user:domain:ha1' lines and cached per path, until a stat() shows the file
+// has been changed. A file modified within the second it was parsed in may
+// change again without its mtime showing it, so such a file is parsed again
+// on the next lookup, until it has aged.
+struct passwd_entry {
+  const char *user;
+  const char *domain;
+  const char *ha1;
+  unsigned int hash;
+  int next;                             // next entry in the hash chain; -1: none
+};
+
+struct mg_passwords {
+  int refcount;                         // protected by ctx->passwords_mutex
+  time_t mtime;                         // the file's mtime and size when it was parsed
+  int64_t size;
+  int is_stable;                        // 0 when the file was modified in the second it was parsed in
+  int num_buckets;                      // a power of 2
+  int *bucket;                          // first entry of each hash chain; -1: none
+  struct passwd_entry *entries;         // the valid lines, in file order
+  char data[1];                         // the file contents; the entries point in here
+};
+
+// The table used when a passwords file exists but cannot be loaded into
+// memory: it denies everyone, as that file would have done for all we know.
+static struct mg_passwords no_passwords = {1, 0, 0, 0, 1, NULL, NULL, ""};
+
+static unsigned int passwd_hash(const char *user, const char *domain) {
+  unsigned int h = ':';
+
+  while (*user)
+    h = h * 31 + (unsigned char) *user++;
+  while (*domain)
+    h = h * 31 + (unsigned char) *domain++;
+  return h;
+}
+
+static void free_passwords(struct mg_passwords *pw) {
+  if (pw != NULL && pw != &no_passwords) {
+    free(pw->entries);
+    free(pw);
+  }
+}
+
+// Parse the passwords file 'path'. The entries are the lines which the
+// classic 'sscanf("%[^:]:%[^:]:%s")' loop accepts. Return NULL when the file
+// cannot be opened; &no_passwords when out of memory.
+static struct mg_passwords *load_passwords(struct mg_connection *conn, const char *path,
+                                           const struct mgstat *st) {
+  struct mg_passwords *pw;
+  struct passwd_entry *e;
+  FILE *fp = NULL;
+  char *line, *eol, *user, *domain, *ha1;
+  size_t len = 0, n;
+  int num_lines = 1, i, h;
+
+  if (!st->is_directory && (fp = conn_fopen(conn, path, "r")) == NULL)
+    return NULL;
+  if (st->size < 0 || st->size > INT_MAX / 2 ||
+      (pw = (struct mg_passwords *) malloc(sizeof(*pw) + (size_t) st->size)) == NULL) {
+    mg_cry(conn, "%s: out of memory loading %s", __func__, path);
+    if (fp != NULL)
+      mg_fclose(fp);
+    return &no_passwords;
+  }
+  while (fp != NULL && len < (size_t) st->size &&
+         (n = fread(pw->data + len, 1, (size_t) st->size - len, fp)) > 0)
+    len += n;
+  if (fp != NULL)
+    mg_fclose(fp);
+  pw->data[len] = '\0';
+  for (line = pw->data; (line = strchr(line, '\n')) != NULL; line++)
+    num_lines++;
+  for (pw->num_buckets = 16; pw->num_buckets < num_lines; pw->num_buckets *= 2)
+    ;
+  pw->entries = (struct passwd_entry *) malloc(num_lines * sizeof(*pw->entries) +
+                                               pw->num_buckets * sizeof(int));
+  if (pw->entries == NULL) {
+    mg_cry(conn, "%s: out of memory loading %s", __func__, path);
+    free(pw);
+    return &no_passwords;
+  }
+  pw->bucket = (int *) (pw->entries + num_lines);
+  for (i = 0; i < pw->num_buckets; i++)
+    pw->bucket[i] = -1;
+  pw->refcount = 1;
+  pw->mtime = st->mtime;
+  pw->size = st->size;
+  pw->is_stable = (time(NULL) > st->mtime);
+
+  for (i = 0, line = pw->data; line != NULL; line = eol) {
+    if ((eol = strchr(line, '\n')) != NULL)
+      *eol++ = '\0';
+    user = line;
+    if ((domain = strchr(user, ':')) == NULL || domain == user ||
+        domain - user > USRDMNPWD_BUFSIZ)
+      continue;
+    *domain++ = '\0';
+    if ((ha1 = strchr(domain, ':')) == NULL || ha1 == domain ||
+        ha1 - domain > USRDMNPWD_BUFSIZ)
+      continue;
+    *ha1++ = '\0';
+    ha1 += strspn(ha1, " \t\r\f\v");
+    if ((len = strcspn(ha1, " \t\r\f\v")) == 0)
+      continue;
+    ha1[len < USRDMNPWD_BUFSIZ ? len : USRDMNPWD_BUFSIZ] = '\0';
+
+    e = &pw->entries[i];
+    e->user = user;
+    e->domain = domain;
+    e->ha1 = ha1;
+    e->hash = passwd_hash(user, domain);
+    // the first line for a user wins: only hash that one
+    for (h = pw->bucket[e->hash & (pw->num_buckets - 1)]; h >= 0; h = pw->entries[h].next) {
+      if (pw->entries[h].hash == e->hash && !strcmp(pw->entries[h].user, user) &&
+          !strcmp(pw->entries[h].domain, domain))
+        break;
+    }
+    if (h < 0) {
+      e->next = pw->bucket[e->hash & (pw->num_buckets - 1)];
+      pw->bucket[e->hash & (pw->num_buckets - 1)] = i++;
+    }
+  }
+  return pw;
+}
+
+// Return the HA1 of the user in the domain, or NULL when not listed.
+static const char *find_password(const struct mg_passwords *pw, const char *user,
+                                 const char *domain) {
+  const struct passwd_entry *e;
+  unsigned int hash = passwd_hash(user, domain);
+  int i;
+
+  for (i = (pw->bucket != NULL ? pw->bucket[hash & (pw->num_buckets - 1)] : -1); i >= 0; i = e->next) {
+    e = &pw->entries[i];
+    if (e->hash == hash && !strcmp(e->user, user) && !strcmp(e->domain, domain))
+      return e->ha1;
+  }
+  return NULL;
+}
+
+static struct mg_passwords_file *find_passwords_file(struct mg_context *ctx, const char *path,
+                                                     unsigned int hash) {
+  struct mg_passwords_file *pf;
+
+  for (pf = ctx->passwords_files[hash % ARRAY_SIZE(ctx->passwords_files)]; pf != NULL; pf = pf->next) {
+    if (pf->hash == hash && !strcmp(pf->path, path))
+      break;
+  }
+  return pf;
+}
+
+// Drop a reference obtained from open_passwords().
+static void release_passwords(struct mg_context *ctx, struct mg_passwords *pw) {
+  int refcount;
+
+  if (pw == NULL || pw == &no_passwords)
+    return;
+  (void) pthread_mutex_lock(&ctx->passwords_mutex);
+  refcount = --pw->refcount;
+  (void) pthread_mutex_unlock(&ctx->passwords_mutex);
+  if (refcount == 0)
+    free_passwords(pw);
+}
+
+// Return the parsed passwords file 'path', from the cache when the file has
+// not changed since. Return NULL when the file cannot be opened.
+static struct mg_passwords *open_passwords(struct mg_connection *conn, const char *path) {
+  struct mg_context *ctx = conn->ctx;
+  struct mg_passwords_file *pf;
+  struct mg_passwords *pw, *old = NULL;
+  struct mgstat st;
+  unsigned int hash = 0;
+  const char *p;
+  size_t len;
+
+  if (conn_stat(conn, path, &st) != 0)
+    return NULL;
+  for (p = path; *p; p++)
+    hash = hash * 31 + (unsigned char) *p;
+
+  (void) pthread_mutex_lock(&ctx->passwords_mutex);
+  pf = find_passwords_file(ctx, path, hash);
+  pw = (pf != NULL ? pf->pw : NULL);
+  if (pw != NULL && pw->is_stable && pw->mtime == st.mtime && pw->size == st.size)
+    pw->refcount++;
+  else
+    pw = NULL;
+  (void) pthread_mutex_unlock(&ctx->passwords_mutex);
+  if (pw != NULL)
+    return pw;
+
+  if ((pw = load_passwords(conn, path, &st)) == NULL || pw == &no_passwords)
+    return pw;
+
+  len = strlen(path);
+  (void) pthread_mutex_lock(&ctx->passwords_mutex);
+  if ((pf = find_passwords_file(ctx, path, hash)) == NULL &&
+      ctx->num_passwords_files < MG_MAX_PASSWORDS_FILES &&
+      (pf = (struct mg_passwords_file *) malloc(sizeof(*pf) + len)) != NULL) {
+    memcpy(pf->path, path, len + 1);
+    pf->hash = hash;
+    pf->pw = NULL;
+    pf->next = ctx->passwords_files[hash % ARRAY_SIZE(ctx->passwords_files)];
+    ctx->passwords_files[hash % ARRAY_SIZE(ctx->passwords_files)] = pf;
+    ctx->num_passwords_files++;
+  }
+  if (pf != NULL) {
+    if (pf->pw != NULL && --pf->pw->refcount == 0)
+      old = pf->pw;
+    pf->pw = pw;
+    pw->refcount++;
+  }
+  (void) pthread_mutex_unlock(&ctx->passwords_mutex);
+  free_passwords(old);
+  return pw;
+}
+
+// Drop all cached passwords files; no request may be using any of them.
+static void free_passwords_files(struct mg_context *ctx) {
+  struct mg_passwords_file *pf;
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(ctx->passwords_files); i++) {
+    while ((pf = ctx->passwords_files[i]) != NULL) {
+      ctx->passwords_files[i] = pf->next;
+      free_passwords(pf->pw);
+      free(pf);
+    }
+  }
+  ctx->num_passwords_files = 0;
+}
+
 // Use the global passwords file, if specified by auth_gpass option,
 // or search for .htpasswd in the requested directory.
-static FILE *open_auth_file(struct mg_connection *conn, const char *path) {
+static struct mg_passwords *open_auth_file(struct mg_connection *conn, const char *path) {
   char name[PATH_MAX];
   const char *p, *e;
   struct mgstat st;
-  FILE *fp;
+  struct mg_passwords *pw;
   const char *global_pwd_file = get_conn_option(conn, GLOBAL_PASSWORDS_FILE);
 
   if (!is_empty(global_pwd_file)) {
     // Use global passwords file
-    fp =  mg_fopen(global_pwd_file, "r");
-    if (fp == NULL)
+    pw = open_passwords(conn, global_pwd_file);
+    if (pw == NULL)
       mg_cry(conn, "fopen(%s): %s",
              global_pwd_file, mg_strerror(ERRNO));
   } else if (!mg_stat(path, &st) && st.is_directory) {
     (void) mg_snprintf(conn, name, sizeof(name), "%s%c%s",
                        path, DIRSEP, PASSWORDS_FILE_NAME);
-    fp = mg_fopen(name, "r");
+    pw = open_passwords(conn, name);
   } else {
      // Try to find .htpasswd in requested directory.
     for (p = path, e = p + strlen(p) - 1; e > p; e--)
@@ -4660,10 +7111,10 @@ static FILE *open_auth_file(struct mg_connection *conn, const char *path) {
         break;
     (void) mg_snprintf(conn, name, sizeof(name), "%.*s%c%s",
                        (int) (e - p), p, DIRSEP, PASSWORDS_FILE_NAME);
-    fp = mg_fopen(name, "r");
+    pw = open_passwords(conn, name);
   }
 
-  return fp;
+  return pw;
 }
 
 // Parsed RFC2617 Authorization request header cf. sec. 3.2.2
@@ -4679,7 +7130,7 @@ static int parse_auth_header(struct mg_connection *conn, char *buf,
 
   (void) memset(ah, 0, sizeof(*ah));
 
-  if ((auth_header = mg_get_header(conn, "Authorization")) == NULL ||
+  if ((auth_header = get_known_header(conn, HDR_AUTHORIZATION)) == NULL ||
       mg_strncasecmp(auth_header, "Digest ", 7) != 0) {
     return 0;
   }
@@ -4745,14 +7196,17 @@ static int parse_auth_header(struct mg_connection *conn, char *buf,
 // (The user callback takes precedence.)
 //
 // Return 1 if authorized.
-static int authorize(struct mg_connection *conn, FILE *fp) {
+static int authorize(struct mg_connection *conn, const struct mg_passwords *pw) {
   struct ah ah;
-  char line[USRDMNPWD_BUFSIZ * 3 + 3], f_user[USRDMNPWD_BUFSIZ + 1], ha1[USRDMNPWD_BUFSIZ + 1], f_domain[USRDMNPWD_BUFSIZ + 1], buf[MG_BUF_LEN];
-  const char *auth_domain;
+  char ha1[USRDMNPWD_BUFSIZ + 1], buf[MG_BUF_LEN];
+  const char *auth_domain, *f_ha1;
   int rv;
 
   rv = parse_auth_header(conn, buf, sizeof(buf), &ah);
   auth_domain = get_conn_option(conn, AUTHENTICATION_DOMAIN);
+  // a 401 response hands the client's nonce out again while it is good:
+  if (ah.nonce != NULL)
+    conn->auth_nonce_seq = lookup_nonce(conn->ctx, ah.nonce);
 
   ha1[0] = 0;
   if (conn->ctx->user_functions.password_callback != NULL) {
@@ -4768,52 +7222,48 @@ static int authorize(struct mg_connection *conn, FILE *fp) {
     else if (m == 0)
       return 0;
     else if (m == 1)
-      fp = NULL; // just use the current ha1[] data
+      pw = NULL; // just use the current ha1[] data
     else if (m != 3) {
       send_http_error(conn, 500, NULL, "");
       return 0;
     }
   }
 
-  if (fp != NULL) {
+  if (pw != NULL) {
     // When parse_auth_header() failed, abort the mission:
     if (!rv)
       return 0;
 
-    // Loop over passwords file
-    rv = 0;
-    while (fgets(line, sizeof(line), fp) != NULL) {
-      if (sscanf(line, "%" USRDMNPWD_BUFSIZ_STR "[^:]:%" USRDMNPWD_BUFSIZ_STR "[^:]:%" USRDMNPWD_BUFSIZ_STR "s",
-                 f_user, f_domain, ha1) != 3) {
-        continue;
-      }
-
-      if (*f_user &&
-          !strcmp(ah.user, f_user) &&
-          !strcmp(auth_domain, f_domain)) {
-        rv = 1;
-        break;
-      }
-    }
     // no probable hit --> FAIL!
-    if (!rv)
+    if ((f_ha1 = find_password(pw, ah.user, auth_domain)) == NULL)
       return 0;
+    mg_strlcpy(ha1, f_ha1, sizeof(ha1));
   }
   if (!ha1[0])
     return 1;
-  return check_password(
+  if (!check_password(
         conn->request_info.request_method,
         ha1, ah.uri, ah.nonce, ah.nc, ah.cnonce, ah.qop,
-        ah.response /* ah.opaque is unused */ );
+        ah.response /* ah.opaque is unused */ ))
+    return 0;
+  // only now that the client has proven to know the password is the nonce
+  // worth checking: when stale, the client may retry with a fresh one
+  // without asking the user for the password again.
+  if (!check_nonce(conn->ctx, ah.nonce, ah.nc)) {
+    conn->auth_nonce_stale = 1;
+    return 0;
+  }
+  return 1;
 }
 
 // Return 1 if request method is allowed, 0 otherwise.
 int check_allowed(struct mg_connection *conn) {
   const char *request_method = conn->request_info.request_method;
-  const char *allowed_methods = mg_get_allowed_methods(conn);
+  const char *list = NULL;
   struct vec v;
+  int pos = 0;
 
-  while ((allowed_methods = next_option(allowed_methods, &v, NULL)) != NULL) {
+  while (next_conn_list_item(conn, ALLOWED_METHODS, &list, &pos, &v)) {
     if (!memcmp(request_method, v.ptr, v.len))
       return 1;
   }
@@ -4822,68 +7272,84 @@ int check_allowed(struct mg_connection *conn) {
 
 // Return 1 if request is authorized.
 static int check_authorization(struct mg_connection *conn, const char *path) {
-  FILE *fp;
+  struct mg_config *cfg = conn_config(conn);
+  const struct uri_map_rule *rule;
+  struct mg_passwords *pw;
   char fname[PATH_MAX];
   struct vec uri_vec, filename_vec;
-  const char *list;
-  int authorized;
+  const char *list, *uri = conn->request_info.uri;
+  size_t uri_len;
+  int authorized, match_len;
 
-  fp = NULL;
+  pw = NULL;
+  filename_vec.ptr = NULL;
 
   list = get_conn_option(conn, PROTECT_URI);
-  while ((list = next_option(list, &uri_vec, &filename_vec)) != NULL) {
-    if (!memcmp(conn->request_info.uri, uri_vec.ptr, uri_vec.len)) {
-      (void) mg_snprintf(conn, fname, sizeof(fname), "%.*s",
-                         (int)filename_vec.len, filename_vec.ptr);
-      if ((fp = mg_fopen(fname, "r")) == NULL) {
-        mg_cry(conn, "%s: cannot open authorization file %s: %s", __func__, fname, mg_strerror(ERRNO));
-      }
-      break;
+  if (is_config_option_value(cfg, PROTECT_URI, list) && cfg->protect != NULL) {
+    if ((rule = match_uri_map(cfg->protect, uri, &match_len)) != NULL)
+      filename_vec = rule->value;
+  } else {
+    uri_len = strlen(uri);
+    while ((list = next_option(list, &uri_vec, &filename_vec)) != NULL) {
+      if (uri_vec.len <= uri_len && !memcmp(uri, uri_vec.ptr, uri_vec.len))
+        break;
     }
+    if (list == NULL)
+      filename_vec.ptr = NULL;
   }
-
-  if (fp == NULL) {
-    fp = open_auth_file(conn, path);
+  if (filename_vec.ptr != NULL) {
+    (void) mg_snprintf(conn, fname, sizeof(fname), "%.*s",
+                       (int)filename_vec.len, filename_vec.ptr);
+    if ((pw = open_passwords(conn, fname)) == NULL) {
+      mg_cry(conn, "%s: cannot open authorization file %s: %s", __func__, fname, mg_strerror(ERRNO));
+    }
   }
-  authorized = authorize(conn, fp);
-  if (fp != NULL) {
-    (void) mg_fclose(fp);
+
+  if (pw == NULL) {
+    pw = open_auth_file(conn, path);
   }
+  authorized = authorize(conn, pw);
+  release_passwords(conn->ctx, pw);
 
   return authorized;
 }
 
 static void send_authorization_request(struct mg_connection *conn) {
+  char nonce[8 + 2 * sizeof(unsigned long) + 1];
+
   if (mg_is_producing_nested_page(conn) || mg_have_headers_been_sent(conn))
     return;
   if (mg_set_response_code(conn, 401) != 401)
     return;
+  // a client whose nonce went stale has proven to know the password: it
+  // is not held to its rate-limited nonce, which may be the stale one
+  new_nonce(conn->ctx, nonce, sizeof(nonce),
+            (conn->auth_nonce_stale ? 0 : conn->auth_nonce_seq),
+            (conn->auth_nonce_stale ? 0 : nonce_client_key(conn)));
   //mg_add_response_header(conn, 0, "Connection", "%s", suggest_connection_header(conn)); -- not needed any longer
   mg_add_response_header(conn, 0, "Content-Length", "0");
   mg_add_response_header(conn, 0, "WWW-Authenticate", "Digest qop=\"auth\", "
-                         "realm=\"%s\", nonce=\"%lu\"",
+                         "realm=\"%s\", nonce=\"%s\"%s",
                          get_conn_option(conn, AUTHENTICATION_DOMAIN),
-                         (unsigned long) time(NULL));
+                         nonce, (conn->auth_nonce_stale ? ", stale=true" : ""));
   (void) mg_write_http_response_head(conn, 0, 0);
 }
 
 // Return 1 when authorized.
 static int is_authorized_for_put(struct mg_connection *conn) {
-  FILE *fp = NULL;
+  struct mg_passwords *pw = NULL;
   int ret;
   const char *pwd_filepath = get_conn_option(conn, PUT_DELETE_PASSWORDS_FILE);
 
   if (!is_empty(pwd_filepath)) {
-    fp = mg_fopen(pwd_filepath, "r");
-    if (fp == NULL) {
+    pw = open_passwords(conn, pwd_filepath);
+    if (pw == NULL) {
       mg_cry(conn, "%s: cannot open authorization file %s: %s", __func__, pwd_filepath, mg_strerror(ERRNO));
       return 0;
     }
   }
-  ret = authorize(conn, fp);
-  if (fp != NULL) {
-    (void) mg_fclose(fp);
-  }
+  ret = authorize(conn, pw);
+  release_passwords(conn->ctx, pw);
   return ret;
 }
 
@@ -5032,48 +7498,55 @@ static int WINCDECL compare_dir_entries(const void *p1, const void *p2) {
 }
 
 static int must_hide_file(struct mg_connection *conn, const char *path) {
-  const char *pw_pattern = "**" PASSWORDS_FILE_NAME "$";
-  const char *pattern = get_conn_option(conn, HIDE_FILES);
-  return match_string(pw_pattern, strlen(pw_pattern), path) > 0 ||
-    (!is_empty(pattern) && match_string(pattern, strlen(pattern), path) > 0);
+  size_t len = strlen(path);
+
+  // same as matching "**" PASSWORDS_FILE_NAME "$":
+  if (len >= sizeof(PASSWORDS_FILE_NAME) - 1 &&
+      !strcmp(path + len - (sizeof(PASSWORDS_FILE_NAME) - 1), PASSWORDS_FILE_NAME))
+    return 1;
+  return !is_empty(get_conn_option(conn, HIDE_FILES)) &&
+    match_option(conn, HIDE_FILES, path) > 0;
 }
 
 int mg_scan_directory(struct mg_connection *conn, const char *dir, void *data, mg_process_direntry_cb *cb) {
-  char path[PATH_MAX];
-  struct dirent *dp;
+  char path[PATH_MAX], name[PATH_MAX];
+  const char *entry;
   DIR *dirp;
   struct mg_direntry de;
 
-  if ((dirp = opendir(dir)) == NULL) {
+  if ((dirp = conn_opendir(conn, dir)) == NULL) {
     return 0;
   } else {
     de.conn = conn;
 
-    while ((dp = readdir(dirp)) != NULL) {
+    while ((entry = conn_readdir(conn, &dirp)) != NULL) {
       // Do not show current dir and hidden files
-      if (!strcmp(dp->d_name, ".") ||
-          !strcmp(dp->d_name, "..") ||
-          must_hide_file(conn, dp->d_name)) {
+      if (!strcmp(entry, ".") ||
+          !strcmp(entry, "..") ||
+          must_hide_file(conn, entry)) {
         continue;
       }
+      // the entry may live in the disk I/O job, which is reused by conn_stat() below:
+      mg_strlcpy(name, entry, sizeof(name));
 
-      mg_snprintf(conn, path, sizeof(path), "%s%c%s", dir, DIRSEP, dp->d_name);
+      mg_snprintf(conn, path, sizeof(path), "%s%c%s", dir, DIRSEP, name);
 
       // If we don't memset stat structure to zero, mtime will have
       // garbage and strftime() will segfault later on in
       // print_dir_entry(). memset is required only if mg_stat()
       // fails. For more details, see
       // http://code.google.com/p/mongoose/issues/detail?id=79
-      if (mg_stat(path, &de.st) != 0) {
+      if (conn_stat(conn, path, &de.st) != 0) {
         memset(&de.st, 0, sizeof(de.st));
       }
-      de.file_name = dp->d_name;
+      de.file_name = name;
 
       cb(&de, data);
     }
-    (void) closedir(dirp);
+    if (dirp != NULL)
+      (void) closedir(dirp);
   }
-  return 1;
+  return conn->disk_io_status == 0;
 }
 
 struct dir_scan_data {
@@ -5109,8 +7582,17 @@ static void handle_directory_request(struct mg_connection *conn,
   if (mg_is_producing_nested_page(conn))
     return;
   if (!mg_scan_directory(conn, dir, &data, dir_scan_callback)) {
-    send_http_error(conn, 500, "Cannot open directory",
-                    "Error: opendir(%s): %s", dir, strerror(ERRNO));
+    for (i = 0; i < data.num_entries; i++) {
+      free(data.entries[i].file_name);
+    }
+    free(data.entries);
+    if (conn->disk_io_status != 0) {
+      send_http_error(conn, conn->disk_io_status, NULL,
+                      "Error: disk I/O stalled while scanning %s", dir);
+    } else {
+      send_http_error(conn, 500, "Cannot open directory",
+                      "Error: opendir(%s): %s", dir, strerror(ERRNO));
+    }
     return;
   }
 
@@ -5212,12 +7694,17 @@ static int64_t send_data_to_log(struct mg_connection *conn, FILE *fp, int64_t le
 // in the file; this will not be considered an error and send_file_data()
 // will cope seamlessly with this situation.
 //
+// Set 'is_disk_file' for regular files so that the reads go through the disk
+// I/O pool; *fpp is set to NULL when the file had to be handed over to that
+// pool after a timeout, in which case the caller must not close it.
+//
 // Return negative number on error; otherwise return the number of bytes
 // actually written.
-static int64_t send_file_data(struct mg_connection *conn, FILE *fp, int64_t len) {
+static int64_t send_file_data(struct mg_connection *conn, FILE **fpp, int64_t len, int is_disk_file) {
   char buf[DATA_COPY_BUFSIZ];
   int to_read, num_read, num_written;
   int64_t wlen = 0;
+  FILE *fp = *fpp;
 
   while (len > 0) {
     // Calculate how much to read from the file in the buffer
@@ -5229,7 +7716,15 @@ static int64_t send_file_data(struct mg_connection *conn, FILE *fp, int64_t len)
         break;
 
     // Read from file, exit the loop on error
-    num_read = (int)fread(buf, 1, (size_t)to_read, fp);
+    if (is_disk_file) {
+      num_read = conn_fread(conn, fpp, buf, to_read);
+      if (conn->disk_io_status != 0) {
+        send_http_error(conn, conn->disk_io_status, NULL, "%s: disk I/O stalled", __func__); // signal the failure in access log file at least
+        return -2;
+      }
+    } else {
+      num_read = (int)fread(buf, 1, (size_t)to_read, fp);
+    }
     if (num_read <= 0 && ferror(fp)) {
       send_http_error(conn, 578, NULL, "%s: failed to read from file: %s", __func__, mg_strerror(ERRNO)); // signal internal error in access log file at least
       return -2;
@@ -5257,39 +7752,116 @@ static void gmt_time_string(char *buf, size_t buf_len, const time_t *t) {
   strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
 }
 
+// The Etag of a precompressed variant is that of the original file plus the
+// Content-Encoding, so that the identity and compressed bodies never match.
 static char *construct_etag(char *buf, size_t buf_len,
-                           const struct mgstat *stp) {
+                           const struct mgstat *stp, const char *encoding) {
   MG_ASSERT(buf_len > 1);
-  mg_snq0printf(fc(NULL), buf, buf_len, "\"%lx.%" PRId64 "\"",
-                  (unsigned long) stp->mtime, stp->size);
+  mg_snq0printf(fc(NULL), buf, buf_len, "\"%lx.%" PRId64 "%s%s\"",
+                  (unsigned long) stp->mtime, stp->size,
+                  (encoding != NULL ? "-" : ""), (encoding != NULL ? encoding : ""));
   return buf;
 }
 
+static int is_not_modified(const struct mg_connection *conn,
+                           const struct mgstat *stp, const char *encoding);
+
+// Look for a precompressed sibling ("<path>.br" or "<path>.gz") of the file
+// at 'path' which the client accepts and which is not older than the file
+// itself. On success, store the sibling's path and stat info in 'buf' and
+// 'stp' and return the matching Content-Encoding; return NULL otherwise.
+static const char *find_precompressed_file(struct mg_connection *conn, const char *path,
+                                           const struct mgstat *orig_stp,
+                                           char *buf, size_t buf_len, struct mgstat *stp) {
+  static const struct {
+    const char *encoding;
+    const char *ext;
+  } variants[] = {
+    { "br",   ".br" },
+    { "gzip", ".gz" },
+  };
+  const char *hdr = get_known_header(conn, HDR_ACCEPT_ENCODING);
+  size_t path_len = strlen(path);
+  size_t i;
+
+  if (hdr == NULL)
+    return NULL;
+  for (i = 0; i < ARRAY_SIZE(variants); i++) {
+    size_t ext_len = strlen(variants[i].ext);
+
+    if (path_len + ext_len >= buf_len ||
+        !accepts_content_coding(hdr, variants[i].encoding))
+      continue;
+    memcpy(buf, path, path_len);
+    memcpy(buf + path_len, variants[i].ext, ext_len + 1);
+    if (conn_stat(conn, buf, stp) == 0 && !stp->is_directory &&
+        stp->mtime >= orig_stp->mtime)
+      return variants[i].encoding;
+    if (conn->disk_io_status != 0)
+      break;
+  }
+  return NULL;
+}
+
+// When 'conditional' is set, answer 304 if the client's copy of the selected
+// variant is still up to date.
+//
 // return negative number on error; 0 on success
 static int handle_file_request(struct mg_connection *conn, const char *path,
-                                struct mgstat *stp) {
+                                struct mgstat *stp, int conditional) {
   char date[64], lm[64], etag[64];
+  char variant_path[PATH_MAX + 1];
+  struct mgstat variant_st;
   const char *hdr;
+  const char *pattern = get_conn_option(conn, PRECOMPRESSED_PATTERN);
+  const char *encoding = NULL;
+  const struct mgstat *body_stp = stp;
   time_t curtime = time(NULL);
   int64_t cl, r1, r2;
   struct vec mime_vec;
+  const char *content_type;
   FILE *fp;
-  int n;
-
-  get_mime_type(conn->ctx, path, "text/plain", &mime_vec);
-  cl = stp->size;
+  int n, vary = 0;
+
+  // the MIME type is always derived from the original name, also when a
+  // precompressed variant is sent instead:
+  content_type = get_mime_type(conn->ctx, conn, path, "text/plain", &mime_vec);
+  if (!is_empty(pattern) && match_option(conn, PRECOMPRESSED_PATTERN, path) > 0) {
+    vary = 1;
+    encoding = find_precompressed_file(conn, path, stp, variant_path, sizeof(variant_path), &variant_st);
+    if (encoding != NULL) {
+      path = variant_path;
+      body_stp = &variant_st;
+    }
+  }
+  construct_etag(etag, sizeof(etag), stp, encoding);
+  if (conditional && is_not_modified(conn, stp, encoding) &&
+      304 == mg_set_response_code(conn, 304)) {
+    mg_add_response_header(conn, 0, "Etag", "%s", etag);
+    if (vary)
+      mg_add_response_header(conn, 0, "Vary", "Accept-Encoding");
+    send_http_error(conn, 304, NULL, "");
+    return 0;
+  }
+  cl = body_stp->size;
   mg_set_response_code(conn, 200);
+  // static files are sent as-is: use precompressed_pattern for those.
+  conn->tx_no_compression = 1;
 
-  if ((fp = mg_fopen(path, "rb")) == NULL) {
-    send_http_error(conn, 500, NULL,
-                    "fopen(%s): %s", path, mg_strerror(ERRNO));
+  if ((fp = conn_fopen(conn, path, "rb")) == NULL) {
+    if (conn->disk_io_status != 0)
+      send_http_error(conn, conn->disk_io_status, NULL,
+                      "fopen(%s): disk I/O stalled", path);
+    else
+      send_http_error(conn, 500, NULL,
+                      "fopen(%s): %s", path, mg_strerror(ERRNO));
     return -1;
   }
   set_close_on_exec(fileno(fp));
 
   // If Range: header specified, act accordingly
   r1 = r2 = 0;
-  hdr = mg_get_header(conn, "Range");
+  hdr = get_known_header(conn, HDR_RANGE);
   if (hdr != NULL && (n = parse_range_header(hdr, &r1, &r2)) > 0) {
     mg_set_response_code(conn, 206);
     (void) fseeko(fp, r1, SEEK_SET);
@@ -5297,7 +7869,7 @@ static int handle_file_request(struct mg_connection *conn, const char *path,
     mg_add_response_header(conn, 0, "Content-Range", "bytes "
                            "%" PRId64 "-%"
                            PRId64 "/%" PRId64,
-                           r1, r1 + cl - 1, stp->size);
+                           r1, r1 + cl - 1, body_stp->size);
   }
 
   // Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
@@ -5307,12 +7879,18 @@ static int handle_file_request(struct mg_connection *conn, const char *path,
 
   mg_add_response_header(conn, 0, "Date", "%s", date);
   mg_add_response_header(conn, 0, "Last-Modified", "%s", lm);
-  mg_add_response_header(conn, 0, "Etag", "%s", construct_etag(etag, sizeof(etag), stp));
+  mg_add_response_header(conn, 0, "Etag", "%s", etag);
   // 'text/...' mime types default to ISO-8859-1; make sure they use the more modern UTF-8 charset instead:
-  if (mime_vec.len > 5 && !memcmp("text/", mime_vec.ptr, 5))
+  if (content_type != NULL)
+    mg_add_response_header(conn, 0, "Content-Type", "%s", content_type);
+  else if (mime_vec.len > 5 && !memcmp("text/", mime_vec.ptr, 5))
     mg_add_response_header(conn, 0, "Content-Type", "%.*s; charset=%s", (int) mime_vec.len, mime_vec.ptr, "utf-8");
   else
     mg_add_response_header(conn, 0, "Content-Type", "%.*s", (int) mime_vec.len, mime_vec.ptr);
+  if (encoding != NULL)
+    mg_add_response_header(conn, 0, "Content-Encoding", "%s", encoding);
+  if (vary)
+    mg_add_response_header(conn, 0, "Vary", "Accept-Encoding");
   mg_add_response_header(conn, 0, "Content-Length", "%" PRId64, cl);
   //mg_add_response_header(conn, 0, "Connection", "%s", suggest_connection_header(conn)); -- not needed any longer
   mg_add_response_header(conn, 0, "Accept-Ranges", "bytes");
@@ -5321,9 +7899,10 @@ static int handle_file_request(struct mg_connection *conn, const char *path,
 
   if (n > 0 &&
       strcmp(conn->request_info.request_method, "HEAD") != 0) {
-    n = (send_file_data(conn, fp, cl) >= 0);
+    n = (send_file_data(conn, &fp, cl, 1) >= 0);
   }
-  (void) mg_fclose(fp);
+  if (fp != NULL)
+    (void) mg_fclose(fp);
   (void) mg_flush(conn);
   return (n > 0 ? 0 : -1);
 }
@@ -5331,7 +7910,7 @@ static int handle_file_request(struct mg_connection *conn, const char *path,
 int mg_send_file(struct mg_connection *conn, const char *path) {
   struct mgstat st;
   if (mg_stat(path, &st) == 0) {
-    return handle_file_request(conn, path, &st);
+    return handle_file_request(conn, path, &st, 0);
   } else {
     send_http_error(conn, 404, NULL, "File not found: (%s)", path);
     return 404;
@@ -5339,6 +7918,69 @@ int mg_send_file(struct mg_connection *conn, const char *path) {
 }
 
 
+// Fast path for mg_extract_raw_http_header(): parse a 'simple' header line,
+// i.e. one without quoted-strings, tabs, runs of whitespace or line
+// continuations in its value, in a single sweep and without moving any data.
+//
+// Return 0 on success, 1 when the line needs the full RFC2616 treatment
+// (the buffer has not been touched then).
+static int parse_simple_http_header(char **buf, struct mg_header *header) {
+  char *name = *buf;
+  char *p = name;
+  char *name_end, *value, *value_end;
+
+  while (rfc2616_token_map[* (unsigned char *) p])
+    p++;
+  if (p == name)
+    return 1;
+  name_end = p;
+  while (*p == ' ')
+    p++;
+  if (*p != ':')
+    return 1;
+  p++;
+  while (*p == ' ')
+    p++;
+
+  value = value_end = p;
+  for (;;) {
+    switch (*p) {
+    case '\0':
+    case '\r':
+    case '\n':
+      break;
+    case '"':
+    case '\t':
+      return 1;
+    case ' ':
+      if (p[1] == ' ' || p[1] == '\t')
+        return 1;
+      p++;
+      continue;
+    default:
+      value_end = ++p;
+      continue;
+    }
+    break;
+  }
+
+  // line continuation?
+  if (*p == '\r')
+    p++;
+  if (*p == '\n')
+    p++;
+  if (*p == ' ' || *p == '\t')
+    return 1;
+  p += strspn(p, "\r\n");
+
+  *name_end = 0;
+  *value_end = 0;
+  header->name = name;
+  header->value = value;
+  *buf = p;
+  return 0;
+}
+
 // Parse HTTP headers from the given buffer, advance buffer to the point
 // where parsing stopped.
 //
@@ -5348,7 +7990,8 @@ static int parse_http_headers(char **buf, struct mg_header *headers, int max_hea
   int i;
 
   for (i = 0; **buf && i < max_header_count; i++) {
-    if (mg_extract_raw_http_header(buf, &headers[i].name, &headers[i].value) < 0)
+    if (parse_simple_http_header(buf, &headers[i]) &&
+        mg_extract_raw_http_header(buf, &headers[i].name, &headers[i].value) < 0)
       return -1;
   }
   p = *buf;
@@ -5358,35 +8001,79 @@ static int parse_http_headers(char **buf, struct mg_header *headers, int max_hea
   return i;
 }
 
-static int is_valid_http_method(const char *method) {
-  return !strcmp(method, "GET") || !strcmp(method, "POST") ||
-         !strcmp(method, "HEAD") || !strcmp(method, "CONNECT") ||
-         !strcmp(method, "PUT") || !strcmp(method, "DELETE") ||
-         !strcmp(method, "OPTIONS") || !strcmp(method, "PROPFIND");
+// Return 1 when the 'len' bytes at 'method' are a request method we know;
+// dispatch on length so that at most two comparisons are needed.
+static int is_valid_http_method(const char *method, size_t len) {
+  switch (len) {
+  case 3:
+    return !memcmp(method, "GET", 3) || !memcmp(method, "PUT", 3);
+  case 4:
+    return !memcmp(method, "POST", 4) || !memcmp(method, "HEAD", 4);
+  case 6:
+    return !memcmp(method, "DELETE", 6);
+  case 7:
+    return !memcmp(method, "OPTIONS", 7) || !memcmp(method, "CONNECT", 7);
+  case 8:
+    return !memcmp(method, "PROPFIND", 8);
+  }
+  return 0;
 }
 
 // Parse HTTP request, fill in mg_request_info structure.
 // This function modifies the buffer by NUL-terminating
 // HTTP request components, header names and header values.
+//
+// The request line is parsed in a single sweep: the method, URI, query
+// string and version are left in place in the buffer.
 static int parse_http_request(char *buf, struct mg_request_info *ri) {
+  char *p, *query = NULL;
+  int valid_method;
+
   // RFC says that all initial whitespace should be ignored
   while (*buf != '\0' && isspace(* (unsigned char *) buf)) {
     buf++;
   }
-  ri->request_method = skip(&buf, " ");
-  ri->uri = skip(&buf, " ");
-  if ((ri->query_string = strchr(ri->uri, '?')) != NULL) {
-    *ri->query_string++ = '\0';
+
+  ri->request_method = p = buf;
+  while (*p && *p != ' ')
+    p++;
+  valid_method = is_valid_http_method(buf, p - buf);
+  if (*p) {
+    *p++ = 0;
+    while (*p == ' ')
+      p++;
+  }
+
+  ri->uri = p;
+  for (; *p && *p != ' '; p++) {
+    if (*p == '?' && !query)
+      query = p;
+  }
+  if (*p) {
+    *p++ = 0;
+    while (*p == ' ')
+      p++;
+  }
+  if (query != NULL) {
+    *query++ = '\0';
+    ri->query_string = query;
   } else {
     ri->query_string = "";
   }
-  ri->http_version = skip(&buf, "\r\n");
+
+  ri->http_version = p;
+  while (*p && *p != '\r' && *p != '\n')
+    p++;
+  if (*p) {
+    *p++ = 0;
+    p += strspn(p, "\r\n");
+  }
   ri->num_headers = 0;
 
-  if (is_valid_http_method(ri->request_method) &&
+  if (valid_method &&
       !strncmp(ri->http_version, "HTTP/", 5)) {
     ri->http_version += 5;   // Skip "HTTP/"
-    ri->num_headers = parse_http_headers(&buf, ri->http_headers, ARRAY_SIZE(ri->http_headers));
+    ri->num_headers = parse_http_headers(&p, ri->http_headers, ARRAY_SIZE(ri->http_headers));
     if (ri->num_headers < 0) {
       ri->num_headers = 0;
       return -1;
@@ -5405,27 +8092,99 @@ static int parse_http_request(char *buf, struct mg_request_info *ri) {
 static int read_request(FILE *fp, struct mg_connection *conn,
                         char *buf, int bufsiz, int *nread) {
   int request_len, n = 1;
+  int scan_pos = 0;
 
-  request_len = get_request_len(buf, *nread);
+  request_len = get_request_len(buf, *nread, &scan_pos);
   while (*nread < bufsiz && request_len == 0 && n > 0) {
     n = pull(fp, conn, buf + *nread, bufsiz - *nread);
     if (n > 0) {
       *nread += n;
-      request_len = get_request_len(buf, *nread);
+      request_len = get_request_len(buf, *nread, &scan_pos);
+    }
+  }
+
+  if (n < 0) {
+    // recv() error -> propagate error; do not process a b0rked-with-very-high-probability request
+    return -1;
+  }
+  return request_len;
+}
+
+// Read the request (or response) headers into the connection buffer,
+// growing that buffer when the headers do not fit.
+// Return the same as read_request().
+static int read_http_headers(struct mg_connection *conn, int *nread) {
+  int request_len;
+
+  for (;;) {
+    request_len = read_request(NULL, conn, conn->buf, conn->buf_size, nread);
+    if (request_len != 0 || *nread < conn->buf_size || grow_header_buffer(conn) < 0)
+      return request_len;
+  }
+}
+
+#if defined(TEST_CHUNKING_SEARCH_OPT_TESTSETTING)
+static int shift_hit = 0;
+static int shift_tail_hit = 0;
+#endif
+
+// Decode a fully buffered 'size[;extensions]CRLF' chunk header in a single
+// sweep. The header may be preceded by the CRLF which terminated the data of
+// the previous chunk.
+//
+// Return the length of the header, or 0 when the header is incomplete, is
+// the last-chunk or is otherwise unusual: read_and_parse_chunk_header()
+// takes care of those. The buffer is only modified on success, when the
+// extensions are NUL-terminated in place.
+static int decode_buffered_chunk_header(char *buf, int len, int64_t *chunk_size, char **exts_ref) {
+  char *p = buf;
+  char *e = buf + len;
+  char *exts;
+  int64_t size = 0;
+  int digits = 0;
+
+  if (p < e && *p == '\r')
+    p++;
+  if (p < e && *p == '\n')
+    p++;
+  for (; p < e; p++, digits++) {
+    int c = * (unsigned char *) p;
+
+    if (c >= '0' && c <= '9') {
+      c -= '0';
+    } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+      c = (c | 0x20) - 'a' + 10;
+    } else {
+      break;
     }
+    if (size > (INT64_MAX >> 4))
+      return 0;
+    size = (size << 4) | c;
   }
+  if (digits == 0 || size == 0)
+    return 0;
 
-  if (n < 0) {
-    // recv() error -> propagate error; do not process a b0rked-with-very-high-probability request
-    return -1;
-  }
-  return request_len;
+  while (p < e && (*p == ' ' || *p == '\t' || *p == ';'))
+    p++;
+  exts = p;
+  while (p < e && *p != '\r' && *p != '\n')
+    p++;
+  e = memchr(p, '\n', e - p);
+  if (e == NULL)
+    return 0;
+
+  *p = 0;
+  *chunk_size = size;
+  *exts_ref = exts;
+  return (int) (e - buf) + 1;
 }
 
-#if defined(TEST_CHUNKING_SEARCH_OPT_TESTSETTING)
-static int shift_hit = 0;
-static int shift_tail_hit = 0;
-#endif
+// Return TRUE when a complete chunk header line is waiting in the RX buffer.
+static int have_buffered_chunk_header(const struct mg_connection *conn) {
+  int n = conn->rx_buffer_loaded_len - conn->rx_buffer_read_len;
+
+  return n > 0 && memchr(conn->buf + conn->request_len + conn->rx_buffer_read_len, '\n', n) != NULL;
+}
 
 // Read enough bytes into the buffer to completely fetch a HTTP chunk header,
 // then decode it.
@@ -5438,7 +8197,7 @@ static int read_and_parse_chunk_header(struct mg_connection *conn)
   int rv, pprv, n;
   char *p;
   char *exts, *e;
-  struct mg_header chunk_headers[64] = {0};
+  struct mg_header chunk_headers[64];
   int hdr_count;
   // ALWAYS shift when we've got a user-defined custom chunk header function
   // and we're running out of buffer space; it's easier for the user code
@@ -5466,6 +8225,18 @@ static int read_and_parse_chunk_header(struct mg_connection *conn)
       conn->rx_buffer_loaded_len = 0;
     }
 
+    // fast path: the next chunk header is already buffered (small chunks streaming in)
+    if (n > 0 && !ctx->user_functions.read_chunk_header) {
+      rv = decode_buffered_chunk_header(buf + conn->rx_buffer_read_len, n,
+                                        &conn->rx_remaining_chunksize, &exts);
+      if (rv > 0) {
+        conn->rx_buffer_read_len += rv;
+        hdr_count = 0;
+        memset(chunk_headers, 0, sizeof(chunk_headers[0]));
+        break;
+      }
+    }
+
     conn->rx_chunk_header_parsed = 2;
     if (ctx->user_functions.read_chunk_header) {
       int usr_nread;
@@ -5577,6 +8348,7 @@ static int read_and_parse_chunk_header(struct mg_connection *conn)
     exts = p;
 
     hdr_count = 0;
+    memset(chunk_headers, 0, sizeof(chunk_headers));
     // load the trailing headers? (i.e. did we hit the terminating ZERO chunk?)
     if (conn->rx_remaining_chunksize == 0) {
       int nread = conn->rx_buffer_loaded_len;
@@ -5638,21 +8410,22 @@ static int read_and_parse_chunk_header(struct mg_connection *conn)
 
     conn->rx_buffer_loaded_len += offset;
     conn->rx_buffer_read_len += offset;
+    break;
+  }
 
-    // call user callback:
-    pprv = 0;
-    conn->rx_chunk_header_parsed = 3;
-    if (ctx->user_functions.process_rx_chunk_header) {
-      pprv = ctx->user_functions.process_rx_chunk_header(conn, conn->rx_remaining_chunksize, exts, chunk_headers, hdr_count);
-    }
-    conn->rx_chunk_header_parsed = 1;
-
-    if (pprv == 0) {
-      conn->rx_chunk_count++;
-    }
+  // call user callback:
+  pprv = 0;
+  conn->rx_chunk_header_parsed = 3;
+  if (ctx->user_functions.process_rx_chunk_header) {
+    pprv = ctx->user_functions.process_rx_chunk_header(conn, conn->rx_remaining_chunksize, exts, chunk_headers, hdr_count);
+  }
+  conn->rx_chunk_header_parsed = 1;
 
-    return pprv < 0 ? pprv : rv;
+  if (pprv == 0) {
+    conn->rx_chunk_count++;
   }
+
+  return pprv < 0 ? pprv : rv;
 }
 
 // For given directory path, append the valid index file.
@@ -5660,11 +8433,11 @@ static int read_and_parse_chunk_header(struct mg_connection *conn)
 // If the file is found, it's stats are returned in stp and path has been augmented to point at the index file.
 int mg_substitute_index_file(struct mg_connection *conn, char *path,
                              size_t path_len, struct mgstat *stp) {
-  const char *list = get_conn_option(conn, INDEX_FILES);
+  const char *list = NULL;
   struct mgstat st;
   struct vec filename_vec;
   size_t n = strlen(path);
-  int found = 0;
+  int found = 0, pos = 0;
 
   // The 'path' given to us points to the directory. Remove all trailing
   // directory separator characters from the end of the path, and
@@ -5676,7 +8449,7 @@ int mg_substitute_index_file(struct mg_connection *conn, char *path,
 
   // Traverse index files list. For each entry, append it to the given
   // path and see if the file exists. If it exists, break the loop
-  while ((list = next_option(list, &filename_vec, NULL)) != NULL) {
+  while (next_conn_list_item(conn, INDEX_FILES, &list, &pos, &filename_vec)) {
 
     // Ignore too long entries that may overflow path buffer
     if (filename_vec.len > path_len - n - 2)
@@ -5686,7 +8459,7 @@ int mg_substitute_index_file(struct mg_connection *conn, char *path,
     (void) mg_strlcpy(path + n + 1, filename_vec.ptr, filename_vec.len + 1);
 
     // Does it exist?
-    if (mg_stat(path, &st) == 0) {
+    if (conn_stat(conn, path, &st) == 0) {
       // Yes it does, break the loop
       *stp = st;
       found = 1;
@@ -5704,27 +8477,458 @@ int mg_substitute_index_file(struct mg_connection *conn, char *path,
 
 // Return True if we should reply 304 Not Modified.
 static int is_not_modified(const struct mg_connection *conn,
-                           const struct mgstat *stp) {
+                           const struct mgstat *stp, const char *encoding) {
   char etag[64];
-  const char *ims = mg_get_header(conn, "If-Modified-Since");
-  const char *inm = mg_get_header(conn, "If-None-Match");
-  construct_etag(etag, sizeof(etag), stp);
+  const char *ims = get_known_header(conn, HDR_IF_MODIFIED_SINCE);
+  const char *inm = get_known_header(conn, HDR_IF_NONE_MATCH);
+  construct_etag(etag, sizeof(etag), stp, encoding);
   return (inm != NULL && !mg_strcasecmp(etag, inm)) ||
     (ims != NULL && stp->mtime <= parse_date_string(ims));
 }
 
+#if defined(__linux__) && !defined(NO_SPLICE)
+// Move 'len' bytes of request body from the (non-SSL) client socket into the
+// regular file 'fp', starting at its current position. The data travels
+// socket -> pipe -> file through splice() and never enters user space; disk
+// space for the entire range is reserved up front with fallocate(). The
+// reservation doesn't change the file size, so an aborted upload doesn't
+// leave a zero-padded file behind.
+//
+// Return the number of bytes stored, -1 on error, or -2 when splice() cannot
+// be used for this socket/file pair before anything has been consumed: the
+// caller should then fall back to the mg_read()/push() loop.
+static int64_t splice_body_data(struct mg_connection *conn, FILE *fp, int64_t len) {
+  struct stat st;
+  loff_t off;
+  int64_t stored = 0;
+  int fd = fileno(fp);
+  int pfd[2];
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    return -2;
+  if (fflush(fp) != 0 || (off = ftello(fp)) < 0)
+    return -1;
+  if (pipe(pfd) != 0)
+    return -2;
+  // EOPNOTSUPP et al are not fatal: the writes will allocate as they go.
+  (void) fallocate(fd, FALLOC_FL_KEEP_SIZE, off, len);
+
+  while (stored < len) {
+    size_t k = (size_t) MG_MIN(len - stored, (int64_t) MG_BODY_COPY_BUFSIZ);
+    ssize_t n = 0, m;
+
+    // poll stop_flag to ensure that we'll be able to abort on server stop (see pull()):
+    while (conn->ctx->stop_flag == 0 || !conn->abort_when_server_stops) {
+      if (!(conn->client.was_idle && conn->client.has_read_data)) {
+        fd_set fdr;
+        int max_fh = 0;
+        struct timeval tv = {0};
+        tv.tv_usec = MG_SELECT_TIMEOUT_MSECS * 1000;
+        FD_ZERO(&fdr);
+        add_to_set(conn->client.sock, &fdr, &max_fh);
+        if (select(max_fh + 1, &fdr, NULL, NULL, &tv) <= 0)
+          continue;
+      }
+      n = splice(conn->client.sock, NULL, pfd[1], NULL, k, SPLICE_F_MOVE | SPLICE_F_MORE);
+      conn->client.read_error = (n < 0);
+      break;
+    }
+    conn->client.was_idle = 0;
+    conn->client.has_read_data = 0;
+    if (n < 0 && stored == 0 && (ERRNO == EINVAL || ERRNO == ENOSYS)) {
+      conn->client.read_error = 0;
+      stored = -2;
+      break;
+    }
+    if (n <= 0)
+      break;
+    conn->consumed_content += n;
+
+    while (n > 0) {
+      m = splice(pfd[0], NULL, fd, &off, (size_t) n, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (m < 0 && ERRNO == EINVAL) {
+        // target filesystem does not support splice(): drain the pipe by hand
+        char buf[DATA_COPY_BUFSIZ];
+        m = read(pfd[0], buf, (size_t) MG_MIN(n, (ssize_t) sizeof(buf)));
+        if (m > 0 && pwrite(fd, buf, (size_t) m, off) != m)
+          m = -1;
+        else if (m > 0)
+          off += m;
+      }
+      if (m <= 0) {
+        stored = -1;
+        break;
+      }
+      n -= m;
+      stored += m;
+    }
+    if (stored < 0)
+      break;
+  }
+
+  (void) close(pfd[0]);
+  (void) close(pfd[1]);
+  // hand back the part of the reservation which was never written:
+  if (stored != len && fstat(fd, &st) == 0)
+    (void) ftruncate(fd, st.st_size);
+  DEBUG_TRACE(0x0400, ("spliced %" PRId64 " of %" PRId64 " bytes", stored, len));
+  // keep the stdio position in sync with what we wrote through the descriptor:
+  if (stored >= 0 && fseeko(fp, off, SEEK_SET) != 0)
+    stored = -1;
+  return stored;
+}
+#endif
+
+// A multipart boundary is at most 70 characters long (RFC 2046 sec. 5.1.1)
+#define MULTIPART_MAX_BOUNDARY  70
+#define MULTIPART_MAX_HEADERS   16
+
+typedef enum {
+  MP_PREAMBLE = 0,              // skipping data up to the first boundary
+  MP_BODY,                      // passing the body of a part to the callback
+  MP_BOUNDARY_TAIL,             // past a boundary: expecting padding + CRLF, or "--"
+  MP_BOUNDARY_LF,               // seen the CR which ends a boundary line
+  MP_CLOSE_DASH,                // seen the first '-' of the closing boundary
+  MP_HEADERS,                   // collecting the headers of a part
+  MP_EPILOGUE,                  // past the closing boundary
+  MP_ERROR
+} multipart_state_t;
+
+struct mg_multipart {
+  mg_multipart_callback_t callback;
+  void *user_data;
+  multipart_state_t state;
+  size_t delim_len;
+  char delim[4 + MULTIPART_MAX_BOUNDARY + 1];   // "\r\n--" boundary
+  unsigned char shift[256];     // Boyer-Moore-Horspool shift table for delim[]
+  size_t held;                  // length of the delim[] prefix which ended the previous slice
+  size_t hdr_len;               // number of bytes in hdr_buf[]
+  size_t line_start;            // offset of the current header line in hdr_buf[]
+  int num_headers;
+  struct mg_header headers[MULTIPART_MAX_HEADERS];
+  const char *part_name;        // Content-Disposition name parameter, or NULL
+  const char *file_name;        // Content-Disposition filename parameter, or NULL
+  char params[MG_MULTIPART_HEADER_BUFSIZ];      // unquoted header parameters
+  char hdr_buf[MG_MULTIPART_HEADER_BUFSIZ];
+};
+
+// Find 'needle' in 'haystack' using the Boyer-Moore-Horspool 'shift' table.
+// Return a pointer to the first match, or NULL if not found.
+static const char *bmh_search(const char *haystack, size_t len, const char *needle,
+                              size_t needle_len, const unsigned char *shift) {
+  const char *p = haystack;
+  const char *e = haystack + len;
+  size_t last = needle_len - 1;
+
+  while ((size_t)(e - p) >= needle_len) {
+    unsigned char c = (unsigned char) p[last];
+
+    if (c == (unsigned char) needle[last] && !memcmp(p, needle, last))
+      return p;
+    p += shift[c];
+  }
+  return NULL;
+}
+
+// Extract the next parameter of a header value like 'form-data; name="a"',
+// unquoting it in place. Return the parameter name, or NULL at the end of
+// the value or when the value is malformed.
+static const char *next_header_param(char **s, const char **value) {
+  const char *name = NULL;
+  char sep;
+
+  *value = NULL;
+  *s += strspn(*s, "; \t");
+  if (**s == '\0' ||
+      mg_extract_token_qstring_value(s, &sep, &name, value, "") < 0 ||
+      (sep && !strchr("; \t", sep)))
+    return NULL;
+  *s += !!sep;
+  return name;
+}
+
+static int multipart_callback(struct mg_multipart *mp, enum mg_multipart_event event,
+                              const char *data, size_t len) {
+  if (mp->callback(mp, event, data, len) != 0) {
+    mp->state = MP_ERROR;
+    return -1;
+  }
+  return 0;
+}
+
+// Pass part body data to the callback; data in the preamble is dropped.
+static int multipart_data(struct mg_multipart *mp, const char *data, size_t len) {
+  if (mp->state != MP_BODY || len == 0)
+    return 0;
+  return multipart_callback(mp, MG_MULTIPART_PART_DATA, data, len);
+}
+
+static const char *multipart_delimiter(struct mg_multipart *mp, const char *p) {
+  if (mp->state == MP_BODY)
+    (void) multipart_callback(mp, MG_MULTIPART_PART_END, NULL, 0);
+  if (mp->state != MP_ERROR)
+    mp->state = MP_BOUNDARY_TAIL;
+  return p;
+}
+
+// Scan preamble or body data for the next delimiter.
+// Return the position where scanning stopped.
+static const char *multipart_scan_body(struct mg_multipart *mp, const char *p, size_t n) {
+  const char *e = p + n;
+  const char *d;
+  size_t need;
+
+  // complete a delimiter which started at the end of the previous slice:
+  if (mp->held > 0) {
+    need = mp->delim_len - mp->held;
+    if (!memcmp(p, mp->delim + mp->held, n < need ? n : need)) {
+      if (n < need) {
+        mp->held += n;
+        return e;
+      }
+      mp->held = 0;
+      return multipart_delimiter(mp, p + need);
+    }
+    // Not a delimiter after all. As the boundary cannot contain a CR, no
+    // later delimiter can start inside the held bytes.
+    if (multipart_data(mp, mp->delim, mp->held) < 0)
+      return e;
+    mp->held = 0;
+  }
+
+  if ((d = bmh_search(p, n, mp->delim, mp->delim_len, mp->shift)) != NULL) {
+    if (multipart_data(mp, p, d - p) < 0)
+      return e;
+    return multipart_delimiter(mp, d + mp->delim_len);
+  }
+
+  // hold back a trailing partial delimiter:
+  d = (n < mp->delim_len ? p : e - (mp->delim_len - 1));
+  while ((d = (const char *) memchr(d, '\r', e - d)) != NULL &&
+         memcmp(d, mp->delim, e - d) != 0)
+    d++;
+  if (d == NULL)
+    d = e;
+  if (multipart_data(mp, p, d - p) == 0)
+    mp->held = e - d;
+  return e;
+}
+
+static void multipart_begin_part(struct mg_multipart *mp) {
+  const char *name, *value, *disposition;
+  char *buf = mp->hdr_buf;
+
+  mp->part_name = mp->file_name = NULL;
+  mp->num_headers = parse_http_headers(&buf, mp->headers, (int) ARRAY_SIZE(mp->headers));
+  if (mp->num_headers < 0) {
+    mp->state = MP_ERROR;
+    return;
+  }
+  disposition = get_header(mp->headers, mp->num_headers, "Content-Disposition");
+  if (disposition != NULL) {
+    // skip the disposition type, e.g. "form-data":
+    (void) mg_strlcpy(mp->params, disposition, sizeof(mp->params));
+    buf = mp->params + strcspn(mp->params, ";");
+    while ((name = next_header_param(&buf, &value)) != NULL) {
+      if (!mg_strcasecmp(name, "name")) {
+        mp->part_name = value;
+      } else if (!mg_strcasecmp(name, "filename")) {
+        mp->file_name = value;
+      }
+    }
+  }
+  mp->state = MP_BODY;
+  (void) multipart_callback(mp, MG_MULTIPART_PART_BEGIN, NULL, 0);
+}
+
+// Collect the headers of a part up to the empty line which ends them.
+// Return the position where collecting stopped.
+static const char *multipart_collect_headers(struct mg_multipart *mp, const char *p, size_t n) {
+  const char *e = p + n;
+
+  while (p < e) {
+    const char *nl = (const char *) memchr(p, '\n', e - p);
+    size_t len = (nl != NULL ? nl + 1 : e) - p;
+    size_t line_len;
+
+    if (len >= sizeof(mp->hdr_buf) - mp->hdr_len) {
+      mp->state = MP_ERROR;
+      return e;
+    }
+    memcpy(mp->hdr_buf + mp->hdr_len, p, len);
+    mp->hdr_len += len;
+    p += len;
+    if (nl == NULL)
+      break;
+
+    line_len = mp->hdr_len - mp->line_start;
+    if (line_len == 1 || (line_len == 2 && mp->hdr_buf[mp->line_start] == '\r')) {
+      mp->hdr_buf[mp->line_start] = '\0';
+      multipart_begin_part(mp);
+      break;
+    }
+    mp->line_start = mp->hdr_len;
+  }
+  return p;
+}
+
+static void multipart_begin_headers(struct mg_multipart *mp) {
+  mp->hdr_len = mp->line_start = 0;
+  mp->state = MP_HEADERS;
+}
+
+struct mg_multipart *mg_create_multipart_parser(const char *content_type,
+                                                mg_multipart_callback_t callback,
+                                                void *user_data) {
+  struct mg_multipart *mp;
+  const char *name, *boundary = NULL;
+  char *s;
+  size_t i, len;
+
+  if (content_type == NULL || callback == NULL ||
+      mg_strncasecmp(content_type, "multipart/", 10) != 0 ||
+      (mp = (struct mg_multipart *) calloc(1, sizeof(*mp))) == NULL)
+    return NULL;
+
+  (void) mg_strlcpy(mp->params, content_type, sizeof(mp->params));
+  s = mp->params + strcspn(mp->params, ";");
+  while ((name = next_header_param(&s, &boundary)) != NULL &&
+         mg_strcasecmp(name, "boundary") != 0)
+    ;
+  // boundary := 0*69<bchars> bcharsnospace (RFC 2046 sec. 5.1.1)
+  if (name == NULL || (len = strlen(boundary)) == 0 ||
+      len > MULTIPART_MAX_BOUNDARY || boundary[len - 1] == ' ' ||
+      strspn(boundary, "0123456789abcdefghijklmnopqrstuvwxyz"
+             "ABCDEFGHIJKLMNOPQRSTUVWXYZ'()+_,-./:=? ") != len) {
+    free(mp);
+    return NULL;
+  }
+
+  mp->callback = callback;
+  mp->user_data = user_data;
+  mp->delim_len = 4 + len;
+  memcpy(mp->delim, "\r\n--", 4);
+  memcpy(mp->delim + 4, boundary, len + 1);
+  for (i = 0; i < ARRAY_SIZE(mp->shift); i++)
+    mp->shift[i] = (unsigned char) mp->delim_len;
+  for (i = 0; i < mp->delim_len - 1; i++)
+    mp->shift[(unsigned char) mp->delim[i]] = (unsigned char) (mp->delim_len - 1 - i);
+
+  // The first boundary need not be preceded by a CRLF: pretend we've seen one.
+  mp->state = MP_PREAMBLE;
+  mp->held = 2;
+  return mp;
+}
+
+void mg_destroy_multipart_parser(struct mg_multipart *mp) {
+  free(mp);
+}
+
+int mg_feed_multipart_parser(struct mg_multipart *mp, const char *data, size_t len) {
+  const char *p = data;
+  const char *e = data + len;
+
+  if (mp == NULL)
+    return -1;
+
+  while (p < e && mp->state < MP_EPILOGUE) {
+    switch (mp->state) {
+    case MP_PREAMBLE:
+    case MP_BODY:
+      p = multipart_scan_body(mp, p, e - p);
+      break;
+    case MP_BOUNDARY_TAIL:
+      switch (*p++) {
+      case '-':
+        mp->state = MP_CLOSE_DASH;
+        break;
+      case '\r':
+        mp->state = MP_BOUNDARY_LF;
+        break;
+      case '\n':
+        multipart_begin_headers(mp);
+        break;
+      case ' ':
+      case '\t':
+        break;
+      default:
+        mp->state = MP_ERROR;
+        break;
+      }
+      break;
+    case MP_BOUNDARY_LF:
+      if (*p++ == '\n')
+        multipart_begin_headers(mp);
+      else
+        mp->state = MP_ERROR;
+      break;
+    case MP_CLOSE_DASH:
+      mp->state = (*p++ == '-' ? MP_EPILOGUE : MP_ERROR);
+      break;
+    case MP_HEADERS:
+      p = multipart_collect_headers(mp, p, e - p);
+      break;
+    default:
+      break;
+    }
+  }
+
+  return mp->state == MP_ERROR ? -1 : mp->state == MP_EPILOGUE;
+}
+
+void *mg_get_multipart_user_data(const struct mg_multipart *mp) {
+  return mp != NULL ? mp->user_data : NULL;
+}
+
+const char *mg_get_multipart_header(const struct mg_multipart *mp, const char *name) {
+  if (mp == NULL || mp->state != MP_BODY)
+    return NULL;
+  return get_header(mp->headers, mp->num_headers, name);
+}
+
+void mg_get_multipart_names(const struct mg_multipart *mp, const char **name,
+                            const char **filename) {
+  int valid = (mp != NULL && mp->state == MP_BODY);
+
+  if (name)
+    *name = (valid ? mp->part_name : NULL);
+  if (filename)
+    *filename = (valid ? mp->file_name : NULL);
+}
+
+int mg_read_multipart(struct mg_connection *conn, mg_multipart_callback_t callback,
+                      void *user_data) {
+  struct mg_multipart *mp;
+  char buf[DATA_COPY_BUFSIZ];
+  int n, rv = 0;
+
+  mp = mg_create_multipart_parser(get_known_header(conn, HDR_CONTENT_TYPE),
+                                  callback, user_data);
+  if (mp == NULL)
+    return -1;
+  // keep reading past the closing boundary to drain the epilogue:
+  while (rv >= 0 && (n = mg_read(conn, buf, sizeof(buf))) > 0)
+    rv = mg_feed_multipart_parser(mp, buf, n);
+  mg_destroy_multipart_parser(mp);
+  return rv == 1 ? 0 : -1;
+}
+
 static int forward_body_data(struct mg_connection *conn, FILE *fp,
                              struct mg_connection *dst_conn, int send_error_on_fail) {
   const char *expect;
-  char buf[DATA_COPY_BUFSIZ];
-  int to_read, nread, success = 0;
+  char stack_buf[DATA_COPY_BUFSIZ];
+  char *buf;
+  int bufsiz, to_read, nread, success = 0;
 
-  expect = mg_get_header(conn, "Expect");
+  expect = get_known_header(conn, HDR_EXPECT);
   MG_ASSERT(fp != NULL);
 
-  // content_len==-1 is all right; it's just either Transfer-Encoding or a HTTP/1.0 client.
-  if (!strcmp(conn->request_info.request_method, "POST") ||
-      !strcmp(conn->request_info.request_method, "PUT")) {
+  // content_len==-1 is all right for chunked transfers. A POST or PUT which has
+  // neither a Content-Length nor chunked encoding gets 411, also from HTTP/1.0
+  // clients; for other methods the body runs until the client closes the connection.
+  if (conn->content_len == -1 && !conn->rx_is_in_chunked_mode &&
+      (!strcmp(conn->request_info.request_method, "POST") ||
+       !strcmp(conn->request_info.request_method, "PUT"))) {
     send_http_error(conn, 411, NULL, "");
   } else if (expect != NULL && mg_strcasecmp(expect, "100-continue")) {
     send_http_error(conn, 417, NULL, "");
@@ -5743,11 +8947,43 @@ static int forward_body_data(struct mg_connection *conn, FILE *fp,
       MG_ASSERT(mg_have_headers_been_sent(conn) == 0);
     }
 
+    // a large copy buffer pays off for bulk uploads; fall back to the stack when we're tight on memory.
+    buf = (char *) malloc(MG_BODY_COPY_BUFSIZ);
+    bufsiz = MG_BODY_COPY_BUFSIZ;
+    if (buf == NULL) {
+      buf = stack_buf;
+      bufsiz = (int) sizeof(stack_buf);
+    }
+
     nread = 0;
-    while (conn->consumed_content < conn->content_len || conn->content_len == -1) {
+#if defined(__linux__) && !defined(NO_SPLICE)
+    // Plain uploads of known size are spliced straight into the file; the body
+    // bytes which arrived together with the request headers are written first.
+    if (dst_conn == NULL && conn->ssl == NULL && !conn->rx_is_in_chunked_mode &&
+        conn->content_len > 0) {
+      int64_t n;
+
+      while (conn->consumed_content < conn->content_len &&
+             conn->rx_buffer_read_len < conn->rx_buffer_loaded_len) {
+        to_read = MG_MIN(bufsiz, conn->rx_buffer_loaded_len - conn->rx_buffer_read_len);
+        nread = mg_read(conn, buf, to_read);
+        if (nread <= 0 || push(fp, NULL, buf, nread) != nread) {
+          nread = -1;
+          break;
+        }
+      }
+      if (nread >= 0 && conn->consumed_content < conn->content_len) {
+        n = splice_body_data(conn, fp, conn->content_len - conn->consumed_content);
+        if (n == -1)
+          nread = -1;
+      }
+    }
+#endif
+
+    while (nread >= 0 && (conn->consumed_content < conn->content_len || conn->content_len == -1)) {
       int nwrite;
 
-      to_read = sizeof(buf);
+      to_read = bufsiz;
       if (conn->content_len >= 0 && (int64_t) to_read > conn->content_len - conn->consumed_content) {
         to_read = (int) (conn->content_len - conn->consumed_content);
       }
@@ -5760,6 +8996,8 @@ static int forward_body_data(struct mg_connection *conn, FILE *fp,
         break;
       }
     }
+    if (buf != stack_buf)
+      free(buf);
 
     if (conn->consumed_content == conn->content_len || conn->content_len == -1) {
       success = (nread >= 0);
@@ -5908,13 +9146,13 @@ static int prepare_cgi_environment(struct mg_connection *conn,
   addenv(blk, "SCRIPT_FILENAME=%s", prog);
   addenv(blk, "PATH_TRANSLATED=%s", prog);
 
-  if ((s = mg_get_header(conn, "Content-Type")) != NULL)
+  if ((s = get_known_header(conn, HDR_CONTENT_TYPE)) != NULL)
     addenv(blk, "CONTENT_TYPE=%s", s);
 
   if (!is_empty(conn->request_info.query_string))
     addenv(blk, "QUERY_STRING=%s", conn->request_info.query_string);
 
-  if ((s = mg_get_header(conn, "Content-Length")) != NULL)
+  if ((s = get_known_header(conn, HDR_CONTENT_LENGTH)) != NULL)
     addenv(blk, "CONTENT_LENGTH=%s", s);
 
   if ((s = getenv("PATH")) != NULL)
@@ -6185,7 +9423,7 @@ static void handle_cgi_request(struct mg_connection *conn, const char *prog) {
     // Send prefetched chunk to client
     (void)mg_write(conn, buf, i);
     // Read the rest of CGI stderr output and send to the client
-    (void)send_file_data(conn, err, INT64_MAX);
+    (void)send_file_data(conn, &err, INT64_MAX, 0);
     if (is_text_out == 2) {
       mg_printf(conn,
                 "</pre>\n"
@@ -6201,7 +9439,7 @@ static void handle_cgi_request(struct mg_connection *conn, const char *prog) {
     (void)mg_write(conn, buf + headers_len, data_len - headers_len);
 
   // Read the rest of CGI output and send to the client
-  (void)send_file_data(conn, out, INT64_MAX);
+  (void)send_file_data(conn, &out, INT64_MAX, 0);
 
   (void)mg_flush(conn);
 
@@ -6284,15 +9522,18 @@ static void put_file(struct mg_connection *conn, const char *path) {
 
   if (mg_is_producing_nested_page(conn))
     return;
-  mg_set_response_code(conn, mg_stat(path, &st) == 0 ? 200 : 201);
+  mg_set_response_code(conn, conn_stat(conn, path, &st) == 0 ? 200 : 201);
 
-  if ((rc = put_dir(path)) == 0) {
+  if (conn->disk_io_status != 0) {
+    send_http_error(conn, conn->disk_io_status, NULL,
+                    "stat(%s): disk I/O stalled", path);
+  } else if ((rc = put_dir(path)) == 0) {
     mg_write_http_response_head(conn, 0, 0);
   } else if (rc == -1) {
     send_http_error(conn, 500, NULL,
                     "put_dir(%s): %s", path, mg_strerror(ERRNO));
-  } else if ((fp = mg_fopen(path, "wb+")) == NULL) {
-    send_http_error(conn, 500, NULL,
+  } else if ((fp = conn_fopen(conn, path, "wb+")) == NULL) {
+    send_http_error(conn, conn->disk_io_status != 0 ? conn->disk_io_status : 500, NULL,
                     "fopen(%s): %s", path, mg_strerror(ERRNO));
   } else {
     set_close_on_exec(fileno(fp));
@@ -6386,16 +9627,15 @@ faulty_tag_value:
       rv = 2;
     } else {
       set_close_on_exec(fileno(fp));
-      if (match_string(get_conn_option(conn, SSI_EXTENSIONS),
-                       -1,
-                       conn->request_info.phys_path) > 0) {
+      if (match_option(conn, SSI_EXTENSIONS, conn->request_info.phys_path) > 0) {
         if (send_ssi_file(conn, conn->request_info.phys_path, fp, include_level + 1) < 0)
           rv = -1;
       } else {
-        if (send_file_data(conn, fp, INT64_MAX) < 0)
+        if (send_file_data(conn, &fp, INT64_MAX, 1) < 0)
           rv = -1;
       }
-      (void) mg_fclose(fp);
+      if (fp != NULL)
+        (void) mg_fclose(fp);
     }
   }
   conn->request_info.phys_path = p;
@@ -6415,7 +9655,7 @@ static int do_ssi_exec(struct mg_connection *conn, char *tag) {
     send_http_error(conn, 577, NULL, "Cannot SSI #exec: [%s]: %s", cmd, mg_strerror(ERRNO));
     return -1;
   } else {
-    int rv = (send_file_data(conn, fp, INT64_MAX) < 0);
+    int rv = (send_file_data(conn, &fp, INT64_MAX, 0) < 0);
     (void) pclose(fp);
     return rv;
   }
@@ -6680,7 +9920,7 @@ static void handle_propfind(struct mg_connection *conn, const char* path,
 
   // If it is a directory, print directory entries too if Depth is not 0
   if (st->is_directory &&
-      !mg_strcasecmp(get_conn_option(conn, ENABLE_DIRECTORY_LISTING), "yes") &&
+      get_conn_bool_option(conn, ENABLE_DIRECTORY_LISTING) &&
       (depth == NULL || strcmp(depth, "0") != 0)) {
     mg_scan_directory(conn, path, conn, &print_dav_dir_entry);
   }
@@ -6700,8 +9940,7 @@ static void handle_request(struct mg_connection *conn) {
   struct mgstat st;
 
   uri_len = (int)strlen(ri->uri);
-  url_decode(ri->uri, (size_t)uri_len, ri->uri, (size_t)(uri_len + 1), 0);
-  remove_double_dots_and_double_slashes(ri->uri);
+  (void) normalize_path(ri->uri, (size_t)uri_len, 1);
   stat_result = convert_uri_to_file_name(conn, path, sizeof(path), &st);
   ri->phys_path = path;
 
@@ -6709,6 +9948,8 @@ static void handle_request(struct mg_connection *conn) {
 
   if (!check_allowed(conn)) {
     send_http_error(conn, 405, NULL, "You cannot %s to this server", conn->request_info.request_method);
+  } else if (conn->disk_io_status != 0) {
+    send_http_error(conn, conn->disk_io_status, NULL, "Disk I/O stalled: URI=%s, PATH=%s", ri->uri, path);
   } else if (check_authorization(conn, path) != 1) {
     send_authorization_request(conn);
   } else if (call_user(conn, MG_NEW_REQUEST) != NULL) {
@@ -6758,16 +9999,16 @@ static void handle_request(struct mg_connection *conn) {
     handle_propfind(conn, path, &st);
   } else if (st.is_directory &&
              !mg_substitute_index_file(conn, path, sizeof(path), &st)) {
-    if (!mg_strcasecmp(get_conn_option(conn, ENABLE_DIRECTORY_LISTING), "yes")) {
+    if (conn->disk_io_status != 0) {
+      send_http_error(conn, conn->disk_io_status, NULL, "Disk I/O stalled: URI=%s, PATH=%s", ri->uri, path);
+    } else if (get_conn_bool_option(conn, ENABLE_DIRECTORY_LISTING)) {
       handle_directory_request(conn, path);
     } else {
       send_http_error(conn, 403, "Directory Listing Denied",
                       "Directory listing denied");
     }
 #if !defined(NO_CGI)
-  } else if (match_string(get_conn_option(conn, CGI_EXTENSIONS),
-                          -1,
-                          path) > 0) {
+  } else if (match_option(conn, CGI_EXTENSIONS, path) > 0) {
     if (strcmp(ri->request_method, "POST") &&
         strcmp(ri->request_method, "GET")) {
       send_http_error(conn, 501, NULL,
@@ -6776,15 +10017,10 @@ static void handle_request(struct mg_connection *conn) {
       handle_cgi_request(conn, path);
     }
 #endif // !NO_CGI
-  } else if (match_string(get_conn_option(conn, SSI_EXTENSIONS),
-                          -1,
-                          path) > 0) {
+  } else if (match_option(conn, SSI_EXTENSIONS, path) > 0) {
     handle_ssi_file_request(conn, path);
-  } else if (is_not_modified(conn, &st) &&
-             304 == mg_set_response_code(conn, 304)) {
-    send_http_error(conn, 304, NULL, "");
   } else {
-    handle_file_request(conn, path, &st);
+    handle_file_request(conn, path, &st, 1);
   }
   // and reset stack storage reference(s):
   ri->phys_path = NULL;
@@ -6846,6 +10082,8 @@ int mg_produce_nested_page(struct mg_connection *conn, const char *uri, size_t u
         conn->request_info.http_headers[i].name = "X-Clobbered";
       }
     }
+    // num_headers is unchanged, so the header index won't notice by itself:
+    invalidate_header_index(conn);
 
     handle_request(conn);  // may increment nested_err_or_pagereq_count when failing internally!
     // did we actually write a response? If not, make sure we report it as a fail to complete:
@@ -6858,6 +10096,7 @@ int mg_produce_nested_page(struct mg_connection *conn, const char *uri, size_t u
 fail_dramatically:
     ri.status_code = conn->request_info.status_code;
     conn->request_info = ri;
+    invalidate_header_index(conn);
   }
   MG_ASSERT(conn->nested_err_or_pagereq_count == 1 || conn->nested_err_or_pagereq_count == 2);
   return (conn->nested_err_or_pagereq_count != 1);
@@ -7077,7 +10316,7 @@ static int set_timeout(struct socket *sock, int seconds) {
     }
 
 #if defined(TCP_USER_TIMEOUT)
-    if (setsockopt(sock->sock, SOL_SOCKET, TCP_USER_TIMEOUT, (const void *)&user_timeout, sizeof(user_timeout)) < 0) {
+    if (setsockopt(sock->sock, IPPROTO_TCP, TCP_USER_TIMEOUT, (const void *)&user_timeout, sizeof(user_timeout)) < 0) {
       DEBUG_TRACE(0x0010,
                   ("setsockopt TCP_USER_TIMEOUT timeout %d set failed on socket: %d",
                    seconds, sock->sock));
@@ -7256,69 +10495,213 @@ static void log_access(struct mg_connection *conn) {
   (void) mg_fclose(fp);
 }
 
-// Verify given socket address against the ACL.
-// Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed.
-static int check_acl(struct mg_context *ctx, const struct usa *usa) {
-  int i, mask = 0, allowed;
+// A node of a compiled access control list: a path-compressed binary
+// (Patricia) trie over the 128-bit form of the addresses, where IPv4
+// addresses take their cvt_ipv4_to_ipv6() form.
+struct acl_node {
+  uint32_t key[4];                      // the prefix; the bits beyond 'len' are zero
+  int len;                              // prefix length in bits
+  int entry;                            // index of the last ACL entry for exactly this prefix; -1: none
+  int allow;                            // 1 when that entry is a '+' entry
+  int child[2];                         // indexes of the child nodes; -1: none
+};
+
+struct mg_acl {
+  int num_nodes;
+  struct acl_node nodes[1];             // nodes[0] is the root: the empty prefix
+};
+
+static void acl_ip_key(uint32_t key[4], const struct mg_ip_address *ip) {
+  struct mg_ip_address a;
+  int i;
+
+  cvt_ipv4_to_ipv6(&a, ip);
+  for (i = 0; i < 4; i++)
+    key[i] = ((uint32_t) a.ip_addr.v6[2 * i] << 16) | a.ip_addr.v6[2 * i + 1];
+}
+
+static int acl_key_bit(const uint32_t *key, int bit) {
+  return (key[bit >> 5] >> (31 - (bit & 31))) & 1;
+}
+
+// Return the number of leading bits 'a' and 'b' have in common, up to 'len'.
+static int acl_common_prefix(const uint32_t *a, const uint32_t *b, int len) {
+  uint32_t x;
+  int i, n;
+
+  for (i = 0; i < len; i += 32) {
+    if ((x = a[i >> 5] ^ b[i >> 5]) != 0) {
+      for (n = i; !(x & 0x80000000U); n++)
+        x <<= 1;
+      return (n < len ? n : len);
+    }
+  }
+  return len;
+}
+
+static int acl_new_node(struct mg_acl *acl, const uint32_t *key, int len) {
+  struct acl_node *node = &acl->nodes[acl->num_nodes];
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (len >= (i + 1) * 32)
+      node->key[i] = key[i];
+    else if (len > i * 32)
+      node->key[i] = key[i] & ~(0xFFFFFFFFU >> (len - i * 32));
+    else
+      node->key[i] = 0;
+  }
+  node->len = len;
+  node->entry = -1;
+  node->allow = 0;
+  node->child[0] = node->child[1] = -1;
+  return acl->num_nodes++;
+}
+
+// Add the prefix 'key'/'len' to the trie. Every call adds at most two nodes.
+static void acl_insert(struct mg_acl *acl, const uint32_t *key, int len, int entry, int allow) {
+  int node = 0, child, bit, m;
+
+  while (acl->nodes[node].len < len) {
+    bit = acl_key_bit(key, acl->nodes[node].len);
+    child = acl->nodes[node].child[bit];
+    if (child < 0) {
+      child = acl_new_node(acl, key, len);
+      acl->nodes[node].child[bit] = child;
+    } else {
+      m = acl->nodes[child].len;
+      m = acl_common_prefix(key, acl->nodes[child].key, m < len ? m : len);
+      if (m < acl->nodes[child].len) {
+        // split the edge: insert a node for the common prefix
+        int split = acl_new_node(acl, key, m);
+        acl->nodes[split].child[acl_key_bit(acl->nodes[child].key, m)] = child;
+        acl->nodes[node].child[bit] = split;
+        child = split;
+      }
+    }
+    node = child;
+  }
+  acl->nodes[node].entry = entry;
+  acl->nodes[node].allow = allow;
+}
+
+// Compile the ACL 'list' into '*acl', which is set to NULL when the list is
+// empty, i.e. when everybody is allowed.
+// Return 0 when the ACL is malformed or when out of memory.
+static int compile_acl(struct mg_context *ctx, const char *list, struct mg_acl **acl) {
+  int i, mask = 0, n = 0, len, ok = 1;
   char flag;
-  struct mg_ip_address acl_subnet, acl_mask, remote_ip;
+  struct mg_ip_address acl_subnet;
   struct usa ip;
   struct vec vec;
-  const char *list = get_option(ctx, ACCESS_CONTROL_LIST);
+  const char *p;
+  uint32_t key[4] = {0};
 
+  *acl = NULL;
   if (is_empty(list)) {
     return 1;
   }
+  for (p = list; (p = next_option(p, &vec, NULL)) != NULL; )
+    n++;
+  if ((*acl = (struct mg_acl *) malloc(sizeof(**acl) + 2 * n * sizeof((*acl)->nodes[0]))) == NULL) {
+    mg_cry(fc(ctx), "%s: out of memory", __func__);
+    return 0;
+  }
+  (*acl)->num_nodes = 0;
+  (void) acl_new_node(*acl, key, 0);
 
-  get_socket_ip_address(&remote_ip, usa);
-  cvt_ipv4_to_ipv6(&remote_ip, &remote_ip);
-
-  // If any ACL is set, deny by default
-  allowed = '-';
-
-  while ((list = next_option(list, &vec, NULL)) != NULL) {
+  for (n = 0; ok && (list = next_option(list, &vec, NULL)) != NULL; n++) {
     char acl_buf[SOCKADDR_NTOA_BUFSIZE * 2 + 10];
 
     if (vec.len >= sizeof(acl_buf)) {
       mg_cry(fc(ctx), "%s: bad acl ip/mask: [%.*s]", __func__, (int)vec.len, vec.ptr);
-      return -1;
+      ok = 0;
+      continue;
     }
     mg_strlcpy(acl_buf, vec.ptr, vec.len + 1);
 
     flag = acl_buf[0];
     if (sscanf(acl_buf, " %c%n", &flag, &i) != 1 && flag != '+' && flag != '-') {
       mg_cry(fc(ctx), "%s: flag must be + or -: [%s]", __func__, vec.ptr);
-      return -1;
+      ok = 0;
+      continue;
     }
-    switch (parse_ipvX_addr_and_netmask(acl_buf + i, &ip, &mask, &acl_mask)) {
+    switch (parse_ipvX_addr_and_netmask(acl_buf + i, &ip, &mask, NULL)) {
     case 0:
       break;
     default:
       mg_cry(fc(ctx), "%s: subnet must be [+|-]<IPv4 address: x.x.x.x>[/x] or [+|-]<IPv6 address>[/x], instead we see [%s]", __func__, acl_buf);
-      return -1;
+      ok = 0;
+      continue;
     case -2:
       mg_cry(fc(ctx), "%s: bad ip address: [%s]", __func__, acl_buf);
-      return -1;
+      ok = 0;
+      continue;
     case -3:
       mg_cry(fc(ctx), "%s: bad subnet mask: %d [%s]", __func__, mask, acl_buf);
-      return -1;
+      ok = 0;
+      continue;
     }
     get_socket_ip_address(&acl_subnet, &ip);
-    cvt_ipv4_to_ipv6(&acl_subnet, &acl_subnet);
-    cvt_ipv4_to_ipv6(&acl_mask, &acl_mask);
+    acl_ip_key(key, &acl_subnet);
+    // an IPv4 a.b.c.d/x is keyed as ::ffff:a:b:c:d with one byte in each
+    // 16-bit group, so its prefix covers the zero upper byte of the groups
+    if (acl_subnet.is_ip6)
+      len = mask;
+    else
+      len = 64 + 16 * (mask / 8) + (mask % 8 ? 8 + mask % 8 : 0);
+    acl_insert(*acl, key, len, n, flag == '+');
+  }
+  if (!ok) {
+    free(*acl);
+    *acl = NULL;
+  }
+  return ok;
+}
 
-    for (i = 0; i < 8; i++) {
-      if ((acl_subnet.ip_addr.v6[i]  & acl_mask.ip_addr.v6[i]) != (remote_ip.ip_addr.v6[i] & acl_mask.ip_addr.v6[i])) {
-        flag = 0;
-        break;
-      }
-    }
-    if (flag) {
-      allowed = flag;
+// Return 1 when the compiled ACL allows the given socket address, 0 otherwise.
+// As with the ACL string, the last matching entry wins: the trie is walked
+// along the address, picking the latest entry among the matching prefixes.
+static int match_acl(const struct mg_acl *acl, const struct usa *usa) {
+  const struct acl_node *node;
+  struct mg_ip_address remote_ip;
+  uint32_t key[4];
+  int i = 0, entry = -1, allow = 0;
+
+  if (acl == NULL) {
+    return 1;
+  }
+  get_socket_ip_address(&remote_ip, usa);
+  acl_ip_key(key, &remote_ip);
+
+  // If any ACL is set, deny by default
+  while (i >= 0) {
+    node = &acl->nodes[i];
+    if (acl_common_prefix(node->key, key, node->len) < node->len)
+      break;
+    if (node->entry > entry) {
+      entry = node->entry;
+      allow = node->allow;
     }
+    if (node->len >= 128)
+      break;
+    i = node->child[acl_key_bit(key, node->len)];
   }
+  return allow;
+}
+
+// Verify given socket address against the ACL 'list'.
+// Return -1 if ACL is malformed, 0 if address is disallowed, 1 if allowed.
+static int check_acl(struct mg_context *ctx, const char *list, const struct usa *usa) {
+  struct mg_acl *acl;
+  int allowed;
 
-  return allowed == '+';
+  if (!compile_acl(ctx, list, &acl)) {
+    return -1;
+  }
+  allowed = match_acl(acl, usa);
+  free(acl);
+  return allowed;
 }
 
 #if !defined(_WIN32)
@@ -7348,6 +10731,11 @@ static int set_uid_option(struct mg_context *ctx) {
 #if !defined(NO_SSL)
 static pthread_mutex_t *ssl_mutexes = NULL;
 
+// The SSL_CTX ex_data index under which our server SSL_CTX points back at its
+// mg_context. Index 0 is the SSL_CTX_set_app_data() slot, which is left to the
+// MG_INIT_SSL callback.
+static int ssl_ctx_ex_index = -1;
+
 // Return OpenSSL error message
 static const char *ssl_error(void) {
   unsigned long err;
@@ -7355,6 +10743,8 @@ static const char *ssl_error(void) {
   return err == 0 ? "" : ERR_error_string(err, NULL);
 }
 
+// The locking callbacks are only needed before OpenSSL 1.1; see is_legacy_openssl().
+#if !defined(NO_SSL_DL) || !defined(OPENSSL_API_1_1)
 static void ssl_locking_callback(int mode, int mutex_num, const char *file,
                                  int line) {
   line = 0;    // Unused
@@ -7375,10 +10765,41 @@ static unsigned long ssl_id_callback(void) {
   v.pt = pthread_self();
   return v.l;
 }
+#endif // !NO_SSL_DL || !OPENSSL_API_1_1
+
+// Return 1 for OpenSSL versions before 1.1, which must be initialized by the
+// application and need the locking callbacks above to be thread-safe. 1.1+
+// initializes itself and does its own locking.
+static int is_legacy_openssl(void) {
+#if defined(NO_SSL_DL)
+#if defined(OPENSSL_API_1_1)
+  return 0;
+#else
+  return 1;
+#endif // OPENSSL_API_1_1
+#else
+  return ssl_modern_sw[0].ptr == NULL;
+#endif // NO_SSL_DL
+}
+
+// Return 1 for OpenSSL 3.0+, whose SSL_CTX_set_options() takes and returns
+// uint64_t instead of unsigned long. The two differ on 32-bit and LLP64
+// platforms, so the call must go through the matching signature.
+static int is_openssl_3(void) {
+#if defined(NO_SSL_DL)
+#if defined(OPENSSL_API_3_0)
+  return 1;
+#else
+  return 0;
+#endif // OPENSSL_API_3_0
+#else
+  return ssl_v3_sw[0].ptr != NULL;
+#endif // NO_SSL_DL
+}
 
 #if !defined(NO_SSL_DL)
 static int load_dll(struct mg_context *ctx, const char *dll_name,
-                    struct ssl_func *sw) {
+                    struct ssl_func *sw, int optional) {
   union {void *p; void (*fp)(void);} u;
   void  *dll_handle;
   struct ssl_func *fp;
@@ -7397,7 +10818,13 @@ static int load_dll(struct mg_context *ctx, const char *dll_name,
     // function pointers. We need to use a union to make a cast.
     u.p = dlsym(dll_handle, fp->name);
 #endif // _WIN32
-    if (u.fp == NULL) {
+    if (u.fp == NULL && optional) {
+      // all or nothing: leave the whole table NULL
+      for (fp = sw; fp->name != NULL; fp++) {
+        fp->ptr = NULL;
+      }
+      return 0;
+    } else if (u.fp == NULL) {
       mg_cry(fc(ctx), "%s: %s: cannot find %s", __func__, dll_name, fp->name);
       return 0;
     } else {
@@ -7409,6 +10836,125 @@ static int load_dll(struct mg_context *ctx, const char *dll_name,
 }
 #endif // NO_SSL_DL
 
+// Replace the current session ticket key by a freshly generated one, keeping
+// the old key around so that the tickets it encrypted can still be decrypted.
+// Must be called with ctx->ticket_mutex held.
+static int rotate_ticket_key(struct mg_context *ctx, time_t now) {
+  struct mg_ssl_ticket_key key;
+
+  if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+      RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+      RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1) {
+    mg_cry(fc(ctx), "%s: cannot generate a session ticket key: %s", __func__, ssl_error());
+    return 0;
+  }
+  key.created = now;
+  ctx->ticket_keys[1] = ctx->ticket_keys[0];
+  ctx->ticket_keys[0] = key;
+  return 1;
+}
+
+// OpenSSL session ticket key callback; see SSL_CTX_set_tlsext_ticket_key_cb().
+// New tickets are encrypted with the current key, which is replaced once it
+// is ssl_ticket_key_lifetime seconds old. Tickets encrypted with the previous
+// key are accepted for one more lifetime, and are then reissued (return 2).
+static int ssl_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                                   EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc) {
+  struct mg_context *ctx = (struct mg_context *) SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ssl_ctx_ex_index);
+  struct mg_ssl_ticket_key key;
+  time_t now = time(NULL);
+  int i, rv = 0;
+
+  if (ctx == NULL || ctx->ticket_key_lifetime <= 0) {
+    return enc ? -1 : 0;
+  }
+
+  (void) pthread_mutex_lock(&ctx->ticket_mutex);
+  if (enc) {
+    if (ctx->ticket_keys[0].created == 0 ||
+        now - ctx->ticket_keys[0].created >= ctx->ticket_key_lifetime) {
+      (void) rotate_ticket_key(ctx, now);
+    }
+    if (ctx->ticket_keys[0].created != 0) {
+      key = ctx->ticket_keys[0];
+      rv = 1;
+    }
+  } else {
+    for (i = 0; i < (int) ARRAY_SIZE(ctx->ticket_keys); i++) {
+      if (ctx->ticket_keys[i].created != 0 &&
+          now - ctx->ticket_keys[i].created < 2 * ctx->ticket_key_lifetime &&
+          !memcmp(key_name, ctx->ticket_keys[i].name, sizeof(key.name))) {
+        key = ctx->ticket_keys[i];
+        rv = (i == 0 && now - key.created < ctx->ticket_key_lifetime) ? 1 : 2;
+        break;
+      }
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->ticket_mutex);
+
+  if (rv == 0) {
+    return enc ? -1 : 0;
+  }
+  if (enc) {
+    memcpy(key_name, key.name, sizeof(key.name));
+    if (RAND_bytes(iv, 16) != 1 ||
+        EVP_EncryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key.aes_key, iv) != 1) {
+      return -1;
+    }
+  } else if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key.aes_key, iv) != 1) {
+    return 0;
+  }
+  if (HMAC_Init_ex(hmac_ctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL) != 1) {
+    return enc ? -1 : 0;
+  }
+  return rv;
+}
+
+// Set up TLS session resumption, so that returning clients can skip the full
+// handshake: a server-side session cache of ssl_session_cache_size entries
+// (0 disables it) and stateless session tickets with rotating keys.
+static int set_ssl_session_options(struct mg_context *ctx) {
+  static const unsigned char sid_ctx[] = "mongoose";
+  long cache_size = atol(get_option(ctx, SSL_SESSION_CACHE_SIZE));
+  long timeout = atol(get_option(ctx, SSL_SESSION_TIMEOUT));
+  int lifetime = atoi(get_option(ctx, SSL_TICKET_KEY_LIFETIME));
+
+  if (cache_size < 0 || timeout <= 0 || lifetime <= 0) {
+    mg_cry(fc(ctx), "%s: invalid ssl_session_cache_size, ssl_session_timeout or ssl_ticket_key_lifetime", __func__);
+    return 0;
+  }
+  ctx->ticket_key_lifetime = mg_strcasecmp(get_option(ctx, SSL_SESSION_TICKETS), "yes") ? 0 : lifetime;
+
+  // OpenSSL treats a cache size of 0 as 'unlimited'
+  (void) SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SET_SESS_CACHE_MODE,
+                      cache_size > 0 ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF, NULL);
+  (void) SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SET_SESS_CACHE_SIZE, cache_size, NULL);
+  (void) SSL_CTX_set_timeout(ctx->ssl_ctx, timeout);
+  if (ssl_ctx_ex_index < 0) {
+    ssl_ctx_ex_index = CRYPTO_get_ex_new_index(is_legacy_openssl() ?
+                                               CRYPTO_EX_INDEX_SSL_CTX_1_0 : CRYPTO_EX_INDEX_SSL_CTX,
+                                               0, NULL, NULL, NULL, NULL);
+  }
+  if (SSL_CTX_set_session_id_context(ctx->ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1) != 1 ||
+      ssl_ctx_ex_index < 0 ||
+      SSL_CTX_set_ex_data(ctx->ssl_ctx, ssl_ctx_ex_index, ctx) != 1) {
+    mg_cry(fc(ctx), "%s: %s", __func__, ssl_error());
+    return 0;
+  }
+  if (ctx->ticket_key_lifetime > 0) {
+    (void) SSL_CTX_callback_ctrl(ctx->ssl_ctx, SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB,
+                                 (void (*)(void)) &ssl_ticket_key_callback);
+  } else if (is_legacy_openssl()) {
+    (void) SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_OPTIONS, SSL_OP_NO_TICKET, NULL);
+  } else if (is_openssl_3()) {
+    // SSL_CTRL_OPTIONS is gone since OpenSSL 1.1
+    (void) SSL_CTX_set_options_v3(ctx->ssl_ctx, SSL_OP_NO_TICKET);
+  } else {
+    (void) SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_TICKET);
+  }
+  return 1;
+}
+
 // Dynamically load SSL library. Set up ctx->ssl_ctx pointer.
 static int set_ssl_option(struct mg_context *ctx) {
   int i, size;
@@ -7419,23 +10965,45 @@ static int set_ssl_option(struct mg_context *ctx) {
   }
 
 #if !defined(NO_SSL_DL)
-  if (!load_dll(ctx, SSL_LIB, ssl_sw) ||
-      !load_dll(ctx, CRYPTO_LIB, crypto_sw)) {
+  if (!load_dll(ctx, SSL_LIB, ssl_sw, 0) ||
+      !load_dll(ctx, CRYPTO_LIB, crypto_sw, 0)) {
+    return 0;
+  }
+  if (!load_dll(ctx, SSL_LIB, ssl_modern_sw, 1) &&
+      (!load_dll(ctx, SSL_LIB, ssl_legacy_sw, 0) ||
+       !load_dll(ctx, CRYPTO_LIB, crypto_legacy_sw, 0))) {
     return 0;
   }
+  if (!is_legacy_openssl()) {
+    (void) load_dll(ctx, SSL_LIB, ssl_v3_sw, 1);
+  }
 #endif // NO_SSL_DL
 
   // Initialize SSL crap
-  SSL_library_init();
-  SSL_load_error_strings();
+  if (is_legacy_openssl()) {
+    SSL_library_init();
+    SSL_load_error_strings();
+  } else {
+    (void) OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+  }
 
-  if ((ctx->client_ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
+  // SSL_MODE_RELEASE_BUFFERS: let idle (keep-alive) connections hand their
+  // record buffers back; with OpenSSL 3 that saves ~9 KB per idle connection
+  // (see examples/ssl_idle_rss.c).
+  if ((ctx->client_ssl_ctx = SSL_CTX_new(is_legacy_openssl() ?
+                                         SSLv23_client_method() : TLS_client_method())) == NULL) {
     mg_cry(fc(ctx), "SSL_CTX_new (client) error: %s", ssl_error());
+  } else {
+    (void) SSL_CTX_ctrl(ctx->client_ssl_ctx, SSL_CTRL_MODE, SSL_MODE_RELEASE_BUFFERS, NULL);
   }
 
-  if ((ctx->ssl_ctx = SSL_CTX_new(SSLv23_server_method())) == NULL) {
+  if ((ctx->ssl_ctx = SSL_CTX_new(is_legacy_openssl() ?
+                                  SSLv23_server_method() : TLS_server_method())) == NULL) {
     mg_cry(fc(ctx), "SSL_CTX_new (server) error: %s", ssl_error());
+  } else if (!set_ssl_session_options(ctx)) {
+    return 0;
   } else {
+    (void) SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_MODE, SSL_MODE_RELEASE_BUFFERS, NULL);
     call_user_over_ctx(ctx, ctx->ssl_ctx, MG_INIT_SSL);
   }
 
@@ -7455,8 +11023,11 @@ static int set_ssl_option(struct mg_context *ctx) {
     return 0;
   }
 
-  // Initialize locking callbacks, needed for thread safety.
+  // Initialize locking callbacks, needed for thread safety before OpenSSL 1.1.
   // http://www.openssl.org/support/faq.html#PROG1
+  if (!is_legacy_openssl()) {
+    return 1;
+  }
   size = sizeof(pthread_mutex_t) * CRYPTO_num_locks();
   if ((ssl_mutexes = (pthread_mutex_t *) malloc((size_t)size)) == NULL) {
     mg_cry(fc(ctx), "%s: cannot allocate mutexes: %s", __func__, ssl_error());
@@ -7467,15 +11038,17 @@ static int set_ssl_option(struct mg_context *ctx) {
     pthread_mutex_init(&ssl_mutexes[i], NULL);
   }
 
+#if !defined(NO_SSL_DL) || !defined(OPENSSL_API_1_1)
   CRYPTO_set_locking_callback(&ssl_locking_callback);
   CRYPTO_set_id_callback(&ssl_id_callback);
+#endif // !NO_SSL_DL || !OPENSSL_API_1_1
 
   return 1;
 }
 
 static void uninitialize_ssl(struct mg_context *ctx) {
   int i;
-  if (ctx->ssl_ctx != NULL) {
+  if (ctx->ssl_ctx != NULL && ssl_mutexes != NULL) {
     CRYPTO_set_locking_callback(NULL);
     for (i = 0; i < CRYPTO_num_locks(); i++) {
       pthread_mutex_destroy(&ssl_mutexes[i]);
@@ -7484,6 +11057,24 @@ static void uninitialize_ssl(struct mg_context *ctx) {
     CRYPTO_set_id_callback(NULL);
   }
 }
+
+int mg_get_ssl_session_stats(struct mg_context *ctx, struct mg_ssl_session_stats *stats) {
+  if (ctx == NULL || ctx->ssl_ctx == NULL || stats == NULL)
+    return -1;
+  stats->handshakes = SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SESS_ACCEPT_GOOD, 0, NULL);
+  stats->hits = SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SESS_HIT, 0, NULL);
+  stats->misses = SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SESS_MISSES, 0, NULL);
+  stats->timeouts = SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SESS_TIMEOUTS, 0, NULL);
+  stats->cache_full = SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SESS_CACHE_FULL, 0, NULL);
+  stats->cached = SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SESS_NUMBER, 0, NULL);
+  return 0;
+}
+#else
+int mg_get_ssl_session_stats(struct mg_context *ctx, struct mg_ssl_session_stats *stats) {
+  (void) ctx;
+  (void) stats;
+  return -1;
+}
 #endif // !NO_SSL
 
 static int set_gpass_option(struct mg_context *ctx) {
@@ -7492,9 +11083,489 @@ static int set_gpass_option(struct mg_context *ctx) {
   return is_empty(path) || mg_stat(path, &mgstat) == 0;
 }
 
-static int set_acl_option(struct mg_context *ctx) {
-  struct usa fake = {0};
-  return check_acl(ctx, &fake) >= 0;
+static int set_acl_option(struct mg_context *ctx, struct mg_config *cfg) {
+  free(cfg->acl);
+  return compile_acl(ctx, config_value(cfg, ACCESS_CONTROL_LIST), &cfg->acl);
+}
+
+static int set_mime_option(struct mg_context *ctx, struct mg_config *cfg) {
+  free(cfg->mime);
+  cfg->mime = compile_mime_types(ctx, config_value(cfg, EXTRA_MIME_TYPES));
+  return cfg->mime != NULL;
+}
+
+static int set_rewrite_option(struct mg_context *ctx, struct mg_config *cfg) {
+  free_uri_map(cfg->rewrite);
+  cfg->rewrite = compile_uri_map(ctx, config_value(cfg, REWRITE), 1);
+  return cfg->rewrite != NULL;
+}
+
+static int set_protect_option(struct mg_context *ctx, struct mg_config *cfg) {
+  free_uri_map(cfg->protect);
+  cfg->protect = compile_uri_map(ctx, config_value(cfg, PROTECT_URI), 0);
+  return cfg->protect != NULL;
+}
+
+// The options which hold a pattern, which is compiled once.
+static const mg_option_index_t pattern_options[] = {
+  CGI_EXTENSIONS, SSI_EXTENSIONS, HIDE_FILES, PRECOMPRESSED_PATTERN, COMPRESS_CONTENT_TYPES
+};
+
+// (Re)compile the given option of the snapshot when it is a pattern option.
+// Return 0 when out of memory.
+static int set_pattern_option(struct mg_context *ctx, struct mg_config *cfg, int index) {
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(pattern_options); i++) {
+    if ((int) pattern_options[i] == index) {
+      free_pattern(cfg->patterns[index]);
+      cfg->patterns[index] = NULL;
+      if (cfg->config[index] != NULL &&
+          (cfg->patterns[index] = compile_pattern(cfg->config[index])) == NULL) {
+        mg_cry(fc(ctx), "%s: out of memory compiling %s", __func__,
+               config_options[index * MG_ENTRIES_PER_CONFIG_OPTION + 1]);
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// The comma-separated list options which are split up front.
+static const mg_option_index_t list_options[] = {
+  ALLOWED_METHODS, INDEX_FILES
+};
+
+// (Re)build the typed values of the given option of the snapshot.
+// Return 0 when out of memory.
+static int set_typed_option(struct mg_context *ctx, struct mg_config *cfg, int index) {
+  struct mg_typed_options *to = &cfg->typed;
+  const char *value = config_value(cfg, index);
+  const char *list;
+  struct vec v;
+  size_t i;
+  int n;
+
+  to->num[index] = atoi(value);
+  to->yes[index] = !mg_strcasecmp(value, "yes");
+  for (i = 0; i < ARRAY_SIZE(list_options); i++) {
+    if ((int) list_options[i] != index)
+      continue;
+    free(to->lists[index]);
+    to->lists[index] = NULL;
+    to->list_len[index] = 0;
+    if (index == ALLOWED_METHODS && is_empty(value))
+      value = DEFAULT_ALLOWED_METHODS;
+    for (n = 0, list = value; (list = next_option(list, &v, NULL)) != NULL; )
+      n++;
+    if (n > 0 && (to->lists[index] = (struct vec *) malloc(n * sizeof(v))) == NULL) {
+      mg_cry(fc(ctx), "%s: out of memory splitting %s", __func__,
+             config_options[index * MG_ENTRIES_PER_CONFIG_OPTION + 1]);
+      return 0;
+    }
+    for (list = value; (list = next_option(list, &v, NULL)) != NULL; )
+      to->lists[index][to->list_len[index]++] = v;
+  }
+  return 1;
+}
+
+static int set_typed_options(struct mg_context *ctx, struct mg_config *cfg) {
+  int i;
+
+  for (i = 0; i < NUM_OPTIONS; i++) {
+    if (!set_typed_option(ctx, cfg, i))
+      return 0;
+  }
+  cfg->typed.valid = 1;
+  return 1;
+}
+
+static int set_pattern_options(struct mg_context *ctx, struct mg_config *cfg) {
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(pattern_options); i++) {
+    if (!set_pattern_option(ctx, cfg, pattern_options[i]))
+      return 0;
+  }
+  return 1;
+}
+
+static void free_config(struct mg_config *cfg) {
+  int i;
+
+  if (cfg == NULL)
+    return;
+  for (i = 0; i < NUM_OPTIONS; i++) {
+    free(cfg->config[i]);
+    free_pattern(cfg->patterns[i]);
+    free(cfg->typed.lists[i]);
+  }
+  free(cfg->acl);
+  free(cfg->mime);
+  free_uri_map(cfg->rewrite);
+  free_uri_map(cfg->protect);
+  free(cfg);
+}
+
+// Return a private copy of the option values of 'src', which has yet to be
+// validated by set_typed_options() et al, or an empty snapshot when 'src' is
+// NULL. Return NULL when out of memory.
+static struct mg_config *copy_config(const struct mg_config *src) {
+  struct mg_config *cfg = (struct mg_config *) calloc(1, sizeof(*cfg));
+  int i;
+
+  for (i = 0; cfg != NULL && src != NULL && i < NUM_OPTIONS; i++) {
+    if (src->config[i] != NULL &&
+        (cfg->config[i] = mg_strdup(src->config[i])) == NULL) {
+      free_config(cfg);
+      cfg = NULL;
+    }
+  }
+  return cfg;
+}
+
+// Store a copy of the option value in the snapshot.
+// Return 0 when the value is invalid or when out of memory.
+static int set_config_value(struct mg_context *ctx, struct mg_config *cfg,
+                            int index, const char *value) {
+  char *v = mg_strdup(value);
+
+  if (v == NULL) {
+    mg_cry(fc(ctx), "%s: out of memory", __func__);
+    return 0;
+  }
+  // at least on Windows, replace single quotes around CGI binary path
+  // by double quotes or your CGI won't ever run.
+  // And you can't easily put double quotes around it from the command line,
+  // so kludge it is.
+  if (index == CGI_INTERPRETER && value[0] == '\'') {
+    char *qp = v;
+    *qp++ = '"';
+    qp = strchr(qp, '\'');
+    if (!qp) {
+      mg_cry(fc(ctx), "Invalid option value (improper quoting): %s=%s",
+             config_options[index * MG_ENTRIES_PER_CONFIG_OPTION + 1], value);
+      free(v);
+      return 0;
+    }
+    *qp = '"';
+  }
+  free(cfg->config[index]);
+  cfg->config[index] = v;
+  return 1;
+}
+
+// Free the retired snapshots which no connection is bound to anymore, once
+// they have been retired for MG_CONFIG_RETIRE_GRACE seconds.
+static void collect_retired_configs(struct mg_context *ctx) {
+  struct mg_config *done = NULL;
+  struct mg_config *cfg, **pp;
+  time_t now = time(NULL);
+
+  (void) pthread_mutex_lock(&ctx->cfg_mutex);
+  pp = &ctx->retired_cfgs;
+  while ((cfg = *pp) != NULL) {
+    if (cfg->refcount == 0 && now - cfg->retired >= MG_CONFIG_RETIRE_GRACE) {
+      *pp = cfg->next_retired;
+      cfg->next_retired = done;
+      done = cfg;
+    } else {
+      pp = &cfg->next_retired;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->cfg_mutex);
+
+  while ((cfg = done) != NULL) {
+    done = cfg->next_retired;
+    free_config(cfg);
+  }
+}
+
+// Put the snapshot on the retired list. The caller holds ctx->cfg_mutex.
+static void retire_config(struct mg_context *ctx, struct mg_config *cfg) {
+  cfg->retired = time(NULL);
+  cfg->next_retired = ctx->retired_cfgs;
+  ctx->retired_cfgs = cfg;
+}
+
+// Drop the cached virtual host configurations for 'host', or all of them when
+// 'host' is NULL. The caller holds ctx->cfg_mutex.
+static void drop_vhost_configs(struct mg_context *ctx, const char *host) {
+  struct mg_vhost_config *vh, **pp;
+  size_t i, len = (host != NULL ? strlen(host) : 0);
+
+  for (i = 0; i < ARRAY_SIZE(ctx->vhosts); i++) {
+    pp = &ctx->vhosts[i];
+    while ((vh = *pp) != NULL) {
+      if (host == NULL || (!mg_strncasecmp(vh->key, host, len) && vh->key[len] == '|')) {
+        *pp = vh->next;
+        vh->cfg->refcount--;
+        retire_config(ctx, vh->cfg);
+        free(vh);
+        ctx->num_vhosts--;
+      } else {
+        pp = &vh->next;
+      }
+    }
+  }
+}
+
+void mg_invalidate_vhost_configs(struct mg_context *ctx, const char *host) {
+  if (ctx == NULL)
+    return;
+  (void) pthread_mutex_lock(&ctx->cfg_mutex);
+  drop_vhost_configs(ctx, host);
+  (void) pthread_mutex_unlock(&ctx->cfg_mutex);
+  collect_retired_configs(ctx);
+}
+
+// Make the validated snapshot 'cfg' the current one. The replaced snapshot is
+// retired rather than freed: connections keep using it until they bind to
+// the new one at their next request, and the master thread until it has
+// dealt with the connection it is accepting; code which reads ctx->cfg
+// without a reference (mg_get_option() callers, see ctx_config()) is covered
+// by the MG_CONFIG_RETIRE_GRACE period. The virtual host configurations derived
+// from the replaced snapshot are retired along with it.
+static void publish_config(struct mg_context *ctx, struct mg_config *cfg) {
+  struct mg_config *old;
+
+  (void) pthread_mutex_lock(&ctx->cfg_mutex);
+  old = ctx->cfg;
+  ctx->cfg = cfg;
+  if (old != NULL)
+    retire_config(ctx, old);
+  drop_vhost_configs(ctx, NULL);
+  (void) pthread_mutex_unlock(&ctx->cfg_mutex);
+
+  collect_retired_configs(ctx);
+}
+
+// Bind the connection to the current configuration snapshot, so that the
+// option values it sees stay put for the duration of the request.
+static void bind_connection_config(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  struct mg_config *old = conn->cfg;
+
+  // a stale read only means the connection picks up a reload one request later
+  if (old == ctx->cfg)
+    return;
+  (void) pthread_mutex_lock(&ctx->cfg_mutex);
+  conn->cfg = ctx->cfg;
+  conn->cfg->refcount++;
+  if (old != NULL)
+    old->refcount--;
+  (void) pthread_mutex_unlock(&ctx->cfg_mutex);
+}
+
+// Take a reference to the current configuration snapshot, for a reader which
+// is not bound to one like a connection is, so that the snapshot is not freed
+// while it is in use. Release it with release_config().
+static struct mg_config *acquire_config(struct mg_context *ctx) {
+  struct mg_config *cfg;
+
+  (void) pthread_mutex_lock(&ctx->cfg_mutex);
+  cfg = ctx->cfg;
+  cfg->refcount++;
+  (void) pthread_mutex_unlock(&ctx->cfg_mutex);
+  return cfg;
+}
+
+static void release_config(struct mg_context *ctx, struct mg_config *cfg) {
+  (void) pthread_mutex_lock(&ctx->cfg_mutex);
+  cfg->refcount--;
+  (void) pthread_mutex_unlock(&ctx->cfg_mutex);
+}
+
+static void release_connection_config(struct mg_connection *conn) {
+  if (conn->cfg != NULL) {
+    (void) pthread_mutex_lock(&conn->ctx->cfg_mutex);
+    conn->cfg->refcount--;
+    (void) pthread_mutex_unlock(&conn->ctx->cfg_mutex);
+    conn->cfg = NULL;
+  }
+}
+
+// Build the snapshot of the options the user_option_get callback produces for
+// the current request. Return NULL when out of memory.
+static struct mg_config *resolve_vhost_config(struct mg_connection *conn) {
+  struct mg_config *base = conn->cfg;
+  struct mg_config *cfg = copy_config(base);
+  const char *value;
+  int i;
+
+  for (i = 0; cfg != NULL && i < NUM_OPTIONS; i++) {
+    value = call_user_conn_option_get(conn, config_options[i * MG_ENTRIES_PER_CONFIG_OPTION + 1]);
+    if (value != NULL && value != base->config[i]) {
+      free(cfg->config[i]);
+      if ((cfg->config[i] = mg_strdup(value)) == NULL) {
+        free_config(cfg);
+        cfg = NULL;
+      }
+    }
+  }
+  if (cfg != NULL && (!set_typed_options(conn->ctx, cfg) || !set_pattern_options(conn->ctx, cfg) ||
+                      !set_rewrite_option(conn->ctx, cfg) || !set_protect_option(conn->ctx, cfg))) {
+    free_config(cfg);
+    cfg = NULL;
+  }
+  if (cfg != NULL)
+    cfg->is_vhost = 1;
+  return cfg;
+}
+
+static struct mg_vhost_config *find_vhost_config(struct mg_context *ctx, const char *key,
+                                                 unsigned int hash) {
+  struct mg_vhost_config *vh;
+
+  for (vh = ctx->vhosts[hash % ARRAY_SIZE(ctx->vhosts)]; vh != NULL; vh = vh->next) {
+    if (vh->hash == hash && !strcmp(vh->key, key))
+      break;
+  }
+  return vh;
+}
+
+// When vhost_config_cache is enabled, rebind the connection, after its
+// request headers have been parsed, to the configuration resolved for its
+// Host header and listener, so that the option lookups for the request do not
+// have to go through the user_option_get callback. The configuration is
+// resolved on the first request for a host and cached until the options are
+// reloaded or mg_invalidate_vhost_configs() is called.
+//
+// This assumes the callback's answers only depend on the Host header and the
+// local address of the connection.
+static void bind_vhost_config(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  struct mg_config *base = conn->cfg;
+  struct mg_config *cfg;
+  struct mg_vhost_config *vh;
+  const char *host = get_known_header(conn, HDR_HOST);
+  char key[256 + SOCKADDR_NTOA_BUFSIZE + 8];
+  char addr[SOCKADDR_NTOA_BUFSIZE];
+  unsigned int hash = 0;
+  int i, len, has_room;
+
+  if (base == NULL || base->is_vhost || !base->typed.yes[VHOST_CONFIG_CACHE] ||
+      ctx->user_functions.user_option_get == NULL)
+    return;
+  if (host == NULL)
+    host = "";
+  else if (strlen(host) > 255)
+    return;     // absurdly long Host: don't cache it
+  len = mg_snprintf(conn, key, sizeof(key), "%s|%s:%d", host,
+                    sockaddr_to_string(addr, sizeof(addr), &conn->client.lsa),
+                    (int) conn->request_info.local_port);
+  for (i = 0; i < len; i++) {
+    key[i] = (char) lowercase(key + i);
+    hash = hash * 31 + (unsigned char) key[i];
+  }
+
+  (void) pthread_mutex_lock(&ctx->cfg_mutex);
+  vh = find_vhost_config(ctx, key, hash);
+  if (vh != NULL) {
+    conn->cfg = vh->cfg;
+    conn->cfg->refcount++;
+    base->refcount--;
+  }
+  has_room = (ctx->num_vhosts < MG_MAX_VHOST_CONFIGS);
+  (void) pthread_mutex_unlock(&ctx->cfg_mutex);
+  if (vh != NULL || !has_room)
+    return;
+
+  // resolve outside the lock: the callback may take its time
+  if ((cfg = resolve_vhost_config(conn)) == NULL ||
+      (vh = (struct mg_vhost_config *) malloc(sizeof(*vh) + len)) == NULL) {
+    free_config(cfg);
+    return;
+  }
+  vh->hash = hash;
+  vh->cfg = cfg;
+  memcpy(vh->key, key, len + 1);
+
+  (void) pthread_mutex_lock(&ctx->cfg_mutex);
+  // only cache it when no reload or other worker got in between
+  if (ctx->cfg == base && ctx->num_vhosts < MG_MAX_VHOST_CONFIGS &&
+      find_vhost_config(ctx, key, hash) == NULL) {
+    vh->next = ctx->vhosts[hash % ARRAY_SIZE(ctx->vhosts)];
+    ctx->vhosts[hash % ARRAY_SIZE(ctx->vhosts)] = vh;
+    ctx->num_vhosts++;
+    cfg->refcount = 2;
+    base->refcount--;
+    conn->cfg = cfg;
+    vh = NULL;
+  }
+  (void) pthread_mutex_unlock(&ctx->cfg_mutex);
+  if (vh != NULL) {
+    free_config(cfg);
+    free(vh);
+  }
+}
+
+// Build a snapshot of the current options with the given changes applied,
+// validate it and publish it. Return the published snapshot, or NULL on
+// error. The caller holds ctx->reload_mutex.
+static struct mg_config *reload_config(struct mg_context *ctx, const char **options) {
+  struct mg_config *cfg;
+  const char *name, *value;
+  int i, rv = 0;
+
+  if ((cfg = copy_config(ctx->cfg)) == NULL) {
+    mg_cry(fc(ctx), "%s: out of memory", __func__);
+    rv = -1;
+  }
+  while (rv == 0 && options && (name = *options++) != NULL) {
+    value = *options++;
+    if ((i = get_option_index(name)) == -1) {
+      mg_cry(fc(ctx), "%s: invalid option: %s", __func__, name);
+      rv = -1;
+    } else if (value == NULL) {
+      mg_cry(fc(ctx), "%s: option value cannot be NULL", name);
+      rv = -1;
+    } else if (!set_config_value(ctx, cfg, i, value)) {
+      rv = -1;
+    } else {
+      DEBUG_TRACE(0x1000, ("[%s] -> [%s]", name, cfg->config[i]));
+    }
+  }
+  if (rv == 0 &&
+      (!set_acl_option(ctx, cfg) ||
+       !set_mime_option(ctx, cfg) ||
+       !set_rewrite_option(ctx, cfg) ||
+       !set_protect_option(ctx, cfg) ||
+       !set_typed_options(ctx, cfg) ||
+       !set_pattern_options(ctx, cfg)))
+    rv = -1;
+
+  if (rv != 0) {
+    free_config(cfg);
+    return NULL;
+  }
+  publish_config(ctx, cfg);
+  return cfg;
+}
+
+int mg_reload_options(struct mg_context *ctx, const char **options) {
+  struct mg_config *cfg;
+
+  if (ctx == NULL || ctx->cfg == NULL)
+    return -1;
+
+  (void) pthread_mutex_lock(&ctx->reload_mutex);
+  cfg = reload_config(ctx, options);
+  (void) pthread_mutex_unlock(&ctx->reload_mutex);
+  return cfg != NULL ? 0 : -1;
+}
+
+static int set_header_buffer_option(struct mg_context *ctx) {
+  ctx->header_buf_size = atoi(get_option(ctx, HEADER_BUFFER_SIZE));
+  ctx->max_header_buf_size = atoi(get_option(ctx, MAX_HEADER_BUFFER_SIZE));
+  if (ctx->header_buf_size < MIN_REQUEST_SIZE) {
+    mg_cry(fc(ctx), "%s: header_buffer_size must be at least %d bytes", __func__, MIN_REQUEST_SIZE);
+    return 0;
+  }
+  // a maximum below the initial size means: fixed size buffers
+  if (ctx->max_header_buf_size < ctx->header_buf_size)
+    ctx->max_header_buf_size = ctx->header_buf_size;
+  return 1;
 }
 
 static void reset_per_request_attributes(struct mg_connection *conn) {
@@ -7514,6 +11585,7 @@ static void reset_per_request_attributes(struct mg_connection *conn) {
   ri->num_headers = 0;
   ri->num_response_headers = 0;
   memset(&ri->http_headers, 0, sizeof(ri->http_headers));
+  invalidate_header_index(conn);
   memset(&ri->response_headers, 0, sizeof(ri->response_headers));
   ri->status_code = -1;
   ri->status_custom_description = NULL;
@@ -7540,6 +11612,8 @@ static void reset_per_request_attributes(struct mg_connection *conn) {
   conn->nested_err_or_pagereq_count = 0;
   conn->tx_can_compact_hdrstore = 0;
   conn->tx_headers_len = 0;
+  conn->auth_nonce_stale = 0;
+  conn->auth_nonce_seq = 0;
 
   // reset all chunked-transfer related datums as those are per-request:
   conn->tx_is_in_chunked_mode = 0;
@@ -7553,22 +11627,36 @@ static void reset_per_request_attributes(struct mg_connection *conn) {
   conn->rx_remaining_chunksize = 0;
   conn->rx_chunk_buf_size = 0;
   //conn->rx_buffer_loaded_len = 0;
+
+  conn->disk_io_status = 0;
+  conn->tx_no_compression = 0;
+#if defined(USE_ZLIB)
+  if (conn->tx_compressor != NULL)
+    conn->tx_compressor->state = 0;
+#endif
 }
 
 static void close_socket_gracefully(struct mg_connection *conn) {
   char buf[MG_BUF_LEN];
   struct linger linger;
   int n, w;
-  int linger_timeout = atoi(get_conn_option(conn, SOCKET_LINGER_TIMEOUT)) * 1000;
+  int linger_timeout = get_conn_int_option(conn, SOCKET_LINGER_TIMEOUT) * 1000;
   SOCKET sock;
   int abort_when_server_stops;
+  int handshake_expired;
 
   if (!conn || conn->client.sock == INVALID_SOCKET)
     return;
   sock = conn->client.sock;
   abort_when_server_stops = conn->abort_when_server_stops;
-
-  MG_ASSERT(!conn->client.is_ssl == !conn->ssl);
+  // a connection which expired (or was evicted from the idle queue) before
+  // its TLS handshake completed has never been sent anything: don't spend
+  // worker time on lingering for it
+  handshake_expired = (conn->client.idle_time_expired && !conn->is_inited);
+
+  // a TLS connection which expires before its handshake got under way
+  // has no SSL object yet
+  MG_ASSERT(!conn->ssl || conn->client.is_ssl);
   if (conn->ssl) {
     // see http://www.openssl.org/docs/ssl/SSL_set_shutdown.html#NOTES
     // and http://www.openssl.org/docs/ssl/SSL_shutdown.html
@@ -7579,6 +11667,8 @@ static void close_socket_gracefully(struct mg_connection *conn) {
     SSL_free(conn->ssl);
     conn->ssl = NULL;
   }
+  // the pending RX data is drained from the raw socket below
+  conn->client.is_ssl = 0;
 
   /*
 
@@ -7624,7 +11714,9 @@ static void close_socket_gracefully(struct mg_connection *conn) {
   // behaviour is seen on Windows, when client keeps sending data
   // when server decides to close the connection; then when client
   // does recv() it gets no data back.
-  do {
+  if (handshake_expired)
+    linger_timeout = 0;
+  else do {
     // we still need to fetch it (see WinSock comments elsewhere for what
     // happens if you don't. Doing this on a NON-BLOCKING socket would
     // as data may still be incoming (but we don't wanna hear about it),
@@ -7719,6 +11811,9 @@ static void close_socket_gracefully(struct mg_connection *conn) {
 static void close_connection(struct mg_connection *conn) {
   (void) mg_flush(conn);       // shut down chunked transfers 'cleanly', if possible
   close_socket_gracefully(conn);
+  release_io_job(conn);
+  release_tx_compressor(conn);
+  release_header_buffer(conn);
 }
 
 void mg_close_connection(struct mg_connection *conn) {
@@ -7752,7 +11847,7 @@ struct mg_connection *mg_connect(struct mg_context *ctx,
 
   MG_ASSERT(ctx);
   if (flags & MG_CONNECT_HTTP_IO) {
-    http_io_buf_size = MAX_REQUEST_SIZE;
+    http_io_buf_size = get_header_buf_size(ctx);
   } else {
     http_io_buf_size = 0;
   }
@@ -7833,6 +11928,7 @@ struct mg_connection *mg_connect(struct mg_context *ctx,
         mg_cry(fc(ctx), "%s: sslize(%s:%d): cannot establish SSL connection", __func__, host, port);
         closesocket(sock);
       } else {
+        newconn->client.is_ssl = newconn->request_info.is_ssl = ((flags & MG_CONNECT_USE_SSL) != 0);
         if (result) freeaddrinfo(result);
         return newconn;
       }
@@ -7946,6 +12042,7 @@ int mg_read_http_response_head(struct mg_connection *conn) {
   MG_ASSERT(conn->content_len == -1);
   ri = &conn->request_info;
   ri->num_headers = 0;
+  invalidate_header_index(conn);
 
   // when a bit of buffered data is still available, make sure it's in the right spot:
   data_len = conn->rx_buffer_loaded_len - conn->rx_buffer_read_len;
@@ -7955,9 +12052,7 @@ int mg_read_http_response_head(struct mg_connection *conn) {
     data_len = 0;
   }
 
-  conn->request_len = read_request(NULL, conn,
-                                   conn->buf, conn->buf_size,
-                                   &data_len);
+  conn->request_len = read_http_headers(conn, &data_len);
   MG_ASSERT(data_len >= conn->request_len);
   ri->seq_no++;
   if (conn->request_len == 0 && data_len == conn->buf_size) {
@@ -8014,14 +12109,14 @@ int mg_read_http_response_head(struct mg_connection *conn) {
     return -5;
   } else {
     // Response is valid, handle the basics.
-    const char *cl = get_header(ri->http_headers, ri->num_headers, "Transfer-Encoding");
+    const char *cl = get_known_header(conn, HDR_TRANSFER_ENCODING);
     MG_ASSERT(conn->content_len == -1);
     if (cl && mg_stristr(cl, "chunked")) {
       MG_ASSERT(conn->content_len == -1);
       mg_set_rx_mode(conn, MG_IOMODE_CHUNKED_DATA);
     } else {
       MG_ASSERT(!conn->rx_is_in_chunked_mode);
-      cl = get_header(ri->http_headers, ri->num_headers, "Content-Length");
+      cl = get_known_header(conn, HDR_CONTENT_LENGTH);
       chknum = NULL;
       if (cl != NULL)
         conn->content_len = strtoll(cl, &chknum, 10);
@@ -8040,10 +12135,10 @@ int mg_read_http_response_head(struct mg_connection *conn) {
         // The chunked transfer case resolves itself, as long as we make sure
         // to keep content_len == -1 then.
         const char *http_version = ri->http_version;
-        const char *header = get_header(ri->http_headers, ri->num_headers, "Connection");
+        const char *header = get_known_header(conn, HDR_CONNECTION);
 
         if (!conn->must_close &&
-            !mg_strcasecmp(get_conn_option(conn, ENABLE_KEEP_ALIVE), "yes") &&
+            get_conn_bool_option(conn, ENABLE_KEEP_ALIVE) &&
             (header == NULL ?
              (http_version && !strcmp(http_version, "1.1")) :
              !mg_strcasecmp(header, "keep-alive"))) {
@@ -8201,6 +12296,8 @@ static int process_new_connection(struct mg_connection *conn) {
     }
 #endif
     reset_per_request_attributes(conn);
+    if (!conn->is_client_conn)
+      bind_connection_config(conn);
 
     // when a bit of buffered data is still available, make sure it's in the right spot:
     data_len = conn->rx_buffer_loaded_len - conn->rx_buffer_read_len;
@@ -8210,9 +12307,7 @@ static int process_new_connection(struct mg_connection *conn) {
       data_len = 0;
     }
 
-    conn->request_len = read_request(NULL, conn,
-                                     conn->buf, conn->buf_size,
-                                     &data_len);
+    conn->request_len = read_http_headers(conn, &data_len);
     MG_ASSERT(data_len >= conn->request_len);
     conn->request_info.seq_no++;
     if (conn->request_len <= 0) {
@@ -8242,6 +12337,7 @@ static int process_new_connection(struct mg_connection *conn) {
 
     // NUL-terminate the request cause parse_http_request() is C-string based
     conn->buf[conn->request_len - 1] = '\0';
+    invalidate_header_index(conn);
     if (parse_http_request(conn->buf, ri) ||
         !is_valid_uri(ri->uri)) {
       // Do not put garbage in the access log, just send it back to the client
@@ -8254,14 +12350,15 @@ static int process_new_connection(struct mg_connection *conn) {
       log_access(conn);
     } else {
       // Request is valid, handle it
-      cl = get_header(ri->http_headers, ri->num_headers, "Transfer-Encoding");
+      bind_vhost_config(conn);
+      cl = get_known_header(conn, HDR_TRANSFER_ENCODING);
       MG_ASSERT(conn->content_len == -1);
       if (cl && mg_stristr(cl, "chunked")) {
         mg_set_rx_mode(conn, MG_IOMODE_CHUNKED_DATA);
       } else {
         char *chknum = NULL;
         MG_ASSERT(!conn->rx_is_in_chunked_mode);
-        cl = get_header(ri->http_headers, ri->num_headers, "Content-Length");
+        cl = get_known_header(conn, HDR_CONTENT_LENGTH);
         if (cl != NULL)
           conn->content_len = strtoll(cl, &chknum, 10);
         if (chknum != NULL)
@@ -8278,10 +12375,10 @@ static int process_new_connection(struct mg_connection *conn) {
           // The chunked transfer case resolves itself, as long as we make sure
           // to keep content_len == -1 then.
           const char *http_version = ri->http_version;
-          const char *header = get_header(ri->http_headers, ri->num_headers, "Connection");
+          const char *header = get_known_header(conn, HDR_CONNECTION);
 
           if (!conn->must_close &&
-              !mg_strcasecmp(get_conn_option(conn, ENABLE_KEEP_ALIVE), "yes") &&
+              get_conn_bool_option(conn, ENABLE_KEEP_ALIVE) &&
               (header == NULL ?
                (http_version && !strcmp(http_version, "1.1")) :
                !mg_strcasecmp(header, "keep-alive"))) {
@@ -8316,6 +12413,26 @@ static int process_new_connection(struct mg_connection *conn) {
   return 0;
 }
 
+// Take the TLS handshakes in test set SET out of (ADD == 0) or back into
+// (ADD != 0) the ctx->num_queued_handshakes count: only the nodes in the
+// idle queue proper can be evicted, not those a worker has pulled.
+static void count_queued_handshakes(struct mg_context *ctx, int set, int add) {
+  struct mg_idle_connection *arr = ctx->queue_store;
+  int p = set;
+
+  do {
+    if (add) {
+      arr[p].in_handshake = (arr[p].client.is_ssl && !arr[p].is_inited &&
+                             !arr[p].client.idle_time_expired);
+      ctx->num_queued_handshakes += arr[p].in_handshake;
+    } else if (arr[p].in_handshake) {
+      arr[p].in_handshake = 0;
+      ctx->num_queued_handshakes--;
+    }
+    p = arr[p].next;
+  } while (p != set);
+}
+
 // extract N idle connections from the queue to test; locking should be done by caller!
 //
 // NOTE: we tweak the extracted elements' was_idle bits (they're ours now)
@@ -8347,6 +12464,7 @@ static int pull_testset_from_idle_queue(struct mg_context *ctx, int n) {
         arr[p].next = p;
         arr[p].prev = p;
         ctx->sq_head = head;
+        count_queued_handshakes(ctx, p, 0);
         return p;
       }
       arr[p].client.was_idle = 0;
@@ -8357,6 +12475,7 @@ static int pull_testset_from_idle_queue(struct mg_context *ctx, int n) {
     if (p == idle_test_set) {
       // grabbed entire set, so that's easy:
       ctx->sq_head = -1;
+      count_queued_handshakes(ctx, idle_test_set, 0);
       return idle_test_set;
     }
     arr[arr[idle_test_set].prev].next = arr[p].next;
@@ -8366,11 +12485,59 @@ static int pull_testset_from_idle_queue(struct mg_context *ctx, int n) {
     arr[p].next = idle_test_set;
 
     ctx->sq_head = head;
+    count_queued_handshakes(ctx, idle_test_set, 0);
     return idle_test_set;
   }
   return -1;
 }
 
+// Return non-zero when queued handshake A should be evicted before B.
+//
+// birth_time has a resolution of one second: among handshakes of the same
+// age, keep those which have client data waiting (they are about to make
+// progress) and expire the one which has been silent the longest.
+static int is_older_queued_handshake(const struct mg_idle_connection *a,
+                                     const struct mg_idle_connection *b) {
+  int a_busy = (a->client.was_idle && a->client.has_read_data);
+  int b_busy = (b->client.was_idle && b->client.has_read_data);
+
+  if (a->birth_time != b->birth_time)
+    return a->birth_time < b->birth_time;
+  if (a_busy != b_busy)
+    return b_busy;
+  return a->last_active_time < b->last_active_time;
+}
+
+// Keep the idle queue within MG_MAX_QUEUED_HANDSHAKES TLS handshakes:
+// expire the oldest ones, so that the next worker to scan the queue closes
+// them.
+//
+// Only the nodes in the queue proper are considered: the test sets pulled by
+// the workers are theirs to modify until they are returned, which is why
+// insert_testset_into_idle_queue() calls this too.
+// Locking should be done by the caller!
+static void evict_queued_handshakes(struct mg_context *ctx) {
+  struct mg_idle_connection *arr = ctx->queue_store;
+  int head = ctx->sq_head;
+  int p, oldest;
+
+  while (head >= 0 && ctx->num_queued_handshakes > MG_MAX_QUEUED_HANDSHAKES) {
+    oldest = -1;
+    p = head;
+    do {
+      if (arr[p].in_handshake &&
+          (oldest < 0 || is_older_queued_handshake(&arr[p], &arr[oldest])))
+        oldest = p;
+      p = arr[p].next;
+    } while (p != head);
+    if (oldest < 0)
+      break;
+    arr[oldest].in_handshake = 0;
+    arr[oldest].client.idle_time_expired = 1;
+    ctx->num_queued_handshakes--;
+  }
+}
+
 // re-insert a series of idle connections into the idle queue: place these
 // at the back when they are not marked as 'active', place the nodes which are
 // marked as 'active' at the front of the queue so they can be picked off
@@ -8390,6 +12557,7 @@ static void insert_testset_into_idle_queue(struct mg_context *ctx, int idle_test
   node_set[0] = node_set[ARRAY_SIZE(node_set) - 1] = -1;
   MG_ASSERT(idle_test_set >= 0);
   MG_ASSERT(idle_test_set < ARRAY_SIZE(ctx->queue_store));
+  count_queued_handshakes(ctx, idle_test_set, 1);
   p = idle_test_set;
   do {
     if (arr[p].client.was_idle && arr[p].client.has_read_data)
@@ -8460,6 +12628,7 @@ static void insert_testset_into_idle_queue(struct mg_context *ctx, int idle_test
   }
 
   ctx->sq_head = head;
+  evict_queued_handshakes(ctx);
 }
 
 // Remove the given element from the idle queue / storage and init the 'conn' connection with its data.
@@ -8486,6 +12655,10 @@ static int pop_node_from_idle_queue(struct mg_context *ctx, int node, struct mg_
   conn->client = arr->client;
   conn->birth_time = arr->birth_time;
   conn->last_active_time = arr->last_active_time;
+  if (arr->in_handshake) {
+    arr->in_handshake = 0;
+    ctx->num_queued_handshakes--;
+  }
 
   // remove node from any cyclic linked list out there:
   if (arr->next == node) {
@@ -8530,6 +12703,9 @@ static int push_conn_onto_idle_queue(struct mg_context *ctx, struct mg_connectio
   arr->client = conn->client;
   arr->birth_time = conn->birth_time;
   arr->last_active_time = conn->last_active_time = time(NULL);
+  arr->in_handshake = (conn->client.is_ssl && !conn->is_inited);
+  if (arr->in_handshake)
+    ctx->num_queued_handshakes++;
 
   // make sure to clear the 'has_read_data' when it would be in an unknown state before
   if (!arr->client.was_idle)
@@ -8548,6 +12724,7 @@ static int push_conn_onto_idle_queue(struct mg_context *ctx, struct mg_connectio
     arr[head].prev = i;
   }
   ctx->sq_head = head;
+  evict_queued_handshakes(ctx);
   return i;
 }
 
@@ -8774,7 +12951,7 @@ static int produce_socket(struct mg_context *ctx, struct mg_connection *conn) {
 static void * WINCDECL worker_thread(struct mg_context *ctx) {
   struct mg_connection *conn = NULL;
 
-  conn = (struct mg_connection *) malloc(sizeof(*conn) + MAX_REQUEST_SIZE * 2 + CHUNK_HEADER_BUFSIZ); /* RX headers, TX headers, chunk header space */
+  conn = (struct mg_connection *) malloc(sizeof(*conn) + ctx->header_buf_size * 2 + CHUNK_HEADER_BUFSIZ); /* RX headers, TX headers, chunk header space */
   if (conn == NULL) {
     mg_cry(fc(ctx), "Cannot create new connection struct, OOM");
     goto fail_dramatically;
@@ -8786,13 +12963,15 @@ static void * WINCDECL worker_thread(struct mg_context *ctx) {
   // sq_empty condvar to wake up the master waiting in produce_socket()
   while (consume_socket(ctx, conn)) {
     int doing_fine = 1;
+    int awaiting_data = 0;
 
     // everything in 'conn' is zeroed at this point in time: set up the buffers, etc.
-    conn->buf_size = MAX_REQUEST_SIZE;
+    conn->buf_size = ctx->header_buf_size;
     conn->buf = (char *) (conn + 1);
     conn->ctx = ctx;
     conn->request_info.is_ssl = conn->client.is_ssl;
     conn->abort_when_server_stops = 1;
+    bind_connection_config(conn);
     if (conn->client.idle_time_expired) {
       DEBUG_TRACE(0x0023, ("kept-alive(?) connection expired (keep-alive-timeout)"));
       conn->must_close = 1;
@@ -8801,27 +12980,40 @@ static void * WINCDECL worker_thread(struct mg_context *ctx) {
     }
 
     if (!conn->is_inited && doing_fine) {
+      int handshake;
+
       doing_fine = 0;
 
       // Fill in IP, port info early so even if SSL setup below fails,
       // error handler would have the corresponding info.
       // Thanks to Johannes Winkelmann for the patch.
-      conn->request_info.remote_port = get_socket_port(&conn->client.rsa);
-      get_socket_ip_address(&conn->request_info.remote_ip, &conn->client.rsa);
-      // get the actual local IP address+port the client connected to:
-      if (0 != getsockname(conn->client.sock, &conn->client.lsa.u.sa, &conn->client.lsa.len)) {
-        mg_cry(conn, "%s: getsockname: %s", __func__, mg_strerror(ERRNO));
-        //conn->client.lsa.len = 0;
+      // (A TLS connection comes by here once per handshake step.)
+      if (conn->ssl == NULL) {
+        conn->request_info.remote_port = get_socket_port(&conn->client.rsa);
+        get_socket_ip_address(&conn->request_info.remote_ip, &conn->client.rsa);
+        // get the actual local IP address+port the client connected to:
+        if (0 != getsockname(conn->client.sock, &conn->client.lsa.u.sa, &conn->client.lsa.len)) {
+          mg_cry(conn, "%s: getsockname: %s", __func__, mg_strerror(ERRNO));
+          //conn->client.lsa.len = 0;
+        }
+        conn->request_info.local_port = get_socket_port(&conn->client.lsa);
+        get_socket_ip_address(&conn->request_info.local_ip, &conn->client.lsa);
       }
-      conn->request_info.local_port = get_socket_port(&conn->client.lsa);
-      get_socket_ip_address(&conn->request_info.local_ip, &conn->client.lsa);
 
-      if (!conn->client.is_ssl ||
-        (conn->client.is_ssl && sslize(conn, conn->ctx->ssl_ctx, SSL_accept))) {
+      // The TLS handshake takes several round trips: run it one non-blocking
+      // step at a time and let the idle queue wait for the client's next
+      // flight (and, eventually, its request), so that slow or malicious
+      // clients cannot tie up the workers.
+      handshake = (conn->client.is_ssl ? ssl_accept_step(conn) : 1);
+      if (handshake > 0) {
         //reset_per_request_attributes(conn); // otherwise the callback will receive arbitrary (garbage) data
         doing_fine = 1;
         conn->is_inited = 1;
         call_user(conn, MG_INIT_CLIENT_CONN);
+        awaiting_data = conn->client.is_ssl && !conn->client.has_read_data;
+      } else if (handshake == 0) {
+        doing_fine = 1;
+        awaiting_data = 1;
       } else {
         mg_cry(conn, "%s: socket %d failed to initialize completely: %s", __func__, (int)conn->client.sock, mg_strerror(ERRNO));
       }
@@ -8831,7 +13023,7 @@ static void * WINCDECL worker_thread(struct mg_context *ctx) {
       DEBUG_TRACE(0x0003, ("closing expired connection socket %d", (int)conn->client.sock));
     }
 
-    if (doing_fine) {
+    if (doing_fine && !awaiting_data) {
       doing_fine = !process_new_connection(conn);
     }
 
@@ -8840,6 +13032,7 @@ static void * WINCDECL worker_thread(struct mg_context *ctx) {
       //reset_per_request_attributes(conn); // otherwise the callback will receive arbitrary (garbage) data
       call_user(conn, MG_EXIT_CLIENT_CONN);
       close_connection(conn);
+      release_connection_config(conn);
       // Clear everything in conn to ensure no value makes it into the next connection/session.
       // (Also clears the cached logfile path so it is recalculated on the next log operation.)
       memset(conn, 0, sizeof(*conn));
@@ -8848,6 +13041,8 @@ static void * WINCDECL worker_thread(struct mg_context *ctx) {
       // The simplest way is to push the current connection onto the queue, and then
       // let consume_socket() [and its internal select() logic] cope with it.
       DEBUG_TRACE(0x0022, ("pushing MAYBE-IDLE connection back onto the queue"));
+      release_header_buffer(conn);
+      release_connection_config(conn);
       if (!produce_socket(ctx, conn)) {
         char src_addr[SOCKADDR_NTOA_BUFSIZE];
         mg_cry(conn, "%s: closing active connection %s because server is shutting down",
@@ -8857,6 +13052,10 @@ static void * WINCDECL worker_thread(struct mg_context *ctx) {
         close_connection(conn);
         break;
       }
+      // the queue owns the socket now: another worker may pick it up (and
+      // close it) before we get to see it again.
+      conn->client.sock = INVALID_SOCKET;
+      conn->ssl = NULL;
     }
   }
   // close the kept-alive connection when a failure occurred, e.g. server stop pending:
@@ -8868,6 +13067,9 @@ static void * WINCDECL worker_thread(struct mg_context *ctx) {
     call_user(conn, MG_EXIT_CLIENT_CONN);
     close_connection(conn);
   }
+  release_io_job(conn);
+  release_tx_compressor(conn);
+  release_connection_config(conn);
   free(conn);
   conn = NULL;
 
@@ -8905,22 +13107,32 @@ static int accept_new_connection(const struct socket *listener,
                                   struct mg_context *ctx) {
   struct socket accepted = {0};  // NIL all connection parameters to prevent surprises in user code accessing any of these.
   char src_addr[SOCKADDR_NTOA_BUFSIZE];
+  struct mg_config *cfg;
+  const char *acl_list;
   int allowed;
 
   accepted.rsa.len = listener->lsa.len; // making sure both peers use the same IPvX records, otherwise accept() will b0rk
   accepted.lsa = listener->lsa;
   accepted.sock = accept(listener->sock, &accepted.rsa.u.sa, &accepted.rsa.len);
   if (accepted.sock != INVALID_SOCKET) {
-    int keep_alive_timeout = atoi(get_option(ctx, KEEP_ALIVE_TIMEOUT));
+    int keep_alive_timeout;
 
+    cfg = acquire_config(ctx);
+    keep_alive_timeout = get_cfg_int_option(ctx, cfg, KEEP_ALIVE_TIMEOUT);
     if (set_timeout(&accepted, keep_alive_timeout)) {
+      release_config(ctx, cfg);
       mg_cry(fc(ctx), "%s: %s failed to set the socket timeout",
              __func__, sockaddr_to_string(src_addr, sizeof(src_addr), &accepted.rsa));
       (void) closesocket(accepted.sock);
       return 0; // this is NOT a GRAVE error; this is not cause enough to go and unbind/rebind the listeners!
     }
 
-    allowed = check_acl(ctx, &accepted.rsa);
+    acl_list = get_cfg_option(ctx, cfg, ACCESS_CONTROL_LIST);
+    if (is_config_option_value(cfg, ACCESS_CONTROL_LIST, acl_list))
+      allowed = match_acl(cfg->acl, &accepted.rsa);
+    else
+      allowed = check_acl(ctx, acl_list, &accepted.rsa);
+    release_config(ctx, cfg);
     if (allowed) {
       struct mg_connection dummy_conn = {0};
 
@@ -9009,6 +13221,8 @@ static void * WINCDECL master_thread(struct mg_context *ctx) {
     } else if (n == 0) {
       // timeout
       call_user_over_ctx(ctx, 0, MG_IDLE_MASTER);
+      if (ctx->retired_cfgs != NULL)
+        collect_retired_configs(ctx);
     } else {
       for (sp = ctx->listening_sockets; sp != NULL; sp = sp->next) {
         if (ctx->stop_flag == 0 && FD_ISSET(sp->sock, &read_set)) {
@@ -9040,6 +13254,11 @@ static void * WINCDECL master_thread(struct mg_context *ctx) {
   // Stop signal received: somebody called mg_stop. Quit.
   close_all_listening_sockets(ctx);
 
+  // Wakeup the disk I/O threads so they notice the stop signal.
+  (void) pthread_mutex_lock(&ctx->io_mutex);
+  pthread_cond_broadcast(&ctx->io_queued);
+  (void) pthread_mutex_unlock(&ctx->io_mutex);
+
   (void) pthread_mutex_lock(&ctx->mutex);
   // Wakeup workers that are waiting for connections to handle.
   pthread_cond_broadcast(&ctx->sq_full);
@@ -9058,6 +13277,8 @@ static void * WINCDECL master_thread(struct mg_context *ctx) {
     ctx->sq_head = pop_node_from_idle_queue(ctx, ctx->sq_head, &dummy_conn);
     DEBUG_TRACE(0x0023, ("grabbed socket %d, forcibly closing the bugger", (int)dummy_conn.client.sock));
     close_socket_UNgracefully(dummy_conn.client.sock);
+    if (dummy_conn.ssl != NULL)
+      SSL_free(dummy_conn.ssl);
   }
 
   // Account for ourselves (master) being done and exiting
@@ -9071,6 +13292,9 @@ static void * WINCDECL master_thread(struct mg_context *ctx) {
   (void) pthread_cond_destroy(&ctx->cond);
   (void) pthread_cond_destroy(&ctx->sq_empty);
   (void) pthread_cond_destroy(&ctx->sq_full);
+  (void) pthread_mutex_destroy(&ctx->io_mutex);
+  (void) pthread_cond_destroy(&ctx->io_queued);
+  (void) pthread_cond_destroy(&ctx->io_done);
 
 #if !defined(NO_SSL)
   uninitialize_ssl(ctx);
@@ -9094,13 +13318,21 @@ static void * WINCDECL master_thread(struct mg_context *ctx) {
 }
 
 static void free_context(struct mg_context *ctx) {
-  int i;
-
-  // Deallocate config parameters
-  for (i = 0; i < NUM_OPTIONS; i++) {
-    if (ctx->config[i] != NULL)
-      free(ctx->config[i]);
-  }
+  struct mg_config *cfg;
+
+  // Deallocate config parameters: no thread is left to reference any snapshot
+  drop_vhost_configs(ctx, NULL);
+  free_config(ctx->cfg);
+  while ((cfg = ctx->retired_cfgs) != NULL) {
+    ctx->retired_cfgs = cfg->next_retired;
+    free_config(cfg);
+  }
+  (void) pthread_mutex_destroy(&ctx->cfg_mutex);
+  (void) pthread_mutex_destroy(&ctx->reload_mutex);
+  free_passwords_files(ctx);
+  (void) pthread_mutex_destroy(&ctx->passwords_mutex);
+  (void) pthread_mutex_destroy(&ctx->nonce_mutex);
+  (void) pthread_mutex_destroy(&ctx->ticket_mutex);
 
   // Deallocate SSL context
   if (ctx->ssl_ctx != NULL) {
@@ -9173,6 +13405,15 @@ struct mg_context *mg_start(const struct mg_user_class_t *user_functions,
   // Allocate context and initialize reasonable general case defaults.
   ctx = (struct mg_context *) calloc(1, sizeof(*ctx));
   if (!ctx) return NULL;
+  (void) pthread_mutex_init(&ctx->cfg_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->reload_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->passwords_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->nonce_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->ticket_mutex, NULL);
+  if ((ctx->cfg = copy_config(NULL)) == NULL) {
+    free_context(ctx);
+    return NULL;
+  }
 
   // init queue (free list)
   ctx->sq_head = -1;
@@ -9202,35 +13443,23 @@ struct mg_context *mg_start(const struct mg_user_class_t *user_functions,
       free_context(ctx);
       return NULL;
     }
-    if (ctx->config[i] != NULL) {
+    if (ctx->cfg->config[i] != NULL) {
       mg_cry(fc(ctx), "%s: duplicate option", name);
     }
-    MG_ASSERT(i < (int)ARRAY_SIZE(ctx->config));
+    MG_ASSERT(i < (int)ARRAY_SIZE(ctx->cfg->config));
     MG_ASSERT(i >= 0);
-    ctx->config[i] = mg_strdup(value);
-    // at least on Windows, replace single quotes around CGI binary path
-    // by double quotes or your CGI won't ever run.
-    // And you can't easily put double quotes around it from the command line,
-    // so kludge it is.
-    if (i == CGI_INTERPRETER && value[0] == '\'') {
-      char *qp = ctx->config[i];
-      *qp++ = '"';
-      qp = strchr(qp, '\'');
-      if (!qp) {
-        mg_cry(fc(ctx), "Invalid option value (improper quoting): %s=%s", name, value);
-        free_context(ctx);
-        return NULL;
-      }
-      *qp = '"';
+    if (!set_config_value(ctx, ctx->cfg, i, value)) {
+      free_context(ctx);
+      return NULL;
     }
-    DEBUG_TRACE(0x1000, ("[%s] -> [%s]", name, ctx->config[i]));
+    DEBUG_TRACE(0x1000, ("[%s] -> [%s]", name, ctx->cfg->config[i]));
   }
 
   // Set default value if needed
   for (i = 0; config_options[i * MG_ENTRIES_PER_CONFIG_OPTION] != NULL; i++) {
     default_value = config_options[i * MG_ENTRIES_PER_CONFIG_OPTION + 2];
-    if (ctx->config[i] == NULL && default_value != NULL) {
-      ctx->config[i] = mg_strdup(default_value);
+    if (ctx->cfg->config[i] == NULL && default_value != NULL) {
+      ctx->cfg->config[i] = mg_strdup(default_value);
       DEBUG_TRACE(0x1000,
                   ("Setting default: [%s] -> [%s]",
                    config_options[i * MG_ENTRIES_PER_CONFIG_OPTION + 1],
@@ -9246,13 +13475,19 @@ struct mg_context *mg_start(const struct mg_user_class_t *user_functions,
   // be initialized before listening ports. UID must be set last.
   if (!set_gpass_option(ctx) ||
 #if !defined(NO_SSL)
-      (ctx->config[SSL_CERTIFICATE] != NULL && !set_ssl_option(ctx)) ||
+      (ctx->cfg->config[SSL_CERTIFICATE] != NULL && !set_ssl_option(ctx)) ||
 #endif
       !set_ports_option(ctx) ||
 #if !defined(_WIN32)
       !set_uid_option(ctx) ||
 #endif
-      !set_acl_option(ctx)) {
+      !set_acl_option(ctx, ctx->cfg) ||
+      !set_mime_option(ctx, ctx->cfg) ||
+      !set_rewrite_option(ctx, ctx->cfg) ||
+      !set_protect_option(ctx, ctx->cfg) ||
+      !set_typed_options(ctx, ctx->cfg) ||
+      !set_pattern_options(ctx, ctx->cfg) ||
+      !set_header_buffer_option(ctx)) {
     free_context(ctx);
     return NULL;
   }
@@ -9269,6 +13504,10 @@ struct mg_context *mg_start(const struct mg_user_class_t *user_functions,
   (void) pthread_cond_init(&ctx->cond, NULL);
   (void) pthread_cond_init(&ctx->sq_empty, NULL);
   (void) pthread_cond_init(&ctx->sq_full, NULL);
+  (void) pthread_mutex_init(&ctx->io_mutex, NULL);
+  (void) pthread_cond_init(&ctx->io_queued, NULL);
+  (void) pthread_cond_init(&ctx->io_done, NULL);
+  ctx->io_timeout = atoi(get_option(ctx, DISK_IO_TIMEOUT));
 
   call_user_over_ctx(ctx, ctx->ssl_ctx, MG_INIT0);
 
@@ -9288,6 +13527,15 @@ struct mg_context *mg_start(const struct mg_user_class_t *user_functions,
     }
   }
 
+  // Start disk I/O threads, if any: workers make the filesystem calls themselves when there are none.
+  for (i = atoi(get_option(ctx, DISK_IO_THREADS)); i > 0; i--) {
+    if (mg_start_thread(ctx, (mg_thread_func_t) io_thread, ctx) != 0) {
+      mg_cry(fc(ctx), "Cannot start disk I/O thread: %d (%s)", ERRNO, mg_strerror(ERRNO));
+    } else {
+      ctx->num_io_threads++;
+    }
+  }
+
   return ctx;
 }
 
@@ -9462,6 +13710,12 @@ int64_t mg_get_tx_remaining_chunk_size(struct mg_connection *conn) {
 }
 
 int mg_set_tx_next_chunk_size(struct mg_connection *conn, int64_t chunk_size) {
+#if defined(USE_ZLIB)
+  // the chunks of a compressed response carry deflate() output, whose size
+  // the caller cannot predict: ignore any explicit chunk size then.
+  if (conn && conn->tx_compressor != NULL && conn->tx_compressor->state != 0)
+    return 0;
+#endif
   if (conn && conn->tx_is_in_chunked_mode && chunk_size >= 0) {
     // chunk_size == 0 POSSIBLY marks the end of chunked transmission:
     // out of mg_write()), mg_flush() and mg_close(), the first one called
@@ -9488,6 +13742,11 @@ int mg_set_tx_next_chunk_size(struct mg_connection *conn, int64_t chunk_size) {
 
 int mg_flush(struct mg_connection *conn) {
   if (conn) {
+#if defined(USE_ZLIB)
+    // a compressed response ends with the gzip trailer:
+    if (finish_tx_compression(conn) < 0)
+      return -1;
+#endif
     // nothing to do unless we're in TX chunked mode
     // and chunk_size == 0 while the chunk header hasn't been
     // sent yet. This marks the end of a chunked transmission.
@@ -163,6 +163,10 @@ typedef void * (*mg_callback_t)(enum mg_event event,
 //   anything else - fail the authorization, send a 5xx response code
 //
 // Notes:
+//   For return values 1 and 3 Mongoose also checks that the nonce is one it
+//   handed out recently and that its nonce count ('nc') has not been used before;
+//   otherwise the client is asked to retry with a fresh nonce (stale=true).
+//
 //   You can access the user data through the mg_get_user_data() and mg_get_context()
 //   API functions.
 typedef int (*mg_password_callback_t)(struct mg_connection *conn,
@@ -413,8 +417,9 @@ void mg_stop(struct mg_context *);
 
 
 // Get the value of particular configuration parameter.
-// The value returned is read-only. Mongoose does not allow changing
-// configuration at run time.
+// The value returned is read-only. It remains valid until the configuration
+// is replaced by mg_reload_options(), plus MG_CONFIG_RETIRE_GRACE seconds
+// (30 by default); copy it when you need it for longer than that.
 // If given parameter name is not valid, NULL is returned. For valid
 // names, return value is guaranteed to be non-NULL. If parameter is not
 // set, zero-length string is returned.
@@ -430,6 +435,46 @@ const char *mg_get_option(struct mg_context *ctx, const char *name);
 const char *mg_get_conn_option(struct mg_connection *conn, const char *name);
 
 
+// Change configuration parameters of a running server.
+//
+// 'options' is a NULL terminated list of option_name, option_value pairs,
+// like the one passed to mg_start(); the options not listed keep their value.
+// A new configuration is built and validated, then swapped in as a whole:
+// requests which are in flight keep seeing the configuration they started
+// with, while subsequent requests see the new one.
+//
+// The listening_ports, num_threads, ssl_certificate, ssl_session_*,
+// ssl_ticket_key_lifetime, run_as_user and the buffer size options are only
+// used by mg_start(); changing those here has no effect on the running server.
+//
+// Return 0 on success, -1 when an option is invalid, in which case the
+// configuration is left unchanged.
+int mg_reload_options(struct mg_context *ctx, const char **options);
+
+
+// Drop the cached per-virtual-host configurations (see the vhost_config_cache
+// option) for the given Host header value, or all of them when 'host' is NULL.
+// Call this when the values your user_option_get callback produces for that
+// host change. Requests in flight keep the configuration they started with.
+void mg_invalidate_vhost_configs(struct mg_context *ctx, const char *host);
+
+
+// TLS session resumption counters of the server SSL context; see the
+// ssl_session_cache_size and ssl_session_tickets options.
+struct mg_ssl_session_stats {
+  long handshakes;   // Completed server handshakes, full or resumed
+  long hits;         // Handshakes which resumed a session, from the cache or a ticket
+  long misses;       // Session IDs offered by clients but not found in the cache
+  long timeouts;     // Sessions offered by clients after they had expired
+  long cache_full;   // Sessions evicted because the cache was full
+  long cached;       // Sessions currently in the cache
+};
+
+// Fill 'stats' with the current counters. Return 0 on success, -1 when the
+// server has no SSL context (no ssl_certificate, or built with NO_SSL).
+int mg_get_ssl_session_stats(struct mg_context *ctx, struct mg_ssl_session_stats *stats);
+
+
 // Return array of strings that represent all mongoose configuration options.
 // For each option, a short name, long name, and default value is returned
 // (i.e. a total of MG_ENTRIES_PER_CONFIG_OPTION elements per entry).
@@ -821,6 +866,110 @@ int mg_extract_raw_http_header(char **buf, char **token_ref, char **value_ref);
 int mg_get_var(const char *data, size_t data_len, const char *var_name,
                char *buf, size_t buf_len, int is_form_url_encoded);
 
+// A variable in a form-url-encoded buffer. Both name and value point into
+// the parsed buffer and are neither decoded nor NUL-terminated.
+struct mg_form_var {
+  const char *name;              // raw variable name
+  size_t name_len;
+  const char *value;             // raw value
+  size_t value_len;
+  int next;                      // index of the next variable in the same hash chain, or -1
+};
+
+// Index of the variables in a query string or POST body; see mg_parse_form_vars().
+// It holds no allocated memory: use it as a local variable in your handler.
+struct mg_form_vars {
+  int is_form_url_encoded;       // as passed to mg_parse_form_vars()
+  int num_vars;                  // number of indexed variables
+  int bucket[32];                // first variable per name hash, or -1
+  struct mg_form_var vars[64];   // Maximum 64 variables
+};
+
+// Parse a form-url-encoded buffer (see mg_get_var()) once, so that any
+// number of variables can then be fetched without rescanning it.
+// The buffer must remain valid and unmodified while the index is in use.
+//
+// Return the number of variables in the buffer. When this exceeds
+// ARRAY_SIZE(vars->vars), only the first ones have been indexed.
+// Like mg_get_var(), a name without '=' does not count as a variable.
+int mg_parse_form_vars(struct mg_form_vars *vars, const char *data, size_t data_len,
+                       int is_form_url_encoded);
+
+// Find the next variable called 'var_name' (case-insensitive, like
+// mg_get_var()) following the one at index 'prev'; pass prev = -1 to find
+// the first one. Repeated variables are found in the order of the buffer.
+//
+// Return the index of the variable in vars->vars[], or -1 if not found.
+int mg_find_form_var(const struct mg_form_vars *vars, const char *var_name, int prev);
+
+// Decode the value of the variable at the given index into the destination
+// buffer. Return the same as mg_get_var(); -1 for an invalid index too.
+int mg_decode_form_var(const struct mg_form_vars *vars, int index,
+                       char *buf, size_t buf_len);
+
+
+// Streaming multipart/form-data (RFC 2388, RFC 2046) parser for uploads.
+//
+// The body is fed in slices of any size, e.g. as returned by mg_read() or
+// as handed to the write_callback; the body never needs to be held in
+// memory as a whole. The parser reports each part to the callback:
+//
+//   MG_MULTIPART_PART_BEGIN: the headers of a new part have been parsed;
+//                            see mg_get_multipart_header() and
+//                            mg_get_multipart_names().
+//   MG_MULTIPART_PART_DATA:  'data' and 'len' point at the next slice of
+//                            the body of the current part.
+//   MG_MULTIPART_PART_END:   the current part is complete.
+//
+// The callback must return 0 to continue; any other value aborts parsing.
+struct mg_multipart;             // Handle for a multipart parser
+
+enum mg_multipart_event {
+  MG_MULTIPART_PART_BEGIN,
+  MG_MULTIPART_PART_DATA,
+  MG_MULTIPART_PART_END
+};
+
+typedef int (*mg_multipart_callback_t)(struct mg_multipart *mp, enum mg_multipart_event event,
+                                       const char *data, size_t len);
+
+// Create a parser for a body with the given Content-Type header value,
+// which must carry the boundary parameter.
+//
+// Return NULL when the Content-Type is not multipart, has no valid
+// boundary, or when out of memory.
+struct mg_multipart *mg_create_multipart_parser(const char *content_type,
+                                                mg_multipart_callback_t callback,
+                                                void *user_data);
+
+// Destroy a parser created by mg_create_multipart_parser().
+void mg_destroy_multipart_parser(struct mg_multipart *mp);
+
+// Feed the next slice of the body to the parser.
+//
+// Return 0 when more data is expected, 1 when the closing boundary has been
+// seen (any data beyond it is ignored), or -1 on a malformed body or when
+// the callback aborted the parse.
+int mg_feed_multipart_parser(struct mg_multipart *mp, const char *data, size_t len);
+
+// Return the user_data pointer passed to mg_create_multipart_parser().
+void *mg_get_multipart_user_data(const struct mg_multipart *mp);
+
+// Return the value of a header of the current part, or NULL if not found.
+const char *mg_get_multipart_header(const struct mg_multipart *mp, const char *name);
+
+// Obtain the unquoted name and filename parameters of the Content-Disposition
+// header of the current part. Either is set to NULL when not available.
+void mg_get_multipart_names(const struct mg_multipart *mp, const char **name,
+                            const char **filename);
+
+// Read the request body with mg_read() and feed it to a multipart parser
+// in a single call.
+//
+// Return 0 when the complete multipart body has been parsed, -1 otherwise.
+int mg_read_multipart(struct mg_connection *conn, mg_multipart_callback_t callback,
+                      void *user_data);
+
 // Fetch value of certain cookie variable into the destination buffer.
 //
 // Destination buffer is guaranteed to be '\0' - terminated. In case of
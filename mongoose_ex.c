@@ -242,7 +242,7 @@ void mg_vlog(struct mg_connection *conn, const char *severity, const char *fmt,
 
 void mg_get_mime_type(struct mg_context *ctx, const char *path, const char *default_mime_type, struct mg_mime_vec *vec) {
 	struct vec rv;
-	get_mime_type(ctx, path, default_mime_type, &rv);
+	get_mime_type(ctx, NULL, path, default_mime_type, &rv);
 	vec->ptr = rv.ptr;
 	vec->len = rv.len;
 }
@@ -291,13 +291,15 @@ int mg_get_headers(const char **dst, int dst_buffersize, const struct mg_connect
     int i;
     int cnt = 0;
     const struct mg_request_info *ri = &conn->request_info;
+    const struct mg_header_index *idx = get_header_index(conn);
 
     set_header_ptr(dst, dst_buffersize, 0, NULL);
-    for (i = 0; i < ri->num_headers; i++)
+    // the hash chain lists the candidates in request order:
+    for (i = idx->bucket[header_name_hash(name)]; i; i = idx->next[i - 1])
     {
-        if (!mg_strcasecmp(name, ri->http_headers[i].name))
+        if (!mg_strcasecmp(name, ri->http_headers[i - 1].name))
         {
-            set_header_ptr(dst, dst_buffersize, cnt++, ri->http_headers[i].value);
+            set_header_ptr(dst, dst_buffersize, cnt++, ri->http_headers[i - 1].value);
         }
     }
     set_header_ptr(dst, dst_buffersize, cnt, NULL);
@@ -394,18 +396,28 @@ int mg_socketpair(struct mg_connection *conns[2], struct mg_context *ctx)
 
 const char *mg_set_option(struct mg_context *ctx, const char *name, const char *value) {
 	// ignore `call_user_option_get(ctx, name)` and friends: brutal hack
+	const char *options[3];
+	const char *rv = NULL;
+	struct mg_config *cfg;
 	int i = get_option_index(name);
 	if (i == -1) {
 		return NULL;
 	}
-	else if (ctx == NULL) {
+	else if (ctx == NULL || ctx->cfg == NULL) {
 		return NULL;
 	}
 	else {
-		if (ctx->config[i]) {
-			free(ctx->config[i]);
+		options[0] = name;
+		options[1] = value;
+		options[2] = NULL;
+		// take the value from the snapshot we published, not from whatever
+		// a concurrent reload made current since:
+		(void) pthread_mutex_lock(&ctx->reload_mutex);
+		if ((cfg = reload_config(ctx, options)) != NULL) {
+			rv = config_value(cfg, i);
 		}
-		return ctx->config[i] = mg_strdup(value);
+		(void) pthread_mutex_unlock(&ctx->reload_mutex);
+		return rv;
 	}
 }
 
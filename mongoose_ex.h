@@ -104,6 +104,10 @@ void mg_vlog(struct mg_connection *conn, const char *severity, const char *fmt,
 
 int mg_get_lasterror(void);
 
+// Change a single option of a running server; see mg_reload_options().
+// Return the new option value, or NULL when the name or the value is invalid.
+// Like the mg_get_option() value, it stays valid for MG_CONFIG_RETIRE_GRACE
+// seconds after the configuration is replaced again.
 const char *mg_set_option(struct mg_context *ctx, const char *name, const char *value);
 
 
@@ -29,6 +29,7 @@
 #else
 #ifdef __linux__
 #define _XOPEN_SOURCE 600       // For PATH_MAX and flockfile() on Linux
+#define _GNU_SOURCE             // For splice() and fallocate() on Linux
 #else
 #define _XOPEN_SOURCE           // BSD
 #endif
@@ -661,6 +662,21 @@ typedef int SOCKET;
 
 #endif // End of Windows and UNIX specific includes
 
+#if defined(USE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if !defined(NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MG_HAVE_AVX2  1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MG_HAVE_SSE2  1
+#endif
+#endif
+
 #ifndef FORMAT_STRING
 # define FORMAT_STRING(p) p
 #endif
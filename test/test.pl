@@ -4,6 +4,8 @@
 
 use IO::Socket;
 use File::Path;
+use Time::HiRes qw(gettimeofday tv_interval);
+use Digest::MD5 qw(md5_hex);
 use strict;
 use warnings;
 #use diagnostics;
@@ -57,9 +59,13 @@ sub req {
     PeerAddr=>'127.0.0.1', PeerPort=>$port);
   fail("Cannot connect: $!") unless $sock;
   $sock->autoflush(1);
-  foreach my $byte (split //, $request) {
-    last unless print $sock $byte;
-    select undef, undef, undef, .001 if length($request) < 256;
+  if (length($request) < 256) {
+    foreach my $byte (split //, $request) {
+      last unless print $sock $byte;
+      select undef, undef, undef, .001;
+    }
+  } else {
+    print $sock $request;
   }
   my ($out, $buf) = ('', '');
   eval {
@@ -96,6 +102,19 @@ sub o {
   }
 }
 
+# Fetch a fresh nonce with the unauthenticated 'request', which must be
+# answered with a 401, and return a Digest Authorization header value for it.
+# The 'user' is put in the header as is, so quote it when needed.
+sub digest_auth {
+  my ($request, $user, $realm, $ha1, $method, $uri) = @_;
+  my $reply = req($request);
+  $reply =~ /nonce="([^"]+)"/ or fail("No nonce in reply: [$reply]");
+  my ($nonce, $nc, $cnonce) = ($1, '00000001', '1a49b53a47a66e82');
+  my $response = md5_hex("$ha1:$nonce:$nc:$cnonce:auth:" . md5_hex("$method:$uri"));
+  return "Digest username=$user, realm=\"$realm\", nonce=\"$nonce\", " .
+    "uri=\"$uri\", response=\"$response\", qop=auth, nc=$nc, cnonce=\"$cnonce\"";
+}
+
 # Spawn a server listening on specified port
 sub spawn {
   my ($cmdline) = @_;
@@ -163,6 +182,11 @@ if (scalar(@ARGV) > 0 and $ARGV[0] eq 'unit') {
   exit 0;
 }
 
+if (scalar(@ARGV) > 0 and $ARGV[0] eq 'benchmark') {
+  do_PUT_benchmark();
+  exit 0;
+}
+
 # Make sure we load config file if no options are given.
 # Command line options override config files settings
 write_file($config, "access_log_file access.log\nlistening_ports 12345\ndocument_root ./");
@@ -182,6 +206,7 @@ my $cmd = "$exe ".
   '-access_control_list -0.0.0.0/0,+127.0.0.1 ' .
   "-document_root $root ".
   "-hide_files_patterns **exploit.pl ".
+  "-precompressed_pattern **.js\$ ".
   "-enable_keep_alive yes ".
   "-url_rewrite_patterns /aiased=/etc/,/ta=$test_dir";
 $cmd .= ' -cgi_interpreter perl' if on_windows();
@@ -222,6 +247,24 @@ print "==> Slow CGI output ... ";
 write_file("$root/a+.txt", '');
 o("GET /a+.txt HTTP/1.0\n\n", 'HTTP/1.0 200 OK', 'URL-decoding, + in URI');
 
+# Precompressed siblings are picked by Accept-Encoding; the MIME type
+# still comes from the original file name
+write_file("$root/precomp.js", 'var a = 1;');
+write_file("$root/precomp.js.gz", 'GZ');
+o("GET /precomp.js HTTP/1.0\nAccept-Encoding: deflate, gzip\n\n",
+  'Content-Type: application/x-javascript.+Content-Encoding: gzip.+' .
+  'Vary: Accept-Encoding.+Content-Length: 2\s.+GZ$', 'Precompressed .gz');
+o("GET /precomp.js HTTP/1.0\nAccept-Encoding: gzip;q=0\n\n",
+  'Vary: Accept-Encoding.+var a = 1;$', 'Precompressed, gzip refused');
+# the compressed variant has an Etag of its own
+my @precomp_st = stat("$root/precomp.js");
+my $precomp_etag = sprintf('"%x.%d', $precomp_st[9], $precomp_st[7]);
+o("GET /precomp.js HTTP/1.0\nAccept-Encoding: gzip\nIf-None-Match: $precomp_etag-gzip\"\n\n",
+  '304 Not Modified.+Vary: Accept-Encoding', 'Precompressed, revalidated');
+o("GET /precomp.js HTTP/1.0\nAccept-Encoding: gzip\nIf-None-Match: $precomp_etag\"\n\n",
+  '200 OK.+Content-Encoding: gzip', 'Precompressed, identity Etag');
+unlink "$root/precomp.js", "$root/precomp.js.gz";
+
 # Test HTTP version parsing
 o("GET / HTTPX/1.0\r\n\r\n", '400 Bad Request', 'Bad HTTP Version', 0);
 o("GET / HTTP/x.1\r\n\r\n", '505 HTTP', 'Bad HTTP maj Version');
@@ -346,16 +389,25 @@ unless (scalar(@ARGV) > 0 and $ARGV[0] eq "basic_tests") {
   # Test various funky things in an authentication header.
   o("GET /hello.txt HTTP/1.0\nAuthorization: Digest   eq== empty=\"\", empty2=, quoted=\"blah foo bar, baz\\\"\\\" more\\\"\", unterminatedquoted=\" doesn't stop\n\n",
     '401 Unauthorized', 'weird auth values should not cause crashes');
-  my $auth_header = "Digest username=\"user with space, \\\" and comma\", ".
-    "realm=\"mydomain.com\", nonce=\"1291376417\", uri=\"/\",".
-    "response=\"e8dec0c2a1a0c8a7e9a97b4b5ea6a6e6\", qop=auth, nc=00000001, cnonce=\"1a49b53a47a66e82\"";
+  # every nonce handed out by the server is good for a single request (nc=1)
+  my $auth = sub {
+    digest_auth("GET / HTTP/1.0\n\n", '"user with space, \\" and comma"',
+                'mydomain.com', '5deda12442309cbdcdffc6b2737a894f', 'GET', '/');
+  };
+  my $auth_header = $auth->();
   o("GET /hello.txt HTTP/1.0\nAuthorization: $auth_header\n\n", 'HTTP/1.1 200 OK', 'GET regular file with auth');
+  o("GET /hello.txt HTTP/1.0\nAuthorization: $auth_header\n\n", 'HTTP/1.1 401 Unauthorized.+stale=true',
+    'replayed auth is rejected as stale');
+  $auth_header = $auth->();
   o("GET / HTTP/1.0\nAuthorization: $auth_header\n\n", '^(.(?!(.htpasswd)))*$',
     '.htpasswd is hidden from the directory list');
+  $auth_header = $auth->();
   o("GET / HTTP/1.0\nAuthorization: $auth_header\n\n", '^(.(?!(exploit.pl)))*$',
     'hidden file is hidden from the directory list');
+  $auth_header = $auth->();
   o("GET /.htpasswd HTTP/1.0\nAuthorization: $auth_header\n\n",
     '^HTTP/1.1 404 ', '.htpasswd must not be shown');
+  $auth_header = $auth->();
   o("GET /exploit.pl HTTP/1.0\nAuthorization: $auth_header\n\n",
     '^HTTP/1.1 404', 'hidden files must not be shown');
   unlink "$root/.htpasswd";
@@ -434,29 +486,61 @@ unless (scalar(@ARGV) > 0 and $ARGV[0] eq "basic_tests") {
 }
 
 sub do_PUT_test {
-  # This only works because mongoose currently doesn't look at the nonce.
-  # It should really be rejected...
-  my $auth_header = "Authorization: Digest  username=guest, ".
-  "realm=mydomain.com, nonce=1145872809, uri=/put.txt, ".
-  "response=896327350763836180c61d87578037d9, qop=auth, ".
-  "nc=00000002, cnonce=53eddd3be4e26a98\n";
+  # every nonce handed out by the server is good for a single request (nc=1)
+  my $auth = sub {
+    "Authorization: " .
+      digest_auth("PUT /a/put.txt HTTP/1.0\nContent-Length: 0\n\n", 'guest',
+                  'mydomain.com', '485264dcc977a1925370b89d516a1477', 'PUT', '/put.txt') .
+      "\n";
+  };
+  my $auth_header = $auth->();
 
   o("PUT /a/put.txt HTTP/1.0\nContent-Length: 7\n$auth_header\n1234567",
     "HTTP/1.1 201 OK", 'PUT file, status 201');
   fail("PUT content mismatch")
   unless read_file("$root/a/put.txt") eq '1234567';
+  $auth_header = $auth->();
   o("PUT /a/put.txt HTTP/1.0\nContent-Length: 4\n$auth_header\nabcd",
     "HTTP/1.1 200 OK", 'PUT file, status 200');
   fail("PUT content mismatch")
   unless read_file("$root/a/put.txt") eq 'abcd';
+  $auth_header = $auth->();
   o("PUT /a/put.txt HTTP/1.0\n$auth_header\nabcd",
     "HTTP/1.1 411 Length Required", 'PUT 411 error');
+  $auth_header = $auth->();
   o("PUT /a/put.txt HTTP/1.0\nExpect: blah\nContent-Length: 1\n".
     "$auth_header\nabcd",
     "HTTP/1.1 417 Expectation Failed", 'PUT 417 error');
+  $auth_header = $auth->();
   o("PUT /a/put.txt HTTP/1.0\nExpect: 100-continue\nContent-Length: 4\n".
     "$auth_header\nabcd",
     "HTTP/1.1 100 Continue.+HTTP/1.1 200", 'PUT 100-Continue');
+
+  # A body much larger than the request buffer; on Linux this exercises
+  # the splice() path.
+  my $size = 1024 * 1024;
+  $auth_header = $auth->();
+  o("PUT /a/put.txt HTTP/1.0\nContent-Length: $size\n$auth_header\n" .
+    ('x' x $size), "HTTP/1.1 200 OK", 'PUT large file');
+  fail("PUT large file size mismatch") unless -s "$root/a/put.txt" == $size;
+}
+
+# Upload throughput of a 64 MB PUT; not part of the regular tests.
+sub do_PUT_benchmark {
+  my $size = 64 * 1024 * 1024;
+  spawn("$exe -listening_ports $port -document_root $root " .
+        '-access_log_file access.log -put_delete_passwords_file test/passfile');
+  my $auth_header = "Authorization: " .
+    digest_auth("PUT /a/put.txt HTTP/1.0\nContent-Length: 0\n\n", 'guest',
+                'mydomain.com', '485264dcc977a1925370b89d516a1477', 'PUT', '/put.txt') .
+    "\n";
+  my $t0 = [gettimeofday];
+  o("PUT /a/put.txt HTTP/1.0\nContent-Length: $size\n$auth_header\n" .
+    ('x' x $size), "^HTTP/1.[01] 20[01] ", 'PUT 64 MB');
+  my $elapsed = tv_interval($t0);
+  fail("PUT 64 MB size mismatch") unless -s "$root/a/put.txt" == $size;
+  printf("    %.1f MB/s\n", $size / 1048576 / ($elapsed || 1e-6));
+  kill_spawned_child();
 }
 
 sub do_unit_test {
@@ -30,10 +30,11 @@ static void fatal_exit(struct mg_context *ctx) {
 
 #define ASSERT_STREQ(str1, str2)                                            \
     do {                                                                    \
-      if (!(str1) || !(str2) || strcmp(str1, str2)) {                       \
+      const char *s1_ = (str1), *s2_ = (str2);                              \
+      if (!s1_ || !s2_ || strcmp(s1_, s2_)) {                               \
         printf("Fail on line %d: strings not matching: "                    \
                "inp:\"%s\" != ref:\"%s\"\n",                                \
-               __LINE__, str1, str2);                                       \
+               __LINE__, s1_, s2_);                                         \
         fatal_exit(ctx);                                                    \
       }                                                                     \
     } while (0)
@@ -73,6 +74,9 @@ static void test_parse_http_request() {
   char req6[] = "GET / HTTP/1.1\r\nA: foo bar\r\nB: bar\r\n";
   char req7[] = "GET / HTTP/1.1\r\nA: foo bar\r\nB: bar\r";
   char req8[] = "GET / HTTP/1.1\r\nA: foo bar\r\nB: bar";
+  char req9[] = "PROPFIND /a?b=1?c HTTP/1.0\r\nHost : x, y \r\nA: 1 \t 2\r\nEmpty:\r\nQ: \"a  b\"\r\n\r\n";
+  char req10[] = "PROPFINDX / HTTP/1.0\r\n\r\n";
+  char req11[] = "GET / HTTP/1.0\r\nA\"b: c\r\n\r\n";
   char *req5_8[4];
   int i;
 
@@ -110,6 +114,25 @@ static void test_parse_http_request() {
     ASSERT_STREQ(ri.query_string, "");
     ASSERT_STREQ(ri.request_method, "GET");
   }
+
+  // simple and RFC2616-normalized header values mixed:
+  ASSERT(parse_http_request(req9, &ri) == 0);
+  ASSERT_STREQ(ri.request_method, "PROPFIND");
+  ASSERT_STREQ(ri.uri, "/a");
+  ASSERT_STREQ(ri.query_string, "b=1?c");
+  ASSERT_STREQ(ri.http_version, "1.0");
+  ASSERT(ri.num_headers == 4);
+  ASSERT_STREQ(ri.http_headers[0].name, "Host");
+  ASSERT_STREQ(ri.http_headers[0].value, "x, y");
+  ASSERT_STREQ(ri.http_headers[1].name, "A");
+  ASSERT_STREQ(ri.http_headers[1].value, "1 2");
+  ASSERT_STREQ(ri.http_headers[2].name, "Empty");
+  ASSERT_STREQ(ri.http_headers[2].value, "");
+  ASSERT_STREQ(ri.http_headers[3].name, "Q");
+  ASSERT_STREQ(ri.http_headers[3].value, "\"a  b\"");
+
+  ASSERT(parse_http_request(req10, &ri) == -1);
+  ASSERT(parse_http_request(req11, &ri) == -1);
 }
 
 static void test_http_hdr_value_unquoting(void) {
@@ -775,6 +798,7 @@ static void test_http_header_extractor(void) {
 static void test_should_keep_alive(void) {
   struct mg_context ctx_fake = {0};
   struct mg_context *ctx = &ctx_fake;
+  struct mg_config cfg_fake = {0};
   struct mg_connection conn;
   char req1[] = "GET / HTTP/1.1\r\n\r\n";
   char req2[] = "GET / HTTP/1.0\r\n\r\n";
@@ -785,13 +809,14 @@ static void test_should_keep_alive(void) {
 
   memset(&conn, 0, sizeof(conn));
   conn.ctx = ctx;
+  ctx->cfg = &cfg_fake;
   ASSERT(parse_http_request(req1, &conn.request_info) == 0);
   conn.request_info.status_code = 200;
 
-  ctx->config[ENABLE_KEEP_ALIVE] = "no";
+  cfg_fake.config[ENABLE_KEEP_ALIVE] = "no";
   ASSERT(should_keep_alive(&conn) == 0);
 
-  ctx->config[ENABLE_KEEP_ALIVE] = "yes";
+  cfg_fake.config[ENABLE_KEEP_ALIVE] = "yes";
   ASSERT(should_keep_alive(&conn) == 1);
 
   conn.must_close = 1;
@@ -821,6 +846,589 @@ static void test_should_keep_alive(void) {
   ASSERT(should_keep_alive(&conn) == 0);
 }
 
+static void test_accept_encoding(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  ASSERT(accepts_content_coding("gzip", "gzip") == 1);
+  ASSERT(accepts_content_coding("deflate, gzip", "gzip") == 1);
+  ASSERT(accepts_content_coding("GZIP;q=0.5", "gzip") == 1);
+  ASSERT(accepts_content_coding("x-gzip, deflate", "gzip") == 0);
+  ASSERT(accepts_content_coding("gzip;q=0", "gzip") == 0);
+  ASSERT(accepts_content_coding("gzip ; q=0.000, br", "gzip") == 0);
+  ASSERT(accepts_content_coding("gzip ; q=0.000, br", "br") == 1);
+  ASSERT(accepts_content_coding("*", "br") == 1);
+  ASSERT(accepts_content_coding("*;q=0", "br") == 0);
+  ASSERT(accepts_content_coding("br;q=0, *", "br") == 0);
+  ASSERT(accepts_content_coding("identity", "gzip") == 0);
+  ASSERT(accepts_content_coding("", "gzip") == 0);
+}
+
+// one-shot header scan of a complete buffer
+static int request_len(const char *buf, int buflen) {
+  int scan_pos = 0;
+
+  return get_request_len(buf, buflen, &scan_pos);
+}
+
+static void test_request_len(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  char buf[300];
+  int i, len, pos, rv;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  ASSERT(request_len("GET / HTTP/1.0\n\n", 16) == 16);
+  ASSERT(request_len("GET / HTTP/1.0\r\n\r\nbody", 22) == 18);
+  ASSERT(request_len("GET / HTTP/1.0\r\n\r", 17) == 0);
+  ASSERT(request_len("GET / HTTP/1.0\r\nX: \x7f\r\n\r\n", 24) == -1);
+  ASSERT(request_len("GET / HTTP/1.0\r\nX: \xe9\r\n\r\n", 24) == 24);
+
+  // exercise the block scanners: terminator and bad bytes at every offset
+  for (i = 0; i < 260; i++) {
+    memset(buf, 'a', sizeof(buf));
+    memcpy(buf + i, "\r\n\r\n", 4);
+    ASSERT(request_len(buf, (int) sizeof(buf)) == i + 4);
+    ASSERT(request_len(buf, i + 3) == 0);
+    buf[i] = '\t';
+    ASSERT(request_len(buf, (int) sizeof(buf)) == -1);
+    buf[i] = '\r';
+    buf[i + 1] = '\r';
+    ASSERT(request_len(buf, (int) sizeof(buf)) == 0);
+  }
+
+  // feeding the same data in small pieces must produce the same result
+  memset(buf, 'b', sizeof(buf));
+  memcpy(buf + 200, "\n\r\n", 3);
+  for (i = 1; i < 40; i++) {
+    pos = 0;
+    rv = 0;
+    for (len = i; rv == 0 && len <= (int) sizeof(buf); len += i) {
+      rv = get_request_len(buf, len, &pos);
+      ASSERT(pos <= len);
+    }
+    ASSERT(rv == 203);
+  }
+}
+
+static void test_form_vars(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct mg_form_vars vars;
+  const char *qs = "a=1&B=x+y&&flag&a=%32&c=&a=3";
+  char buf[20];
+  int i, n;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  ASSERT(mg_parse_form_vars(&vars, qs, strlen(qs), 1) == 5);
+  ASSERT(vars.num_vars == 5);
+
+  // repeated variables are iterated in order; names match case-insensitively
+  i = mg_find_form_var(&vars, "A", -1);
+  ASSERT(i == 0);
+  ASSERT(mg_decode_form_var(&vars, i, buf, sizeof(buf)) == 1 && !strcmp(buf, "1"));
+  i = mg_find_form_var(&vars, "a", i);
+  ASSERT(i == 2);
+  ASSERT(mg_decode_form_var(&vars, i, buf, sizeof(buf)) == 1 && !strcmp(buf, "2"));
+  i = mg_find_form_var(&vars, "a", i);
+  ASSERT(i == 4);
+  ASSERT(mg_find_form_var(&vars, "a", i) == -1);
+
+  i = mg_find_form_var(&vars, "b", -1);
+  ASSERT(mg_decode_form_var(&vars, i, buf, sizeof(buf)) == 3 && !strcmp(buf, "x y"));
+  ASSERT(mg_decode_form_var(&vars, i, buf, 3) == -1);
+  ASSERT(mg_decode_form_var(&vars, i, NULL, 0) == -2);
+
+  i = mg_find_form_var(&vars, "c", -1);
+  ASSERT(i == 3);
+  ASSERT(mg_decode_form_var(&vars, i, buf, sizeof(buf)) == 0 && !strcmp(buf, ""));
+  ASSERT(mg_find_form_var(&vars, "flag", -1) == -1);
+  ASSERT(mg_find_form_var(&vars, "", -1) == -1);
+  ASSERT(mg_decode_form_var(&vars, 5, buf, sizeof(buf)) == -1);
+
+  // agrees with mg_get_var(), which doesn't find a variable without '=' either
+  ASSERT(mg_get_var(qs, strlen(qs), "b", buf, sizeof(buf), 1) == 3);
+  ASSERT(mg_get_var(qs, strlen(qs), "c", buf, sizeof(buf), 1) == 0);
+  ASSERT(mg_get_var(qs, strlen(qs), "flag", buf, sizeof(buf), 1) == -1);
+  ASSERT(mg_parse_form_vars(&vars, "a&b=1", (size_t)-1, 0) == 1);
+  ASSERT(mg_find_form_var(&vars, "a", -1) == -1);
+  ASSERT(mg_get_var("a&b=1", 5, "a", buf, sizeof(buf), 0) == -1);
+  i = mg_find_form_var(&vars, "b", -1);
+  ASSERT(i == 0);
+  ASSERT(mg_decode_form_var(&vars, i, buf, sizeof(buf)) == 1 && !strcmp(buf, "1"));
+  ASSERT(mg_get_var("a&b=1", 5, "b", buf, sizeof(buf), 0) == 1);
+
+  // overflowing the index still reports the total count
+  {
+    char many[600] = "";
+
+    for (n = 0; n < 70; n++)
+      mg_snprintf(NULL, many + strlen(many), sizeof(many) - strlen(many), "v%d=%d&", n, n);
+    ASSERT(mg_parse_form_vars(&vars, many, (size_t)-1, 0) == 70);
+    ASSERT(vars.num_vars == 64);
+    i = mg_find_form_var(&vars, "v63", -1);
+    ASSERT(i == 63);
+    ASSERT(mg_decode_form_var(&vars, i, buf, sizeof(buf)) == 2 && !strcmp(buf, "63"));
+    ASSERT(mg_find_form_var(&vars, "v64", -1) == -1);
+  }
+
+  ASSERT(mg_parse_form_vars(&vars, NULL, 0, 0) == 0);
+  ASSERT(mg_find_form_var(&vars, "a", -1) == -1);
+}
+
+struct multipart_log {
+  char buf[512];
+  size_t len;
+};
+
+static int multipart_logger(struct mg_multipart *mp, enum mg_multipart_event event,
+                            const char *data, size_t len) {
+  struct multipart_log *log = (struct multipart_log *) mg_get_multipart_user_data(mp);
+  const char *name, *filename;
+
+  switch (event) {
+  case MG_MULTIPART_PART_BEGIN:
+    mg_get_multipart_names(mp, &name, &filename);
+    log->len += mg_snprintf(NULL, log->buf + log->len, sizeof(log->buf) - log->len,
+                            "<%s|%s|%s>", name ? name : "-", filename ? filename : "-",
+                            mg_get_multipart_header(mp, "content-type") ?
+                            mg_get_multipart_header(mp, "content-type") : "-");
+    break;
+  case MG_MULTIPART_PART_DATA:
+    if (len > 0 && len < sizeof(log->buf) - log->len) {
+      memcpy(log->buf + log->len, data, len);
+      log->len += len;
+      log->buf[log->len] = 0;
+    }
+    break;
+  case MG_MULTIPART_PART_END:
+    log->len += mg_snprintf(NULL, log->buf + log->len, sizeof(log->buf) - log->len, "</>");
+    break;
+  }
+  return !strcmp(log->buf, "<abort|-|->");
+}
+
+static void test_multipart(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  static const char body[] =
+    "preamble\r\n"
+    "--AaB03x\r\n"
+    "Content-Disposition: form-data; name=\"field1\"\r\n"
+    "\r\n"
+    "Joe Blow\r\n"
+    "--AaB03x  \r\n"
+    "Content-Disposition: form-data; name=\"pics\"; filename=\"file1.txt\"\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+    "\r\n--AaB03\r--AaB0\r\n-\r\r\n\r\n"
+    "--AaB03x--\r\n"
+    "epilogue";
+  static const char expect[] =
+    "<field1|-|->Joe Blow</>"
+    "<pics|file1.txt|text/plain>\r\n--AaB03\r--AaB0\r\n-\r\r\n</>";
+  struct mg_multipart *mp;
+  struct multipart_log log;
+  size_t step, i;
+  int rv;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  ASSERT(mg_create_multipart_parser("text/plain; boundary=x", multipart_logger, &log) == NULL);
+  ASSERT(mg_create_multipart_parser("multipart/form-data", multipart_logger, &log) == NULL);
+  ASSERT(mg_create_multipart_parser("multipart/form-data; boundary=\"a\rb\"", multipart_logger, &log) == NULL);
+
+  // any slicing of the body produces the same result:
+  for (step = 1; step <= sizeof(body); step++) {
+    memset(&log, 0, sizeof(log));
+    mp = mg_create_multipart_parser("multipart/form-data; charset=utf-8; boundary=\"AaB03x\"",
+                                    multipart_logger, &log);
+    ASSERT(mp != NULL);
+    for (rv = 0, i = 0; rv == 0 && i < sizeof(body) - 1; i += step)
+      rv = mg_feed_multipart_parser(mp, body + i, MG_MIN(step, sizeof(body) - 1 - i));
+    ASSERT(rv == 1);
+    ASSERT_STREQ(log.buf, expect);
+    mg_destroy_multipart_parser(mp);
+  }
+
+  // the first boundary may start the body; parts may have no headers:
+  memset(&log, 0, sizeof(log));
+  mp = mg_create_multipart_parser("multipart/mixed; boundary=b", multipart_logger, &log);
+  ASSERT(mg_feed_multipart_parser(mp, "--b\r\n\r\nx\r\n--b--", 15) == 1);
+  ASSERT_STREQ(log.buf, "<-|-|->x</>");
+  mg_destroy_multipart_parser(mp);
+
+  // malformed bodies and aborts are reported:
+  memset(&log, 0, sizeof(log));
+  mp = mg_create_multipart_parser("multipart/mixed; boundary=b", multipart_logger, &log);
+  ASSERT(mg_feed_multipart_parser(mp, "--b\r\nx", 6) == 0);
+  ASSERT(mg_feed_multipart_parser(mp, "--bx", 4) == 0);
+  ASSERT(mg_feed_multipart_parser(mp, "\r\n\r\n--bx", 8) == -1);
+  mg_destroy_multipart_parser(mp);
+
+  memset(&log, 0, sizeof(log));
+  mp = mg_create_multipart_parser("multipart/mixed; boundary=b", multipart_logger, &log);
+  ASSERT(mg_feed_multipart_parser(mp, "--b\r\nContent-Disposition: x; name=abort\r\n\r\ndata", 47) == -1);
+  ASSERT_STREQ(log.buf, "<abort|-|->");
+  mg_destroy_multipart_parser(mp);
+}
+
+static void test_typed_options(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct mg_config cfg_fake = {0};
+  struct mg_connection conn;
+  char keep_alive[] = "Yes", linger[] = "7", index_files[] = "index.html,index.htm,default.htm";
+  const char *list;
+  struct vec v;
+  int pos, n;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  memset(&conn, 0, sizeof(conn));
+  conn.ctx = ctx;
+  ctx->cfg = &cfg_fake;
+  cfg_fake.config[ENABLE_KEEP_ALIVE] = keep_alive;
+  cfg_fake.config[SOCKET_LINGER_TIMEOUT] = linger;
+  cfg_fake.config[INDEX_FILES] = index_files;
+  ASSERT(set_typed_options(ctx, &cfg_fake));
+
+  ASSERT(get_conn_bool_option(&conn, ENABLE_KEEP_ALIVE) == 1);
+  ASSERT(get_conn_bool_option(&conn, ENABLE_DIRECTORY_LISTING) == 0);
+  ASSERT(get_conn_int_option(&conn, SOCKET_LINGER_TIMEOUT) == 7);
+  ASSERT(get_cfg_int_option(ctx, &cfg_fake, KEEP_ALIVE_TIMEOUT) == 0);
+
+  for (list = NULL, pos = n = 0; next_conn_list_item(&conn, INDEX_FILES, &list, &pos, &v); n++) {
+    ASSERT(v.len == (n == 0 ? 10 : n == 1 ? 9 : 11));
+  }
+  ASSERT(n == 3);
+  ASSERT(pos == 3);
+
+  // an empty allowed_methods option means: the default set
+  for (list = NULL, pos = n = 0; next_conn_list_item(&conn, ALLOWED_METHODS, &list, &pos, &v); n++)
+    ;
+  ASSERT(n == 6);
+
+  free(cfg_fake.typed.lists[INDEX_FILES]);
+  free(cfg_fake.typed.lists[ALLOWED_METHODS]);
+}
+
+static void init_fake_configs(struct mg_context *ctx) {
+  (void) pthread_mutex_init(&ctx->cfg_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->reload_mutex, NULL);
+  ctx->cfg = copy_config(NULL);
+  ASSERT(ctx->cfg != NULL);
+}
+
+static void free_fake_configs(struct mg_context *ctx) {
+  struct mg_config *cfg;
+
+  drop_vhost_configs(ctx, NULL);
+  free_config(ctx->cfg);
+  while ((cfg = ctx->retired_cfgs) != NULL) {
+    ctx->retired_cfgs = cfg->next_retired;
+    free_config(cfg);
+  }
+  (void) pthread_mutex_destroy(&ctx->cfg_mutex);
+  (void) pthread_mutex_destroy(&ctx->reload_mutex);
+}
+
+static void test_reload_options(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct mg_connection conn1, conn2;
+  struct mg_config *old_cfg;
+  const char *options1[] = { "document_root", "/new", "enable_keep_alive", "yes", NULL };
+  const char *options2[] = { "document_root", "/bad", "access_control_list", "+1.2.3.4/99", NULL };
+  const char *options3[] = { "no_such_option", "1", NULL };
+  const char *root;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  init_fake_configs(ctx);
+  ASSERT(set_config_value(ctx, ctx->cfg, DOCUMENT_ROOT, "/old"));
+  ASSERT(set_typed_options(ctx, ctx->cfg));
+  ASSERT(set_pattern_options(ctx, ctx->cfg));
+  old_cfg = ctx->cfg;
+
+  memset(&conn1, 0, sizeof(conn1));
+  memset(&conn2, 0, sizeof(conn2));
+  conn1.ctx = conn2.ctx = ctx;
+  bind_connection_config(&conn1);
+  ASSERT(conn1.cfg == old_cfg);
+  ASSERT(old_cfg->refcount == 1);
+  root = get_conn_option(&conn1, DOCUMENT_ROOT);
+  ASSERT_STREQ(root, "/old");
+
+  ASSERT(mg_reload_options(ctx, options1) == 0);
+  ASSERT(ctx->cfg != old_cfg);
+  ASSERT(ctx->retired_cfgs == old_cfg);
+  ASSERT(ctx->cfg->typed.valid);
+  ASSERT(ctx->cfg->typed.yes[ENABLE_KEEP_ALIVE]);
+
+  // the request in flight keeps its snapshot, a new request sees the new one
+  ASSERT(get_conn_option(&conn1, DOCUMENT_ROOT) == root);
+  ASSERT_STREQ(root, "/old");
+  ASSERT(get_conn_bool_option(&conn1, ENABLE_KEEP_ALIVE) == 0);
+  bind_connection_config(&conn2);
+  ASSERT_STREQ(get_conn_option(&conn2, DOCUMENT_ROOT), "/new");
+  ASSERT(get_conn_bool_option(&conn2, ENABLE_KEEP_ALIVE) == 1);
+  ASSERT_STREQ(get_option(ctx, DOCUMENT_ROOT), "/new");
+
+  // the next request of the first connection moves on to the new snapshot
+  bind_connection_config(&conn1);
+  ASSERT(conn1.cfg == ctx->cfg);
+  ASSERT(old_cfg->refcount == 0);
+  ASSERT(ctx->cfg->refcount == 2);
+
+  // invalid updates leave the configuration untouched
+  old_cfg = ctx->cfg;
+  ASSERT(mg_reload_options(ctx, options2) == -1);
+  ASSERT(mg_reload_options(ctx, options3) == -1);
+  ASSERT(ctx->cfg == old_cfg);
+  ASSERT_STREQ(get_option(ctx, DOCUMENT_ROOT), "/new");
+
+  root = mg_set_option(ctx, "r", "/set");
+  ASSERT_STREQ(root, "/set");
+  ASSERT(root == ctx->cfg->config[DOCUMENT_ROOT]);
+  ASSERT_STREQ(get_option(ctx, DOCUMENT_ROOT), "/set");
+  ASSERT(mg_set_option(ctx, "no_such_option", "1") == NULL);
+
+  release_connection_config(&conn1);
+  release_connection_config(&conn2);
+  ASSERT(conn1.cfg == NULL);
+  ASSERT(old_cfg->refcount == 0);
+
+  // a reference taken outside of a connection outlasts the grace period
+  old_cfg = acquire_config(ctx);
+  ASSERT(mg_reload_options(ctx, options1) == 0);
+  ASSERT(ctx->retired_cfgs == old_cfg);
+  old_cfg->retired -= MG_CONFIG_RETIRE_GRACE;
+  collect_retired_configs(ctx);
+  ASSERT(ctx->retired_cfgs == old_cfg);
+  ASSERT_STREQ(get_cfg_option(ctx, old_cfg, DOCUMENT_ROOT), "/set");
+  release_config(ctx, old_cfg);
+  collect_retired_configs(ctx);
+  ASSERT(ctx->retired_cfgs != old_cfg);
+
+  free_fake_configs(ctx);
+}
+
+static int vhost_option_get_calls;
+
+static const char *vhost_option_get(struct mg_context *ctx, struct mg_connection *conn, const char *name) {
+  const char *host;
+
+  (void) ctx;
+  vhost_option_get_calls++;
+  if (conn == NULL || strcmp(name, "document_root"))
+    return NULL;
+  host = mg_get_header(conn, "Host");
+  return (host != NULL && !strcmp(host, "docs.lan") ? "/docs" : NULL);
+}
+
+static void test_vhost_configs(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct mg_connection conn1, conn2, conn3;
+  char req1[] = "GET / HTTP/1.1\r\nHost: docs.lan\r\n\r\n";
+  char req2[] = "GET / HTTP/1.1\r\nHost: DOCS.lan\r\n\r\n";
+  char req3[] = "GET / HTTP/1.1\r\nHost: www.lan\r\n\r\n";
+  const char *options[] = { "enable_keep_alive", "yes", NULL };
+  struct mg_config *docs_cfg;
+  int calls;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  init_fake_configs(ctx);
+  ctx->user_functions.user_option_get = vhost_option_get;
+  ASSERT(set_config_value(ctx, ctx->cfg, DOCUMENT_ROOT, "/www"));
+  ASSERT(set_config_value(ctx, ctx->cfg, VHOST_CONFIG_CACHE, "yes"));
+  ASSERT(set_typed_options(ctx, ctx->cfg));
+  ASSERT(set_pattern_options(ctx, ctx->cfg));
+
+  memset(&conn1, 0, sizeof(conn1));
+  memset(&conn2, 0, sizeof(conn2));
+  memset(&conn3, 0, sizeof(conn3));
+  conn1.ctx = conn2.ctx = conn3.ctx = ctx;
+  ASSERT(parse_http_request(req1, &conn1.request_info) == 0);
+  ASSERT(parse_http_request(req2, &conn2.request_info) == 0);
+  ASSERT(parse_http_request(req3, &conn3.request_info) == 0);
+
+  // the first request for a host resolves its configuration...
+  bind_connection_config(&conn1);
+  bind_vhost_config(&conn1);
+  docs_cfg = conn1.cfg;
+  ASSERT(docs_cfg != ctx->cfg);
+  ASSERT(docs_cfg->is_vhost);
+  ASSERT(ctx->num_vhosts == 1);
+  ASSERT(ctx->cfg->refcount == 0);
+  ASSERT(docs_cfg->refcount == 2);
+
+  // ...after which lookups no longer go through the callback
+  calls = vhost_option_get_calls;
+  ASSERT_STREQ(get_conn_option(&conn1, DOCUMENT_ROOT), "/docs");
+  ASSERT_STREQ(mg_get_conn_option(&conn1, "document_root"), "/docs");
+  ASSERT(vhost_option_get_calls == calls);
+
+  // host names are case insensitive
+  bind_connection_config(&conn2);
+  bind_vhost_config(&conn2);
+  ASSERT(conn2.cfg == docs_cfg);
+  ASSERT(vhost_option_get_calls == calls);
+
+  bind_connection_config(&conn3);
+  bind_vhost_config(&conn3);
+  ASSERT(conn3.cfg->is_vhost);
+  ASSERT(ctx->num_vhosts == 2);
+  ASSERT_STREQ(get_conn_option(&conn3, DOCUMENT_ROOT), "/www");
+
+  // invalidation drops the cache entry, not the snapshot in use
+  mg_invalidate_vhost_configs(ctx, "Docs.lan");
+  ASSERT(ctx->num_vhosts == 1);
+  ASSERT(docs_cfg->refcount == 2);
+  ASSERT_STREQ(get_conn_option(&conn1, DOCUMENT_ROOT), "/docs");
+
+  // a reload drops them all
+  ASSERT(mg_reload_options(ctx, options) == 0);
+  ASSERT(ctx->num_vhosts == 0);
+  bind_connection_config(&conn1);
+  ASSERT(conn1.cfg == ctx->cfg);
+  ASSERT(docs_cfg->refcount == 1);
+
+  release_connection_config(&conn1);
+  release_connection_config(&conn2);
+  release_connection_config(&conn3);
+  free_fake_configs(ctx);
+}
+
+static void test_header_index(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct mg_connection conn;
+  char req1[] = "GET / HTTP/1.1\r\ncontent-length: 5\r\nX-A: 1\r\nConnection: close\r\nx-a: 2\r\n\r\n";
+  char req2[] = "GET / HTTP/1.1\r\nX-B: 1\r\nRange: bytes=0-\r\nX-C: 3\r\nHost: h\r\n\r\n";
+  const char *values[4];
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  memset(&conn, 0, sizeof(conn));
+  conn.ctx = ctx;
+  ASSERT(parse_http_request(req1, &conn.request_info) == 0);
+  ASSERT_STREQ(get_known_header(&conn, HDR_CONTENT_LENGTH), "5");
+  ASSERT_STREQ(get_known_header(&conn, HDR_CONNECTION), "close");
+  ASSERT(get_known_header(&conn, HDR_RANGE) == NULL);
+  ASSERT_STREQ(mg_get_header(&conn, "CONTENT-LENGTH"), "5");
+  ASSERT(mg_get_header(&conn, "X-B") == NULL);
+  ASSERT(mg_get_headers(values, 4, &conn, "X-A") == 2);
+  ASSERT_STREQ(values[0], "1");
+  ASSERT_STREQ(values[1], "2");
+
+  // same header count: the index must be explicitly invalidated
+  invalidate_header_index(&conn);
+  ASSERT(parse_http_request(req2, &conn.request_info) == 0);
+  ASSERT(get_known_header(&conn, HDR_CONTENT_LENGTH) == NULL);
+  ASSERT(get_known_header(&conn, HDR_CONNECTION) == NULL);
+  ASSERT_STREQ(get_known_header(&conn, HDR_RANGE), "bytes=0-");
+  ASSERT_STREQ(get_known_header(&conn, HDR_HOST), "h");
+  ASSERT_STREQ(mg_get_header(&conn, "x-c"), "3");
+  ASSERT(mg_get_header(&conn, "X-A") == NULL);
+}
+
+static void test_chunk_header_decoder(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  char buf[64];
+  int64_t size;
+  char *exts;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  strcpy(buf, "1a\r\ndata");
+  ASSERT(decode_buffered_chunk_header(buf, (int) strlen(buf), &size, &exts) == 4);
+  ASSERT(size == 26);
+  ASSERT_STREQ(exts, "");
+
+  strcpy(buf, "\r\nFf; name=val\r\nx");
+  ASSERT(decode_buffered_chunk_header(buf, (int) strlen(buf), &size, &exts) == 16);
+  ASSERT(size == 255);
+  ASSERT_STREQ(exts, "name=val");
+
+  // incomplete, last-chunk or non-standard: leave it to the full parser
+  strcpy(buf, "\r\n10\r");
+  ASSERT(decode_buffered_chunk_header(buf, (int) strlen(buf), &size, &exts) == 0);
+  ASSERT_STREQ(buf, "\r\n10\r");
+  strcpy(buf, "0\r\n\r\n");
+  ASSERT(decode_buffered_chunk_header(buf, (int) strlen(buf), &size, &exts) == 0);
+  strcpy(buf, " 10\r\n");
+  ASSERT(decode_buffered_chunk_header(buf, (int) strlen(buf), &size, &exts) == 0);
+  strcpy(buf, "ffffffffffffffffff\r\n");
+  ASSERT(decode_buffered_chunk_header(buf, (int) strlen(buf), &size, &exts) == 0);
+}
+
+// Chunked RX benchmark: drain a fully buffered body of small chunks through
+// mg_read() and report the CPU time per chunk. Needs no sockets or server.
+static void test_chunked_read_benchmark(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct mg_connection *conn;
+  int bufsiz = 256 * 1024;
+  int body_len = 0, total, n, i, runs;
+  long chunks = 0;
+  char *body, out[16384];
+  clock_t start;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  body = (char *) malloc(bufsiz);
+  ASSERT(body != NULL);
+  for (i = 0; body_len < bufsiz - 200; i++) {
+    int len = 1 + (i * 37) % 120;
+
+    body_len += sprintf(body + body_len, "%x\r\n", len);
+    memset(body + body_len, 'x', len);
+    body_len += len;
+    body_len += sprintf(body + body_len, "\r\n");
+    chunks++;
+  }
+  body_len += sprintf(body + body_len, "0\r\n\r\n");
+
+  conn = (struct mg_connection *) calloc(1, sizeof(*conn) + bufsiz * 2 + CHUNK_HEADER_BUFSIZ);
+  ASSERT(conn != NULL);
+  conn->buf = (char *) (conn + 1);
+  conn->ctx = ctx;
+  conn->client.sock = INVALID_SOCKET;
+
+  start = clock();
+  for (runs = 0; runs < 200; runs++) {
+    memcpy(conn->buf, body, body_len);
+    conn->buf_size = bufsiz;
+    conn->request_len = 0;
+    conn->rx_chunk_buf_size = bufsiz + CHUNK_HEADER_BUFSIZ;
+    conn->rx_buffer_loaded_len = body_len;
+    conn->rx_buffer_read_len = 0;
+    conn->content_len = -1;
+    conn->consumed_content = 0;
+    conn->rx_remaining_chunksize = 0;
+    conn->rx_chunk_header_parsed = 0;
+    conn->rx_chunk_count = 0;
+    mg_set_rx_mode(conn, MG_IOMODE_CHUNKED_DATA);
+    total = 0;
+    while ((n = mg_read(conn, out, sizeof(out))) > 0)
+      total += n;
+    ASSERT(conn->rx_chunk_count >= chunks);
+  }
+  printf("Chunked RX benchmark: %ld chunks, %d bytes per body: %.1f nsec CPU per chunk\n",
+         chunks, total, 1e9 * (clock() - start) / CLOCKS_PER_SEC / (runs * (double) chunks));
+
+  free(conn);
+  free(body);
+}
+
 static void test_match_prefix(void) {
   struct mg_context ctx_fake = {0};
   struct mg_context *ctx = &ctx_fake;
@@ -854,6 +1462,31 @@ static void test_match_prefix(void) {
   ASSERT(match_string("**.a$|**.b$", 11, "/a/b.b/") == -1);
   ASSERT(match_string("**.a$|**.b$", 11, "/a/b.b") == 6);
   ASSERT(match_string("**.a$|**.b$", 11, "/a/b.a") == 6);
+
+  // compiled patterns match exactly like ad-hoc ones:
+  {
+    static const char *patterns[] = {
+      "**.cgi$|**.pl$|**.php$", "/api|/api/**", "*/*", "/a/*.?s$|**/x$", "**$",
+      "?*?*?*?*?*?*?*?*?*?*?*?*?*?*$", "**a**a**a**a**a**a**b$", "", "x|"
+    };
+    static const char *strs[] = {
+      "", "/", "/a/b.cgi", "/x.php/y", "/api", "/api/v1/x", "/a/b.js",
+      "/a/c/x", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", "/abc/def/ghi/x"
+    };
+    struct mg_pattern *pat;
+    size_t i, j;
+
+    for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+      pat = compile_pattern(patterns[i]);
+      ASSERT(pat != NULL);
+      for (j = 0; j < ARRAY_SIZE(strs); j++)
+        ASSERT(match_pattern(pat, strs[j]) == match_string(patterns[i], -1, strs[j]));
+      free_pattern(pat);
+    }
+    // no exponential blowup on hostile input:
+    ASSERT(match_string("**a**a**a**a**a**a**a**a**a**a**a**a**b$", -1,
+                        "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa") == -1);
+  }
 }
 
 static void test_remove_double_dots() {
@@ -868,6 +1501,18 @@ static void test_remove_double_dots() {
     {"/\\", "/"},    /* as we have cross-platform code/storage, we do NOT accept the '/' as part of any filename, even in UNIX! */
     {"/a\\", "/a\\"},
   };
+  struct { const char *before, *after; } decoded[] = {
+    {"/a/b/c.html", "/a/b/c.html"},
+    {"/static/js/application.bundle.min.js", "/static/js/application.bundle.min.js"},
+    {"/a%20b/%7euser", "/a b/~user"},
+    {"/%2e%2e/etc", "//etc"},
+    {"/x/%2E./%2fy", "/x//y"},
+    {"/long/path/to/some/resource//with/double/slash", "/long/path/to/some/resource/with/double/slash"},
+    {"/long/path/to/some/resource/../../up", "/long/path/to/some/resource///up"},
+    {"/100%", "/100%"},
+    {"/%zz%4", "/%zz%4"},
+    {"/a%00b", "/a"},
+  };
   size_t i;
   struct mg_context ctx_fake = {0};
   struct mg_context *ctx = &ctx_fake;
@@ -876,9 +1521,18 @@ static void test_remove_double_dots() {
 
   for (i = 0; i < ARRAY_SIZE(data); i++) {
     //printf("[%s] -> [%s]\n", data[i].before, data[i].after);
-    remove_double_dots_and_double_slashes(data[i].before);
+    normalize_path(data[i].before, strlen(data[i].before), 0);
     ASSERT_STREQ(data[i].before, data[i].after);
   }
+
+  // decoding and normalization in a single pass:
+  for (i = 0; i < ARRAY_SIZE(decoded); i++) {
+    char buf[80];
+
+    strcpy(buf, decoded[i].before);
+    ASSERT(!normalize_path(buf, strlen(buf), 1) || !strcmp(decoded[i].before, decoded[i].after));
+    ASSERT_STREQ(buf, decoded[i].after);
+  }
 }
 
 static void test_IPaddr_parsing() {
@@ -968,11 +1622,365 @@ static void test_IPaddr_parsing() {
 
 
   // TODO: test these:
-  //  check_acl()
   //  parse_ipvX_addr_and_netmask()
 
 }
 
+static int acl_allows(const struct mg_acl *acl, const char *ip) {
+  char buf[SOCKADDR_NTOA_BUFSIZE];
+  struct usa usa;
+
+  mg_strlcpy(buf, ip, sizeof(buf));
+  if (!parse_ipvX_addr_string(buf, 0, &usa))
+    return -1;
+  return match_acl(acl, &usa);
+}
+
+static void test_acl(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct mg_acl *acl;
+  char buf[SOCKADDR_NTOA_BUFSIZE];
+  struct usa usa;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  ASSERT(compile_acl(ctx, "", &acl));
+  ASSERT(acl == NULL);
+  ASSERT(acl_allows(acl, "1.2.3.4") == 1);
+
+  ASSERT(compile_acl(ctx, "-0.0.0.0/0,+10.0.0.0/8,-10.1.0.0/16,+10.1.2.3", &acl));
+  ASSERT(acl_allows(acl, "10.5.5.5") == 1);
+  ASSERT(acl_allows(acl, "10.1.9.9") == 0);
+  ASSERT(acl_allows(acl, "10.1.2.3") == 1);
+  ASSERT(acl_allows(acl, "11.0.0.1") == 0);
+  ASSERT(acl_allows(acl, "192.168.0.1") == 0);
+  free(acl);
+
+  // the last matching entry wins, not the most specific one
+  ASSERT(compile_acl(ctx, "+10.1.2.3,-10.0.0.0/8", &acl));
+  ASSERT(acl_allows(acl, "10.1.2.3") == 0);
+  free(acl);
+  ASSERT(compile_acl(ctx, "+10.0.0.0/8,-10.0.0.0/8,+10.0.0.0/8", &acl));
+  ASSERT(acl_allows(acl, "10.9.8.7") == 1);
+  free(acl);
+
+  // any ACL denies by default; masks need not be byte aligned
+  ASSERT(compile_acl(ctx, "+172.16.0.0/12", &acl));
+  ASSERT(acl_allows(acl, "172.16.0.1") == 1);
+  ASSERT(acl_allows(acl, "172.31.255.255") == 1);
+  ASSERT(acl_allows(acl, "172.32.0.0") == 0);
+  ASSERT(acl_allows(acl, "127.0.0.1") == 0);
+  free(acl);
+
+  ASSERT(!compile_acl(ctx, "+1.2.3.4/33", &acl));
+  ASSERT(acl == NULL);
+  ASSERT(!compile_acl(ctx, "+1.2.3.4,+bogus", &acl));
+  ASSERT(acl == NULL);
+
+  mg_strlcpy(buf, "1.2.3.4", sizeof(buf));
+  ASSERT(parse_ipvX_addr_string(buf, 0, &usa));
+  ASSERT(check_acl(ctx, "-0.0.0.0/0,+1.2.3.4", &usa) == 1);
+  ASSERT(check_acl(ctx, "+1.2.3.0/24,-1.2.3.4", &usa) == 0);
+  ASSERT(check_acl(ctx, "+1.2.3.4/99", &usa) == -1);
+}
+
+static void test_mime_types(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct mg_config cfg_fake = {0}, vhost_cfg = {0};
+  struct mg_connection conn = {0};
+  char list[] = ".foo=text/x-foo,.HTML=application/x-html,.tar.gz=application/x-gtar,.foo=text/x-bar,kit=x/y";
+  char vhost_list[] = ".foo=text/x-vhost";
+  const char *ct;
+  struct vec vec;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  ctx->cfg = &cfg_fake;
+  cfg_fake.config[EXTRA_MIME_TYPES] = list;
+  cfg_fake.typed.valid = 1;
+  ASSERT(set_mime_option(ctx, &cfg_fake));
+  ASSERT(cfg_fake.mime != NULL);
+
+  ct = get_mime_type(ctx, NULL, "/a/b.Foo", "text/plain", &vec);
+  ASSERT_STREQ(ct, "text/x-foo; charset=utf-8");
+  ASSERT(vec.len == 10 && !memcmp(vec.ptr, "text/x-foo", 10));
+  // extra_mime_types override builtin_mime_types[]
+  ct = get_mime_type(ctx, NULL, "/index.html", "text/plain", &vec);
+  ASSERT_STREQ(ct, "application/x-html");
+  ct = get_mime_type(ctx, NULL, "/style.CSS", "text/plain", &vec);
+  ASSERT_STREQ(ct, "text/css; charset=utf-8");
+  ct = get_mime_type(ctx, NULL, "/x.tar.gz", "text/plain", &vec);
+  ASSERT_STREQ(ct, "application/x-gtar");
+  ct = get_mime_type(ctx, NULL, "/x.gz", "text/plain", &vec);
+  ASSERT_STREQ(ct, "application/x-gunzip");
+  // suffixes need not start with a dot
+  ct = get_mime_type(ctx, NULL, "/toolkit", "text/plain", &vec);
+  ASSERT_STREQ(ct, "x/y");
+  ct = get_mime_type(ctx, NULL, "/dir.foo/README", "text/plain", &vec);
+  ASSERT(ct == NULL);
+  ASSERT(vec.len == 10 && !memcmp(vec.ptr, "text/plain", 10));
+  ct = get_mime_type(ctx, NULL, "/noext.", NULL, &vec);
+  ASSERT(ct == NULL);
+  ASSERT(vec.ptr == NULL && vec.len == 0);
+
+  // a connection sees the table of the snapshot it is bound to
+  vhost_cfg.config[EXTRA_MIME_TYPES] = vhost_list;
+  vhost_cfg.typed.valid = 1;
+  vhost_cfg.is_vhost = 1;
+  ASSERT(set_mime_option(ctx, &vhost_cfg));
+  conn.ctx = ctx;
+  conn.cfg = &vhost_cfg;
+  ct = get_mime_type(ctx, &conn, "/a/b.foo", "text/plain", &vec);
+  ASSERT_STREQ(ct, "text/x-vhost; charset=utf-8");
+  ct = get_mime_type(ctx, &conn, "/x.tar.gz", "text/plain", &vec);
+  ASSERT_STREQ(ct, "application/x-gunzip");
+  conn.cfg = NULL;
+  ct = get_mime_type(ctx, &conn, "/a/b.foo", "text/plain", &vec);
+  ASSERT_STREQ(ct, "text/x-foo; charset=utf-8");
+
+  free(vhost_cfg.mime);
+  free(cfg_fake.mime);
+}
+
+static void test_uri_map(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct mg_uri_map *map;
+  const struct uri_map_rule *rule;
+  int match_len;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  map = compile_uri_map(ctx, "/a/b/**=/deep,/a/=/shallow,**.cgi$=/cgi,/x|/a/b=/alt", 1);
+  ASSERT(map != NULL);
+
+  // the first rule in list order wins, not the longest one
+  rule = match_uri_map(map, "/a/b/c", &match_len);
+  ASSERT(rule != NULL && rule->value.len == 5 && !memcmp(rule->value.ptr, "/deep", 5));
+  ASSERT(match_len == 6);
+  rule = match_uri_map(map, "/a/c", &match_len);
+  ASSERT(rule != NULL && rule->value.len == 8 && !memcmp(rule->value.ptr, "/shallow", 8));
+  ASSERT(match_len == 3);
+  // rules starting with a wildcard are tried for every URI
+  rule = match_uri_map(map, "/b/x.cgi", &match_len);
+  ASSERT(rule != NULL && rule->value.len == 4 && !memcmp(rule->value.ptr, "/cgi", 4));
+  ASSERT(match_len == 8);
+  rule = match_uri_map(map, "/x/y.cgi", &match_len);
+  ASSERT(rule != NULL && rule->value.len == 4 && !memcmp(rule->value.ptr, "/cgi", 4));
+  rule = match_uri_map(map, "/x/y", &match_len);
+  ASSERT(rule != NULL && rule->value.len == 4 && !memcmp(rule->value.ptr, "/alt", 4));
+  ASSERT(match_len == 2);
+  ASSERT(match_uri_map(map, "/b", &match_len) == NULL);
+  ASSERT(match_uri_map(map, "", &match_len) == NULL);
+  free_uri_map(map);
+
+  map = compile_uri_map(ctx, "", 1);
+  ASSERT(map != NULL);
+  ASSERT(match_uri_map(map, "/a", &match_len) == NULL);
+  free_uri_map(map);
+
+  // protect_uri: plain prefixes, which may contain pattern characters
+  map = compile_uri_map(ctx, "/a*=f1,/secret=f2,/secret/x=f3,=f4", 0);
+  ASSERT(map != NULL);
+  rule = match_uri_map(map, "/a*b", &match_len);
+  ASSERT(rule != NULL && rule->value.len == 2 && !memcmp(rule->value.ptr, "f1", 2));
+  ASSERT(match_len == 3);
+  rule = match_uri_map(map, "/secret/x/y", &match_len);
+  ASSERT(rule != NULL && rule->value.len == 2 && !memcmp(rule->value.ptr, "f2", 2));
+  ASSERT(match_len == 7);
+  // an empty prefix matches any URI
+  rule = match_uri_map(map, "/ab", &match_len);
+  ASSERT(rule != NULL && rule->value.len == 2 && !memcmp(rule->value.ptr, "f4", 2));
+  ASSERT(match_len == 0);
+  free_uri_map(map);
+
+  map = compile_uri_map(ctx, "/secret=f2", 0);
+  ASSERT(map != NULL);
+  ASSERT(match_uri_map(map, "/secre", &match_len) == NULL);
+  ASSERT(match_uri_map(map, "/public/secret", &match_len) == NULL);
+  ASSERT(match_uri_map(map, "/secrets", &match_len) != NULL);
+  free_uri_map(map);
+}
+
+static void test_passwords_file(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct mg_connection c;
+  struct mg_passwords *pw, *pw2;
+  const char *fname = "unit_test_htpasswd.tmp";
+  char ha1[33];
+  FILE *fp;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  (void) pthread_mutex_init(&ctx->passwords_mutex, NULL);
+  memset(&c, 0, sizeof(c));
+  c.ctx = ctx;
+  mg_remove(fname);
+  ASSERT(open_passwords(&c, fname) == NULL);
+
+  fp = fopen(fname, "w");
+  ASSERT(fp != NULL);
+  fprintf(fp, "alice:dom:0123\n"
+              "# comment\n"
+              ":dom:4567\n"
+              "alice:dom:89ab\n"
+              "bob:other:cdef  \r\n"
+              "carol:dom:\n"
+              "dave:dom:  fedc");
+  fclose(fp);
+  pw = open_passwords(&c, fname);
+  ASSERT(pw != NULL);
+  // the first line for a user wins
+  ASSERT_STREQ(find_password(pw, "alice", "dom"), "0123");
+  ASSERT_STREQ(find_password(pw, "bob", "other"), "cdef");
+  ASSERT_STREQ(find_password(pw, "dave", "dom"), "fedc");
+  ASSERT(find_password(pw, "bob", "dom") == NULL);
+  ASSERT(find_password(pw, "carol", "dom") == NULL);
+  ASSERT(find_password(pw, "", "dom") == NULL);
+  ASSERT(ctx->num_passwords_files == 1);
+
+  // a file changed within the same second is parsed again nevertheless
+  ASSERT(mg_modify_passwords_file(fname, "dom", "alice", "secret"));
+  pw2 = open_passwords(&c, fname);
+  ASSERT(pw2 != NULL && pw2 != pw);
+  mg_md5(ha1, "alice", ":", "dom", ":", "secret", NULL);
+  ASSERT_STREQ(find_password(pw2, "alice", "dom"), ha1);
+  // the replaced table lives on until released
+  ASSERT_STREQ(find_password(pw, "alice", "dom"), "0123");
+  ASSERT(ctx->num_passwords_files == 1);
+  release_passwords(ctx, pw);
+  release_passwords(ctx, pw2);
+
+  mg_remove(fname);
+  free_passwords_files(ctx);
+  ASSERT(ctx->num_passwords_files == 0);
+  (void) pthread_mutex_destroy(&ctx->passwords_mutex);
+}
+
+static void test_auth_nonces(void) {
+  struct mg_context *ctx = (struct mg_context *) calloc(1, sizeof(*ctx));
+  char nonce[32], nonce2[32], nonce3[32], nonce4[32];
+  unsigned long seq;
+  int i;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  (void) pthread_mutex_init(&ctx->nonce_mutex, NULL);
+  new_nonce(ctx, nonce, sizeof(nonce), 0, 1);
+  new_nonce(ctx, nonce2, sizeof(nonce2), 0, 2);
+  ASSERT(strcmp(nonce, nonce2) != 0);
+
+  ASSERT(check_nonce(ctx, nonce, "00000001"));
+  ASSERT(check_nonce(ctx, nonce, "00000002"));
+  // replays are rejected
+  ASSERT(!check_nonce(ctx, nonce, "00000002"));
+  ASSERT(!check_nonce(ctx, nonce, "00000001"));
+  ASSERT(!check_nonce(ctx, nonce, "00000000"));
+  // nonce counts may arrive out of order
+  ASSERT(check_nonce(ctx, nonce, "00000005"));
+  ASSERT(check_nonce(ctx, nonce, "00000003"));
+  ASSERT(!check_nonce(ctx, nonce, "00000003"));
+  ASSERT(check_nonce(ctx, nonce, "00000004"));
+  ASSERT(check_nonce(ctx, nonce, "000000ff"));
+  ASSERT(!check_nonce(ctx, nonce, "00000006"));
+  ASSERT(check_nonce(ctx, nonce2, "00000001"));
+
+  // unknown and malformed nonces
+  ASSERT(!check_nonce(ctx, "1291376417", "00000001"));
+  ASSERT(!check_nonce(ctx, "", "00000001"));
+  ASSERT(!check_nonce(ctx, nonce, ""));
+  ASSERT(!check_nonce(ctx, nonce, "xyz"));
+
+  // expired nonces
+  ctx->nonces[ctx->nonce_seq % MG_MAX_AUTH_NONCES].issued -= MG_AUTH_NONCE_TIMEOUT + 1;
+  ASSERT(!check_nonce(ctx, nonce2, "00000002"));
+
+  // an outstanding nonce is handed out again; an expired one is not
+  ASSERT(lookup_nonce(ctx, nonce) == 1);
+  ASSERT(lookup_nonce(ctx, nonce2) == 0);
+  new_nonce(ctx, nonce3, sizeof(nonce3), lookup_nonce(ctx, nonce), 3);
+  ASSERT(strcmp(nonce3, nonce) == 0);
+  new_nonce(ctx, nonce3, sizeof(nonce3), 2, 3);
+  ASSERT(strcmp(nonce3, nonce2) != 0);
+  ASSERT(check_nonce(ctx, nonce3, "00000001"));
+
+  // a flurry of 401s to one client hands it the same nonce again and
+  // cannot evict the nonces of the others
+  seq = ctx->nonce_seq;
+  new_nonce(ctx, nonce2, sizeof(nonce2), 0, 4);
+  for (i = 0; i < 2 * MG_MAX_AUTH_NONCES; i++) {
+    new_nonce(ctx, nonce4, sizeof(nonce4), 0, 4);
+    ASSERT(strcmp(nonce4, nonce2) == 0);
+  }
+  ASSERT(ctx->nonce_seq == seq + 1);
+  ASSERT(check_nonce(ctx, nonce, "00000100"));
+  ASSERT(check_nonce(ctx, nonce3, "00000002"));
+  ASSERT(check_nonce(ctx, nonce2, "00000001"));
+
+  // other clients get nonces of their own, so their nonce counts don't collide
+  new_nonce(ctx, nonce4, sizeof(nonce4), 0, 5);
+  ASSERT(strcmp(nonce4, nonce2) != 0);
+  ASSERT(check_nonce(ctx, nonce4, "00000001"));
+
+  // the client gets a fresh nonce after MG_AUTH_NONCE_MIN_AGE, and at once
+  // when it is not rate-limited
+  ctx->nonces[lookup_nonce(ctx, nonce2) % MG_MAX_AUTH_NONCES].issued -= MG_AUTH_NONCE_MIN_AGE;
+  new_nonce(ctx, nonce4, sizeof(nonce4), 0, 4);
+  ASSERT(strcmp(nonce4, nonce2) != 0);
+  new_nonce(ctx, nonce2, sizeof(nonce2), 0, 0);
+  ASSERT(strcmp(nonce4, nonce2) != 0);
+
+  // nonces are forgotten when their slot is reused
+  for (i = 0; i < MG_MAX_AUTH_NONCES; i++)
+    new_nonce(ctx, nonce2, sizeof(nonce2), 0, 0);
+  ASSERT(!check_nonce(ctx, nonce, "00000101"));
+  ASSERT(check_nonce(ctx, nonce2, "00000001"));
+
+  (void) pthread_mutex_destroy(&ctx->nonce_mutex);
+  free(ctx);
+}
+
+#if !defined(NO_SSL) && !defined(NO_SSL_DL) && !defined(_WIN32)
+static void test_ssl_dll_loading(void) {
+  struct mg_context ctx_fake = {0};
+  struct mg_context *ctx = &ctx_fake;
+  struct ssl_func found_sw[] = {{"strlen", NULL}, {"memcpy", NULL}, {NULL, NULL}};
+  struct ssl_func partial_sw[] = {{"strlen", NULL}, {"mg_no_such_function", NULL}, {NULL, NULL}};
+  void (*modern)(void) = ssl_modern_sw[0].ptr;
+  void (*v3)(void) = ssl_v3_sw[0].ptr;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  // NULL: look in the program and the libraries it has loaded
+  ASSERT(load_dll(ctx, NULL, found_sw, 0) == 1);
+  ASSERT(found_sw[0].ptr != NULL && found_sw[1].ptr != NULL);
+  // an optional table is loaded all or nothing, and quietly
+  ASSERT(load_dll(ctx, NULL, partial_sw, 1) == 0);
+  ASSERT(partial_sw[0].ptr == NULL && partial_sw[1].ptr == NULL);
+  partial_sw[1].ptr = found_sw[1].ptr;
+  ASSERT(load_dll(ctx, NULL, partial_sw, 1) == 0);
+  ASSERT(partial_sw[0].ptr == NULL && partial_sw[1].ptr == NULL);
+  ASSERT(load_dll(ctx, NULL, found_sw, 1) == 1);
+  // a required table fails loudly
+  ASSERT(load_dll(ctx, NULL, partial_sw, 0) == 0);
+  ASSERT(partial_sw[1].ptr == NULL);
+
+  // the OpenSSL flavour follows from the optional tables which were found
+  ssl_modern_sw[0].ptr = NULL;
+  ssl_v3_sw[0].ptr = NULL;
+  ASSERT(is_legacy_openssl() && !is_openssl_3());
+  ssl_modern_sw[0].ptr = found_sw[0].ptr;
+  ASSERT(!is_legacy_openssl() && !is_openssl_3());
+  ssl_v3_sw[0].ptr = found_sw[0].ptr;
+  ASSERT(!is_legacy_openssl() && is_openssl_3());
+  ssl_modern_sw[0].ptr = modern;
+  ssl_v3_sw[0].ptr = v3;
+}
+#endif
+
 static void test_logpath_fmt() {
   char *uri_input[] = {
     "http://example.com/Oops.I.did.it.again....yeah....yeah....yeah....errr....ohhhhh....you shouldn't have.... Now let's see whether this bugger does da right thang for long URLs when we wanna have them as part of the logpath..........",
@@ -1163,7 +2171,7 @@ static void test_header_processing()
   c.ctx = ctx;
 
   strcpy(buf, input);
-  rv = get_request_len(buf, (int)strlen(buf));
+  rv = request_len(buf, (int)strlen(buf));
   ASSERT(rv > 0 && rv < (int)strlen(buf));
   ASSERT(strstr(buf + rv, "<HTML><HEAD>") == buf + rv);
   buf[rv] = 0;
@@ -1174,7 +2182,7 @@ static void test_header_processing()
   ASSERT(c.request_info.num_headers == -1);
 
   strcpy(buf, input);
-  rv = get_request_len(buf, (int)strlen(buf));
+  rv = request_len(buf, (int)strlen(buf));
   ASSERT(rv > 0 && rv < (int)strlen(buf));
   ASSERT(strstr(buf + rv, "<HTML><HEAD>") == buf + rv);
   buf[rv] = 0;
@@ -1610,6 +2618,105 @@ static void test_mg_fetch(void) {
   mg_stop(ctx);
 }
 
+static void test_queued_handshake_limit(void) {
+  struct mg_context *ctx = (struct mg_context *) calloc(1, sizeof(*ctx));
+  struct mg_connection conn = {0}, popped;
+  int i, n, set;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  ctx->sq_head = -1;
+  for (i = 0; i < (int) ARRAY_SIZE(ctx->queue_store) - 1; i++)
+    ctx->queue_store[i].next = i + 1;
+  ctx->queue_store[ARRAY_SIZE(ctx->queue_store) - 1].next = -1;
+
+  // TLS connections in their handshake beyond the limit expire the oldest
+  conn.client.is_ssl = 1;
+  for (i = 0; i < MG_MAX_QUEUED_HANDSHAKES + 16; i++) {
+    conn.birth_time = 1000 + i;
+    ASSERT(push_conn_onto_idle_queue(ctx, &conn) >= 0);
+    ASSERT(ctx->num_queued_handshakes == (i < MG_MAX_QUEUED_HANDSHAKES ? i + 1 : MG_MAX_QUEUED_HANDSHAKES));
+    if (i == 1) {
+      // the ones a worker has pulled for testing don't count until returned
+      set = pull_testset_from_idle_queue(ctx, FD_SETSIZE);
+      ASSERT(ctx->num_queued_handshakes == 0);
+      insert_testset_into_idle_queue(ctx, set);
+      ASSERT(ctx->num_queued_handshakes == 2);
+    }
+  }
+  // established connections don't count
+  conn.is_inited = 1;
+  conn.birth_time = 0;
+  ASSERT(push_conn_onto_idle_queue(ctx, &conn) >= 0);
+  ASSERT(ctx->num_queued_handshakes == MG_MAX_QUEUED_HANDSHAKES);
+
+  for (i = n = 0; ctx->sq_head >= 0; i++) {
+    ctx->sq_head = pop_node_from_idle_queue(ctx, ctx->sq_head, &popped);
+    if (popped.birth_time == 0)
+      ASSERT(!popped.client.idle_time_expired);
+    else if (popped.birth_time < 1000 + 16)
+      ASSERT(popped.client.idle_time_expired);
+    else
+      ASSERT(!popped.client.idle_time_expired);
+    n += popped.client.idle_time_expired;
+  }
+  ASSERT(i == MG_MAX_QUEUED_HANDSHAKES + 17);
+  ASSERT(n == 16);
+  ASSERT(ctx->num_queued_handshakes == 0);
+
+  free(ctx);
+}
+
+#if !defined(NO_SSL)
+// Clients which stall in the middle of their TLS handshake, more than the
+// idle queue can hold, must not keep the server from accepting others.
+static void test_stalled_tls_handshakes(void) {
+  static const char *options[] = {
+    "listening_ports", "33798s",
+    "ssl_certificate", "examples/ssl_cert.pem",
+    "num_threads", "2",
+    "keep_alive_timeout", "30",
+    NULL,
+  };
+  struct mg_user_class_t ucb = {
+    NULL,
+    fetch_callback
+  };
+  const char *tmp_file = "temporary_file_name_for_unit_test.txt";
+  struct mg_connection *stalled[160];
+  struct mg_context *ctx;
+  time_t start;
+  FILE *fp;
+  int i;
+
+  printf("=== TEST: %s ===\n", __func__);
+
+  ASSERT((ctx = mg_start(&ucb, options)) != NULL);
+  // half of them send the start of a ClientHello, the others nothing at all
+  for (i = 0; i < (int) ARRAY_SIZE(stalled); i++) {
+    stalled[i] = mg_connect(ctx, "localhost", 33798, MG_CONNECT_BASIC);
+    ASSERT(stalled[i] != NULL);
+    if (i % 2)
+      ASSERT(mg_write(stalled[i], "\x16\x03\x01", 3) == 3);
+  }
+  // make sure the fetch below is accepted after all of them (birth_time
+  // has a resolution of one second)
+  mg_sleep(1100);
+
+  start = time(NULL);
+  fp = mg_fetch(ctx, "https://localhost:33798/data", tmp_file, NULL);
+  ASSERT(fp != NULL);
+  ASSERT(time(NULL) - start < 5);
+  if (fp != NULL)
+    fclose(fp);
+
+  for (i = 0; i < (int) ARRAY_SIZE(stalled); i++)
+    mg_close_connection(stalled[i]);
+  mg_remove(tmp_file);
+  mg_stop(ctx);
+}
+#endif
+
 
 
 static int test_client_connect_expect_error = 0;
@@ -2932,12 +4039,31 @@ int main(void) {
   test_match_prefix();
   test_remove_double_dots();
   test_IPaddr_parsing();
+  test_acl();
+  test_mime_types();
+  test_uri_map();
+  test_passwords_file();
+  test_auth_nonces();
+#if !defined(NO_SSL) && !defined(NO_SSL_DL) && !defined(_WIN32)
+  test_ssl_dll_loading();
+#endif
   test_logpath_fmt();
   test_http_hdr_value_unquoting();
   test_token_value_extractor();
   test_http_header_extractor();
   test_header_processing();
   test_should_keep_alive();
+  test_accept_encoding();
+  test_request_len();
+  test_header_index();
+  test_form_vars();
+  test_multipart();
+  test_typed_options();
+  test_reload_options();
+  test_vhost_configs();
+  test_queued_handshake_limit();
+  test_chunk_header_decoder();
+  test_chunked_read_benchmark();
   test_parse_http_request();
   test_response_header_rw();
 
@@ -2951,6 +4077,9 @@ int main(void) {
   test_client_connect();
   test_local_client_connect();
   test_mg_fetch();
+#if !defined(NO_SSL)
+  test_stalled_tls_handshakes();
+#endif
 
   /*
   semi-random testing of the chunked transfer I/O logic: the edge cases are easily seen